@@ -2,28 +2,93 @@
 // Implements low-level file system functionality that interfaces with
 // the disk.
 
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include <ctime>
+#include <cstring>
+using namespace std;
+
 #include "Disk.h"
+#include "RamDisk.h"
 #include "Blocks.h"
 #include "BasicFileSys.h"
+#include "Crc32c.h"
+#include "Latency.h"
+
+BasicFileSys::BasicFileSys() : dedup(false), verify(true), disk(NULL), corrupt(false), frees(),
+  indexed()
+{
+}
 
 // Mounts the simulated disk file. If a disk file is created, this
 // routines also "formats" the disk by initializing special blocks
 // 0 (superblock) and 1 (root directory).
-void BasicFileSys::mount()
+void BasicFileSys::mount(const char *file_name, bool in_memory)
 {
   // mount the disk
-  bool new_disk = disk.mount("DISK");
+  if (in_memory) disk = new RamDisk;
+  else disk = new Disk;
+  bool new_disk = disk->mount(file_name);
+
+  // a new disk needs formatting, an existing one must have a layout
+  // this program understands
+  if (new_disk) format();
+  else check_format(file_name);
+
+  // a new disk gets an empty reference count table
+  if (disk->num_blocks() < REFCOUNT_START + REFCOUNT_BLOCKS) {
+    struct refcount_block_t table[REFCOUNT_BLOCKS];
+    memset(table, 0, sizeof table);
+    disk->write_blocks(REFCOUNT_START, REFCOUNT_BLOCKS, table);
+  }
+
+  // open the journal, finishing any commands a crash interrupted
+  journal.mount(disk);
+  journal.ship_to(&changes);
+
+  // disks made before snapshots get an empty snapshot directory, once
+  // the checksums and index its writes keep up to date are loaded
+  bool before_snapshots = disk->num_blocks() < SNAPSHOT_BLOCK + 1;
+  load_checksums();
+  load_index();
+  if (before_snapshots) {
+    thaw(1);
+    struct dirblock_t snapshots;
+    memset(&snapshots, 0, sizeof snapshots);
+    snapshots.magic = DIR_MAGIC_NUM;
+    store(SNAPSHOT_BLOCK, (void *) &snapshots);
+  }
+
+  // record the layout last, as the checks above go by the disk's size
+  if (disk->num_blocks() < FORMAT_BLOCK + 1) {
+    struct formatblock_t format;
+    memset(&format, 0, sizeof format);
+    format.magic = FORMAT_MAGIC_NUM;
+    format.version = FORMAT_VERSION;
+    disk->write_block(FORMAT_BLOCK, (void *) &format);
+  }
 
-  // if the disk exists, return as no further initialization is needed
-  if (!new_disk) return;
+  server_stats.add_cache(&dentries.stats);
+  count_free();
+  count_inodes();
+
+  // start generations at a random point, as ext4 does, so handles from
+  // before a remount are unlikely to match a reused inode
+  next_generation = random_device()() ^ (unsigned int) time(NULL);
+}
 
+// Formats a new disk by initializing special blocks 0 (superblock) and
+// 1 (root directory) and zeroing all others.
+void BasicFileSys::format()
+{
   // initialize the superblock
   struct superblock_t super_block;
   super_block.bitmap[0] = 0x3;		// mark blocks 0 and 1 as used
   for (int i = 1; i < BLOCK_SIZE; i++) {
     super_block.bitmap[i] = 0;
   }
-  disk.write_block(0, (void *) &super_block);
+  disk->write_block(0, (void *) &super_block);
 
   // initialize the root directory
   struct dirblock_t dir_block;
@@ -32,7 +97,7 @@ void BasicFileSys::mount()
   for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
     dir_block.dir_entries[i].block_num = 0;
   }
-  disk.write_block(1, (void *) &dir_block);
+  disk->write_block(1, (void *) &dir_block);
 
   // write a zeroed-out data block to all other blocks on disk
   struct datablock_t data_block;
@@ -40,14 +105,194 @@ void BasicFileSys::mount()
     data_block.data[i] = 0;
   }
   for (int i = 2; i < NUM_BLOCKS; i++) {
-    disk.write_block(i, (void *) &data_block);
+    disk->write_block(i, (void *) &data_block);
+  }
+}
+
+// Exits unless the disk's layout is the current one or one mount migrates.
+void BasicFileSys::check_format(const char *file_name)
+{
+  if (disk->num_blocks() >= FORMAT_BLOCK + 1) {
+    struct formatblock_t format;
+    disk->read_block(FORMAT_BLOCK, (void *) &format);
+    if (format.magic == FORMAT_MAGIC_NUM && format.version == FORMAT_VERSION) return;
+    if (format.magic == FORMAT_MAGIC_NUM) {
+      cerr << file_name << ": disk has format version " << format.version
+           << ", this program reads version " << FORMAT_VERSION << endl;
+    }
+    else {
+      cerr << file_name << ": disk has no valid format block" << endl;
+    }
+    exit(-1);
+  }
+
+  // Disks made before the format block have the current inode layout
+  // only if they have reference counts, which came after inodes gained
+  // generations; older inodes would be misread.
+  if (disk->num_blocks() < REFCOUNT_START + REFCOUNT_BLOCKS) {
+    cerr << file_name << ": disk predates reference counts and has an older "
+         << "inode layout; it cannot be mounted" << endl;
+    exit(-1);
+  }
+}
+
+// Reads the checksum table.
+void BasicFileSys::load_checksums()
+{
+  checksums.assign(CHECKSUM_BLOCKS * CHECKSUMS_PER_BLOCK, 0);
+  if (disk->num_blocks() >= CHECKSUM_START + CHECKSUM_BLOCKS) {
+    for (int i = 0; i < CHECKSUM_BLOCKS; i++) {
+      disk->read_block(CHECKSUM_START + i, (void *) &checksums[i * CHECKSUMS_PER_BLOCK]);
+    }
+    return;
+  }
+
+  // disks made before checksums get a table of the blocks as they are
+  struct datablock_t block;
+  for (int i = 0; i < CHECKED_BLOCKS; i++) {
+    int b = checked_block(i);
+    if (b >= disk->num_blocks()) continue;
+    disk->read_block(b, (void *) &block);
+    checksums[i] = crc32c(0, &block, BLOCK_SIZE);
+  }
+  disk->write_blocks(CHECKSUM_START, CHECKSUM_BLOCKS, &checksums[0]);
+}
+
+// Reads the deduplication bitmap and indexes the blocks it marks.
+void BasicFileSys::load_index()
+{
+  // disks made before deduplication get an empty bitmap
+  if (disk->num_blocks() < DEDUP_BLOCK + 1) {
+    memset(&indexed, 0, sizeof indexed);
+    store(DEDUP_BLOCK, (void *) &indexed);
+  }
+  else {
+    fetch(DEDUP_BLOCK, (void *) &indexed);
+  }
+
+  server_stats.dedup_indexed.fetch_sub(fingerprints.size(), memory_order_relaxed);
+  fingerprints.clear();
+  for (short b = 0; b < NUM_BLOCKS; b++) {
+    if (indexed.bitmap[b / 8] & (1 << (b % 8))) fingerprints.insert(make_pair(checksums[b], b));
+  }
+  server_stats.dedup_indexed.fetch_add(fingerprints.size(), memory_order_relaxed);
+}
+
+// Reads a block through the journal, checking it against its checksum if
+// it came from the disk.
+void BasicFileSys::fetch(short block_num, void *block)
+{
+  if (journal.read(block_num, block)) return;
+  disk->read_block(block_num, block);
+  int i = checksum_index(block_num);
+  if (!verify || i < 0 || checksums.empty()) return;
+
+  long long start = now_ns();
+  bool good = crc32c(0, block, BLOCK_SIZE) == checksums[i];
+  server_stats.checksum_verified.fetch_add(1, memory_order_relaxed);
+  server_stats.checksum_verify_ns.fetch_add(now_ns() - start, memory_order_relaxed);
+  if (!good) {
+    server_stats.checksum_failures.fetch_add(1, memory_order_relaxed);
+    cerr << "Block " << block_num << ": contents do not match the checksum" << endl;
+    corrupt = true;
+  }
+}
+
+// Writes a block through the journal, and its checksum with it.
+void BasicFileSys::store(short block_num, const void *block)
+{
+  if (!journal.write(block_num, block)) disk->write_block(block_num, (void *) block);
+  int i = checksum_index(block_num);
+  if (i < 0 || checksums.empty()) return;
+
+  long long start = now_ns();
+  checksums[i] = crc32c(0, block, BLOCK_SIZE);
+  server_stats.checksum_updated.fetch_add(1, memory_order_relaxed);
+  server_stats.checksum_update_ns.fetch_add(now_ns() - start, memory_order_relaxed);
+  short table_num = CHECKSUM_START + i / CHECKSUMS_PER_BLOCK;
+  void *table = &checksums[i - i % CHECKSUMS_PER_BLOCK];
+  if (!journal.write(table_num, table)) disk->write_block(table_num, table);
+}
+
+// Counts the free blocks in the bitmap.
+void BasicFileSys::count_free()
+{
+  struct superblock_t super_block;
+  read_block(0, (void *) &super_block);
+  int used = 0;
+  for (int byte = 0; byte < BLOCK_SIZE; byte++) {
+    used += __builtin_popcount(super_block.bitmap[byte]);
+  }
+  free_blocks = NUM_BLOCKS - used;
+}
+
+// Counts the root and every file and directory below it and the snapshots.
+void BasicFileSys::count_inodes()
+{
+  inodes = 1 + count_below(1) + count_below(SNAPSHOT_BLOCK);
+}
+
+// Number of files and directories below dir.
+int BasicFileSys::count_below(short dir)
+{
+  struct dirblock_t dir_block;
+  read_block(dir, (void *) &dir_block);
+  int count = dir_block.num_entries;
+  for (unsigned int i = 0; i < dir_block.num_entries; i++) {
+    struct inode_t inode;
+    short block = dir_block.dir_entries[i].block_num;
+    read_block(block, (void *) &inode);
+    if (inode.magic == DIR_MAGIC_NUM) count += count_below(block);
+  }
+  return count;
+}
+
+// Clears the SNAPSHOT_GENERATION bit of every inode below dir, which
+// only snapshots may have.
+void BasicFileSys::thaw(short dir)
+{
+  struct dirblock_t dir_block;
+  read_block(dir, (void *) &dir_block);
+  for (unsigned int i = 0; i < dir_block.num_entries; i++) {
+    struct inode_t inode;
+    short block = dir_block.dir_entries[i].block_num;
+    read_block(block, (void *) &inode);
+    if (inode.magic == DIR_MAGIC_NUM) {
+      thaw(block);
+    }
+    else if (inode.generation & SNAPSHOT_GENERATION) {
+      inode.generation &= ~SNAPSHOT_GENERATION;
+      write_block(block, (void *) &inode);
+    }
   }
 }
 
 // Unmounts the disk
 void BasicFileSys::unmount()
 {
-  disk.unmount();
+  server_stats.remove_cache(&dentries.stats);
+  lock_guard<mutex> guard(saving);
+  journal.unmount();
+  disk->unmount();
+  delete disk;
+  disk = NULL;
+  server_stats.dedup_indexed.fetch_sub(fingerprints.size(), memory_order_relaxed);
+  fingerprints.clear();
+}
+
+// Writes a consistent image of a disk kept in memory to its file.
+void BasicFileSys::save()
+{
+  // the disk stays until the save is done, as unmount waits for saving
+  lock();
+  lock_guard<mutex> guard(saving);
+  if (!disk) {
+    unlock();
+    return;
+  }
+  disk->take_image();
+  unlock();
+  disk->save_image();
 }
 
 // Gets a free block from the disk.
@@ -55,7 +300,7 @@ short BasicFileSys::get_free_block()
 {
   // get superblock
   struct superblock_t super_block;
-  disk.read_block(0, (void *) &super_block);
+  read_block(0, (void *) &super_block);
   
   // look for first available block
   for (int byte = 0; byte < BLOCK_SIZE; byte++) {
@@ -71,7 +316,8 @@ short BasicFileSys::get_free_block()
 				  // Available block is found: set bit in bitmap, write result back
 			  // to superblock, and return block number.
 			  super_block.bitmap[byte] |= mask;
-			  disk.write_block(0, (void *) &super_block);
+			  write_block(0, (void *) &super_block);
+			  free_blocks--;
 			  return (byte * 8) + bit;
 			}
       }
@@ -84,27 +330,242 @@ short BasicFileSys::get_free_block()
   
 // Reclaims block making it available for future use.
 void BasicFileSys::reclaim_block(short block_num)
+{
+  reclaim_blocks(&block_num, 1);
+}
+
+// Reclaims count blocks with one update of the bitmap.
+void BasicFileSys::reclaim_blocks(const short *blocks, int count)
 {
   // get superblock
   struct superblock_t super_block;
-  disk.read_block(0, (void *) &super_block);
+  read_block(0, (void *) &super_block);
+  bool unindexed = false;
+
+  for (int i = 0; i < count; i++) {
+    // a shared block stays allocated for the other files
+    if (adjust_refs(blocks[i], 0) > 0) {
+      adjust_refs(blocks[i], -1);
+      continue;
+    }
 
-  // clear bit
-  int byte = block_num / 8;		// byte number
-  int bit = block_num % 8;		// bit number
-  unsigned char mask = ~(1 << bit);	// mask to clear bit
-  super_block.bitmap[byte] &= mask;
+    // a freed block can no longer be shared
+    if (unindex(blocks[i])) unindexed = true;
+
+    // clear bit
+    int byte = blocks[i] / 8;		// byte number
+    int bit = blocks[i] % 8;		// bit number
+    unsigned char mask = ~(1 << bit);	// mask to clear bit
+    if (super_block.bitmap[byte] & ~mask) {
+      free_blocks++;
+      frees[blocks[i]]++;
+    }
+    super_block.bitmap[byte] &= mask;
+  }
 
   // write back superblock
-  disk.write_block(0, (void *) &super_block);
+  write_block(0, (void *) &super_block);
+  if (unindexed) store(DEDUP_BLOCK, (void *) &indexed);
 }
   
+// Adds a reference to a data block.
+void BasicFileSys::share_block(short block_num)
+{
+  adjust_refs(block_num, 1);
+}
+
+// True if more than one file refers to block_num.
+bool BasicFileSys::is_shared(short block_num)
+{
+  return adjust_refs(block_num, 0) > 0;
+}
+
+// Looks up a full data block by fingerprint, sharing a block with the
+// same contents if there is one.
+short BasicFileSys::find_duplicate(const void *block)
+{
+  if (!dedup) return 0;
+  long long start = now_ns();
+  unsigned int fingerprint = crc32c(0, block, BLOCK_SIZE);
+  server_stats.dedup_lookups.fetch_add(1, memory_order_relaxed);
+
+  // blocks with the same checksum are compared, since CRCs collide
+  short found = 0;
+  auto range = fingerprints.equal_range(fingerprint);
+  for (auto it = range.first; it != range.second && !found; it++) {
+    struct datablock_t other;
+    read_block(it->second, (void *) &other);
+    if (memcmp(&other, block, BLOCK_SIZE) == 0) found = it->second;
+    else server_stats.dedup_collisions.fetch_add(1, memory_order_relaxed);
+  }
+  if (found) {
+    adjust_refs(found, 1);
+    server_stats.dedup_hits.fetch_add(1, memory_order_relaxed);
+  }
+  server_stats.dedup_ns.fetch_add(now_ns() - start, memory_order_relaxed);
+  return found;
+}
+
+// Drops block_num from the fingerprint index, if it is there, leaving the
+// bitmap block for the caller to write.
+bool BasicFileSys::unindex(short block_num)
+{
+  unsigned char mask = 1 << (block_num % 8);
+  if (!(indexed.bitmap[block_num / 8] & mask)) return false;
+  indexed.bitmap[block_num / 8] &= ~mask;
+  auto range = fingerprints.equal_range(checksums[block_num]);
+  for (auto it = range.first; it != range.second; it++) {
+    if (it->second == block_num) {
+      fingerprints.erase(it);
+      server_stats.dedup_indexed.fetch_sub(1, memory_order_relaxed);
+      break;
+    }
+  }
+  return true;
+}
+
+// Marks block_num as holding a full data block that may be shared.
+void BasicFileSys::index_block(short block_num)
+{
+  unsigned char mask = 1 << (block_num % 8);
+  if (!dedup || (indexed.bitmap[block_num / 8] & mask)) return;
+  indexed.bitmap[block_num / 8] |= mask;
+  store(DEDUP_BLOCK, (void *) &indexed);
+  fingerprints.insert(make_pair(checksums[block_num], block_num));
+  server_stats.dedup_indexed.fetch_add(1, memory_order_relaxed);
+}
+
+// Adds delta to the extra references to block_num.
+int BasicFileSys::adjust_refs(short block_num, int delta)
+{
+  short table_num = REFCOUNT_START + block_num / REFS_PER_BLOCK;
+  struct refcount_block_t table;
+  fetch(table_num, (void *) &table);
+  unsigned short &extra = table.extra[block_num % REFS_PER_BLOCK];
+  if (delta) {
+    extra += delta;
+    store(table_num, (void *) &table);
+  }
+  return extra;
+}
+  
+// Copies every block of the file system into blocks.
+void BasicFileSys::image(map<short, datablock_t> &blocks)
+{
+  for (int i = 0; i < CHECKED_BLOCKS; i++) {
+    short b = checked_block(i);
+    fetch(b, (void *) &blocks[b]);
+  }
+}
+
+// Writes blocks shipped from a primary over this disk's.
+void BasicFileSys::apply(const map<short, datablock_t> &blocks, bool whole)
+{
+  // blocks the primary freed, and with a whole image any block at all,
+  // may no longer be what a connection was in
+  if (whole || blocks.count(0)) {
+    struct superblock_t before;
+    read_block(0, (void *) &before);
+    const unsigned char *after = blocks.count(0) ? (const unsigned char *) blocks.at(0).data : before.bitmap;
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+      int mask = 1 << (b % 8);
+      if (whole || ((before.bitmap[b / 8] & mask) && !(after[b / 8] & mask))) frees[b]++;
+    }
+  }
+  for (auto &b : blocks) {
+    // the primary's checksums are for its own disk
+    if (checksum_index(b.first) < 0) continue;
+    store(b.first, (void *) &b.second);
+    // the block may be a directory whose names changed
+    if (!whole) dentries.invalidate_dir(b.first);
+  }
+  if (whole) dentries.clear();
+  // files come and go only with blocks
+  if (blocks.count(0)) {
+    count_free();
+    count_inodes();
+  }
+  if (blocks.count(DEDUP_BLOCK)) load_index();
+}
+
 // Reads block from disk. Output parameter block points to new block.
 void BasicFileSys::read_block(short block_num, void *block) {
-  disk.read_block(block_num, block);
+  if ((block_num < 0 || block_num >= NUM_BLOCKS) && block_num != SNAPSHOT_BLOCK) {
+    cerr << "Invalid block number" << endl;
+    exit(-1);
+  }
+  fetch(block_num, block);
 }
 
 // Writes block to disk. Input block points to block to write.
 void BasicFileSys::write_block(short block_num, void *block) {
-  disk.write_block(block_num, block);
+  if ((block_num < 0 || block_num >= NUM_BLOCKS) && block_num != SNAPSHOT_BLOCK) {
+    cerr << "Invalid block number" << endl;
+    exit(-1);
+  }
+  // new contents no longer match the fingerprint
+  if (block_num < NUM_BLOCKS && unindex(block_num)) store(DEDUP_BLOCK, (void *) &indexed);
+  store(block_num, block);
+}
+
+// True if block_num is allocated in the bitmap.
+bool BasicFileSys::is_allocated(short block_num) {
+  struct superblock_t super_block;
+  read_block(0, (void *) &super_block);
+  return super_block.bitmap[block_num / 8] & (1 << (block_num % 8));
+}
+
+// Times block_num was freed.
+unsigned int BasicFileSys::times_freed(short block_num) {
+  return frees[block_num];
+}
+
+// A generation number for a new inode.
+unsigned int BasicFileSys::new_generation() {
+  return next_generation++ & ~SNAPSHOT_GENERATION;
+}
+
+// Number of free blocks. Safe to call without holding the lock.
+int BasicFileSys::num_free_blocks() {
+  return free_blocks.load(std::memory_order_relaxed);
+}
+
+// Number of files and directories. Safe to call without holding the lock.
+int BasicFileSys::num_inodes() {
+  return inodes.load(std::memory_order_relaxed);
+}
+
+// Counts files or directories made (delta > 0) or removed (delta < 0).
+void BasicFileSys::add_inodes(int delta) {
+  inodes.fetch_add(delta, std::memory_order_relaxed);
+}
+
+// Serializes file system operations from concurrent connections.
+void BasicFileSys::lock() {
+  fs_lock.lock();
+}
+
+void BasicFileSys::unlock() {
+  fs_lock.unlock();
+}
+
+// Journal transactions; see BasicFileSys.h.
+void BasicFileSys::begin() {
+  corrupt = false;
+  journal.begin();
+}
+
+unsigned int BasicFileSys::commit() {
+  return journal.commit();
+}
+
+void BasicFileSys::wait_durable(unsigned int seq) {
+  journal.wait_durable(seq);
+}
+
+// True, once, if a block read since begin did not match its checksum.
+bool BasicFileSys::checksum_failed() {
+  bool failed = corrupt;
+  corrupt = false;
+  return failed;
 }
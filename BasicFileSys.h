@@ -5,33 +5,202 @@
 #ifndef BASIC_FILESYS_H
 #define BASIC_FILESYS_H
 
-#include "Disk.h"
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "Storage.h"
+#include "Journal.h"
+#include "DentryCache.h"
 
 // Basic File 
 class BasicFileSys {
 
   public:
-    // Mounts the disk.  If the disk is new, it formats the disk by
-    // initializing special blocks 0 (superblock) and 1 (root directory). 
-    void mount();
+    BasicFileSys();
 
-    // Unmounts the disk.
+    // Mounts the disk stored in file_name.  If the disk is new, it formats
+    // the disk by initializing special blocks 0 (superblock) and 1 (root
+    // directory). Transactions committed before a crash are replayed.
+    // A disk made with an older layout that cannot be migrated is refused.
+    // With in_memory, the disk is kept in a RamDisk and the file only
+    // written when the disk is saved.
+    void mount(const char *file_name = "DISK", bool in_memory = false);
+
+    // Unmounts the disk, writing every committed block home. Waits for a
+    // save that is writing its image, so may be called with the lock held.
     void unmount();
 
+    // Writes a consistent image of a disk kept in memory to its file.
+    // Takes the lock, so must be called without it. Does nothing for a
+    // disk file, which every command already reaches, or once unmounted.
+    void save();
+
     // Gets a free block from the disk.
     short get_free_block();
   
-    // Reclaims block making it available for future use.
+    // Reclaims block making it available for future use. A shared block
+    // just loses a reference; the last reclaim frees it.
     void reclaim_block(short block_num);
 
+    // Reclaims count blocks with one update of the bitmap.
+    void reclaim_blocks(const short *blocks, int count);
+
+    // Adds a reference to a data block, which a copy of a file now shares.
+    void share_block(short block_num);
+
+    // True if more than one file refers to block_num, so that a file
+    // writing to it must write to a copy instead.
+    bool is_shared(short block_num);
+
     // Reads block from disk. Output parameter block points to new block.
+    // Besides the file system blocks, SNAPSHOT_BLOCK may be read. A block
+    // read from the disk is checked against its checksum.
     void read_block(short block_num, void *block);
   
-    // Writes block to disk. Input block points to block to write.
+    // Writes block to disk. Input block points to block to write. Its
+    // checksum is updated in the same transaction, and a block indexed
+    // for deduplication leaves the index.
     void write_block(short block_num, void *block);
 
+    // Inline deduplication, if on: a full data block about to be written
+    // is looked up by fingerprint. Returns a block already holding the
+    // same data, with a reference added for the caller, or 0 if there is
+    // none.
+    short find_duplicate(const void *block);
+
+    // Marks block_num, just written with a full data block, as one that
+    // find_duplicate may return. Does nothing unless dedup is on.
+    void index_block(short block_num);
+
+    // Share full data blocks with identical contents; off unless turned on.
+    bool dedup;
+
+    // True if block_num is allocated in the bitmap.
+    bool is_allocated(short block_num);
+
+    // Number of times block_num has been freed. A connection
+    // compares it to tell whether its current directory is still there.
+    unsigned int times_freed(short block_num);
+
+    // A generation number for a new inode, different from any other
+    // inode's since mount; file handles carry it to detect reuse. The
+    // SNAPSHOT_GENERATION bit is clear.
+    unsigned int new_generation();
+
+    // Number of free blocks. Safe to call without holding the lock.
+    int num_free_blocks();
+
+    // Number of files and directories, the root and those in snapshots
+    // included. Counted at mount and kept up to date by the commands that
+    // make and remove them, through add_inodes. Safe to call without
+    // holding the lock.
+    int num_inodes();
+    void add_inodes(int delta);
+
+    // Serializes file system operations from concurrent connections.
+    void lock();
+    void unlock();
+
+    // Journal transactions. A command's writes between begin and commit,
+    // both under the lock, reach the disk atomically. After unlocking,
+    // wait_durable(seq) returns once the command's transaction, and any
+    // it read from, survive a crash. Writes outside a transaction go
+    // straight to disk, unjournaled.
+    void begin();
+    unsigned int commit();
+    void wait_durable(unsigned int seq);
+
+    // True, once, if a block read since begin did not match its checksum,
+    // so the command may have acted on corrupt data.
+    bool checksum_failed();
+
+    // Check blocks read from the disk against their checksums; on unless
+    // turned off to save the time it takes. Checksums are kept up to date
+    // either way.
+    bool verify;
+
+    // Copies every block of the file system, the reference counts, the
+    // snapshot directory and the deduplication bitmap included, into
+    // blocks. Called with the lock held. The checksums are left out; each
+    // disk keeps its own.
+    void image(std::map<short, datablock_t> &blocks);
+
+    // Writes blocks shipped from a primary over this disk's, in the open
+    // transaction. A whole image replaces everything image copies.
+    // Called with the lock held.
+    void apply(const std::map<short, datablock_t> &blocks, bool whole);
+
+    // Name lookups of the file system on this disk, shared by all
+    // connections. Used with the lock held.
+    DentryCache dentries;
+
+    // Transactions committed, for replicas of this disk to follow.
+    ChangeLog changes;
+
   private:
-    Disk disk;
+    Storage *disk;	// a Disk, or a RamDisk if kept in memory
+    Journal journal;
+    std::mutex fs_lock;	// held for the duration of one file system command
+    std::mutex saving;	// held by save from taking its image to writing it
+    std::atomic<int> free_blocks;	// kept in step with the bitmap
+    std::atomic<int> inodes;	// files and directories
+    unsigned int next_generation;	// seeded randomly at mount
+    std::vector<unsigned int> checksums;	// the checksum table, by checksum_index
+    bool corrupt;		// a block read failed its checksum
+    unsigned int frees[NUM_BLOCKS];	// times each block was freed
+    struct dedupblock_t indexed;	// the deduplication bitmap
+    std::unordered_multimap<unsigned int, short> fingerprints;	// checksum -> indexed block
+
+    // Reads or writes any block other than the journal's, through the
+    // journal, checking or updating its checksum.
+    void fetch(short block_num, void *block);
+    void store(short block_num, const void *block);
+
+    // Reads the checksum table, computing it for a disk made before
+    // checksums.
+    void load_checksums();
+
+    // Drops block_num from the fingerprint index and the bitmap in memory.
+    // Returns true if it was indexed.
+    bool unindex(short block_num);
+
+    // Reads the deduplication bitmap, making an empty one for a disk made
+    // before deduplication, and builds the fingerprint index from it.
+    void load_index();
+
+    // Formats a new disk.
+    void format();
+
+    // Exits with an error if the disk was made with a layout mount cannot
+    // migrate.
+    void check_format(const char *file_name);
+
+    // Sets free_blocks from the bitmap.
+    void count_free();
+
+    // Sets inodes by walking the tree and the snapshots.
+    void count_inodes();
+
+    // Number of files and directories below dir.
+    int count_below(short dir);
+
+    // Clears the snapshot bit from the generation of every inode below
+    // dir, for a disk made before snapshots.
+    void thaw(short dir);
+
+    // Adds delta to the extra references to block_num, returning the new
+    // count. The table goes through the journal like any other block.
+    int adjust_refs(short block_num, int delta);
+};
+
+// A disk the server mounts as a volume. With more than one, each is
+// reached as the top-level directory /name.
+struct Volume {
+  std::string name;
+  BasicFileSys *disk;
 };
 
 #endif
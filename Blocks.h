@@ -18,15 +18,90 @@ const int MAX_FNAME_SIZE = 9;
 const int MAX_DIR_ENTRIES = ((BLOCK_SIZE - 8) / 12);
 
 // Maximum number of blocks in a data file
-const int MAX_DATA_BLOCKS = ((BLOCK_SIZE - 8) / 2);
+const int MAX_DATA_BLOCKS = ((BLOCK_SIZE - 12) / 2);
 
 // Maximum file size for a data file
 const int MAX_FILE_SIZE	= (MAX_DATA_BLOCKS * BLOCK_SIZE);
 
+// Files up to this size are stored inline, in the inode's block pointers
+const int MAX_INLINE_SIZE = (MAX_DATA_BLOCKS * 2);
+
 // Magic numbers - used to distinguish between directory blocks and inodes
 const unsigned int DIR_MAGIC_NUM = 0xFFFFFFFF;
 const unsigned int INODE_MAGIC_NUM = 0xFFFFFFFE;
 
+// Journal - a write-ahead log stored after the file system blocks in the
+// disk image: one header block followed by a circular log
+const int JOURNAL_BLOCKS = 256;
+const int JOURNAL_START = NUM_BLOCKS;
+const int JOURNAL_LOG_BLOCKS = JOURNAL_BLOCKS - 1;
+
+// Reference counts - a table after the journal holding, for each block,
+// the number of files sharing it beyond the first
+const int REFS_PER_BLOCK = BLOCK_SIZE / 2;
+const int REFCOUNT_START = JOURNAL_START + JOURNAL_BLOCKS;
+const int REFCOUNT_BLOCKS = NUM_BLOCKS / REFS_PER_BLOCK;
+
+// Snapshots - a directory block after the reference counts whose entries
+// name the root directory of each snapshot. It is reached, read-only, as
+// the hidden directory /.snapshot.
+const int SNAPSHOT_BLOCK = REFCOUNT_START + REFCOUNT_BLOCKS;
+const char SNAPSHOT_DIR_NAME[] = ".snapshot";
+
+// Top bit of the generation of an inode frozen in a snapshot
+const unsigned int SNAPSHOT_GENERATION = 0x80000000;
+
+// Checksums - a table after the snapshot directory holding the CRC32C of
+// each block of the file system, the reference counts, the snapshot
+// directory and the deduplication bitmap, in that order. The journal's
+// blocks are covered by its own commit checksums instead.
+const int CHECKSUMS_PER_BLOCK = BLOCK_SIZE / 4;
+const int CHECKSUM_START = SNAPSHOT_BLOCK + 1;
+const int CHECKED_BLOCKS = NUM_BLOCKS + REFCOUNT_BLOCKS + 2;
+const int CHECKSUM_BLOCKS = (CHECKED_BLOCKS + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+
+// Deduplication - a bitmap after the checksum table marking the full data
+// blocks that a write of the same contents may share. The checksum of a
+// marked block is its fingerprint.
+const int DEDUP_BLOCK = CHECKSUM_START + CHECKSUM_BLOCKS;
+
+// Index of a block's checksum in the table, -1 if it has none
+inline int checksum_index(int block_num) {
+  if (block_num >= 0 && block_num < NUM_BLOCKS) return block_num;
+  if (block_num >= REFCOUNT_START && block_num <= SNAPSHOT_BLOCK) return NUM_BLOCKS + block_num - REFCOUNT_START;
+  if (block_num == DEDUP_BLOCK) return CHECKED_BLOCKS - 1;
+  return -1;
+}
+
+// The block whose checksum is at index in the table
+inline int checked_block(int index) {
+  if (index < NUM_BLOCKS) return index;
+  if (index < CHECKED_BLOCKS - 1) return REFCOUNT_START + index - NUM_BLOCKS;
+  return DEDUP_BLOCK;
+}
+
+// Format - a block after the deduplication bitmap recording the version
+// of the layout the disk was made with. Bump FORMAT_VERSION whenever a
+// block's layout changes in a way mount cannot migrate.
+const int FORMAT_BLOCK = DEDUP_BLOCK + 1;
+const unsigned int FORMAT_MAGIC_NUM = 0x4E465346;
+const unsigned int FORMAT_VERSION = 1;
+
+// Number of blocks in the disk image
+const int DISK_BLOCKS = FORMAT_BLOCK + 1;
+
+// Maximum number of block numbers in one journal descriptor block
+const int MAX_JOURNAL_TAGS = ((BLOCK_SIZE - 16) / 2);
+
+// Most blocks one journaled transaction can write, so that they, their
+// descriptors and the commit block fit in the log together
+const int JOURNAL_MAX_BLOCKS = (JOURNAL_LOG_BLOCKS - 1) * MAX_JOURNAL_TAGS / (MAX_JOURNAL_TAGS + 1);
+
+// Journal magic numbers
+const unsigned int JOURNAL_MAGIC_NUM = 0x4A4E4C48;
+const unsigned int JOURNAL_DESC_MAGIC_NUM = 0x4A4E4C44;
+const unsigned int JOURNAL_COMMIT_MAGIC_NUM = 0x4A4E4C43;
+
 // BLOCK TYPES
 
 // Superblock - keeps track of which blocks are used in the filesystem.
@@ -35,6 +110,18 @@ struct superblock_t {
   unsigned char bitmap[BLOCK_SIZE]; // bitmap of free blocks
 };
 
+// Deduplication block - marks the full data blocks indexed by fingerprint
+struct dedupblock_t {
+  unsigned char bitmap[BLOCK_SIZE]; // bitmap of indexed blocks
+};
+
+// Format block - identifies the layout of the disk
+struct formatblock_t {
+  unsigned int magic;		// magic number, must be FORMAT_MAGIC_NUM
+  unsigned int version;		// layout version, must be FORMAT_VERSION
+  char unused[BLOCK_SIZE - 8];
+};
+
 // Directory block - represents a directory
 struct dirblock_t {
   unsigned int magic;		// magic number, must be DIR_MAGIC_NUM
@@ -49,7 +136,47 @@ struct dirblock_t {
 struct inode_t {
   unsigned int magic;		 // magic number, must be INODE_MAGIC_NUM
   unsigned int size;		 // file size in bytes
-  short blocks[MAX_DATA_BLOCKS]; // array of direct indices to data blocks
+  unsigned int generation;	 // new each time the block becomes an inode
+  union {
+    short blocks[MAX_DATA_BLOCKS]; // array of direct indices to data blocks
+    char data[MAX_INLINE_SIZE];	   // contents, if size <= MAX_INLINE_SIZE
+  };
+};
+
+// Journal header - first block of the journal. Replay starts with
+// transaction start_seq at log block start.
+struct journal_header_t {
+  unsigned int magic;		// magic number, must be JOURNAL_MAGIC_NUM
+  unsigned int start_seq;	// oldest transaction not yet checkpointed
+  unsigned int start;		// log block where that transaction begins
+  char unused[BLOCK_SIZE - 12];
+};
+
+// Journal descriptor - starts a transaction in the log. It is followed by
+// the new contents of each listed block, then by another descriptor if
+// more is set, else by the commit block.
+struct journal_desc_t {
+  unsigned int magic;		// magic number, must be JOURNAL_DESC_MAGIC_NUM
+  unsigned int seq;		// transaction sequence number
+  unsigned int count;		// number of block numbers in blocks
+  unsigned int more;		// another descriptor follows the blocks
+  short blocks[MAX_JOURNAL_TAGS]; // home block numbers of the logged blocks
+};
+
+// Journal commit - ends a transaction. A transaction counts only if its
+// commit block is intact and the checksum matches.
+struct journal_commit_t {
+  unsigned int magic;		// magic number, must be JOURNAL_COMMIT_MAGIC_NUM
+  unsigned int seq;		// transaction sequence number
+  unsigned int checksum;	// over the descriptors and logged blocks
+  char unused[BLOCK_SIZE - 12];
+};
+
+// Reference count block - extra references to REFS_PER_BLOCK consecutive
+// blocks. A data block copied by cp is shared until one of the files
+// writes to it; a block no file shares has 0.
+struct refcount_block_t {
+  unsigned short extra[REFS_PER_BLOCK];
 };
 
 // Data block - stores data for a data file
@@ -0,0 +1,63 @@
+// CPSC 3500: Change Log
+// The transactions a volume commits, kept in memory for replicas to
+// follow.
+
+#include <chrono>
+using namespace std;
+
+#include "ChangeLog.h"
+#include "Latency.h"
+
+ChangeLog::ChangeLog() : last_seq(0), readers(0)
+{
+}
+
+// Records a committed transaction's blocks.
+void ChangeLog::append(const map<short, datablock_t> &blocks)
+{
+  lock_guard<mutex> guard(log_lock);
+  if (!readers) return;
+  recent.push_back(Change());
+  Change &change = recent.back();
+  change.seq = ++last_seq;
+  change.time_ns = wall_ns();
+  change.blocks = blocks;
+  if (recent.size() > MAX_CHANGES) recent.pop_front();
+  appended.notify_all();
+}
+
+// Starts following the log.
+unsigned int ChangeLog::subscribe()
+{
+  lock_guard<mutex> guard(log_lock);
+  readers++;
+  return last_seq;
+}
+
+void ChangeLog::unsubscribe()
+{
+  lock_guard<mutex> guard(log_lock);
+  // with no one to read them, the kept transactions are dead weight
+  if (--readers == 0) recent.clear();
+}
+
+// Last transaction appended.
+unsigned int ChangeLog::last()
+{
+  lock_guard<mutex> guard(log_lock);
+  return last_seq;
+}
+
+// Waits up to timeout_ms for transactions after seq.
+bool ChangeLog::wait(unsigned int seq, vector<Change> &out, int timeout_ms)
+{
+  unique_lock<mutex> guard(log_lock);
+  appended.wait_for(guard, chrono::milliseconds(timeout_ms),
+                    [&] { return last_seq != seq; });
+  if (last_seq == seq) return true;
+  if (recent.empty() || recent.front().seq > seq + 1) return false;
+  for (auto &change : recent) {
+    if (change.seq > seq) out.push_back(change);
+  }
+  return true;
+}
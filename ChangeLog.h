@@ -0,0 +1,61 @@
+// CPSC 3500: Change Log
+// The transactions a volume commits, kept in memory for replicas to
+// follow. The journal appends each one as it commits, with the new
+// contents of every block it wrote, so a replica that applies them in
+// order holds the same blocks as the primary. Only the latest MAX_CHANGES
+// are kept; a replica that falls further behind starts over from a full
+// copy. Nothing is kept while no replica is following.
+
+#ifndef CHANGE_LOG_H
+#define CHANGE_LOG_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include "Blocks.h"
+
+// Transactions kept for replicas that are behind
+const size_t MAX_CHANGES = 1024;
+
+// One committed transaction
+struct Change {
+  unsigned int seq;	// numbered from 1, in commit order
+  long long time_ns;	// wall clock time it committed
+  std::map<short, datablock_t> blocks;
+};
+
+class ChangeLog {
+
+  public:
+    ChangeLog();
+
+    // Records a committed transaction's blocks. Called with the file system
+    // lock held.
+    void append(const std::map<short, datablock_t> &blocks);
+
+    // Starts following the log, returning the last transaction so far.
+    // Called with the file system lock held, under which the caller also
+    // copies the volume, so the copy and the transactions after the one
+    // returned together are complete.
+    unsigned int subscribe();
+    void unsubscribe();
+
+    // Last transaction appended. With the file system lock held, a copy
+    // of the volume is current as of it.
+    unsigned int last();
+
+    // Waits up to timeout_ms for transactions after seq, adding them to
+    // out. Returns false if some of them are no longer kept.
+    bool wait(unsigned int seq, std::vector<Change> &out, int timeout_ms);
+
+  private:
+    std::mutex log_lock;	// guards the fields below
+    std::condition_variable appended;
+    std::deque<Change> recent;	// the latest transactions, oldest first
+    unsigned int last_seq;
+    int readers;		// replicas following the log
+};
+
+#endif
@@ -0,0 +1,296 @@
+// CPSC 3500: Channel
+// The byte stream between a client and the server: TCP, a Unix domain
+// socket, or rings in shared memory.
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "Channel.h"
+
+// Request that sets up a shared memory channel; the segment rides along
+static const char SHM_HELLO[] = "shm\r\n";
+
+// Seals the segment must carry: a client that could resize it after the
+// server mapped it would make the server's next access fault
+static const int SHM_SEALS = F_SEAL_SHRINK | F_SEAL_GROW;
+
+// Checks made before sleeping on a futex, none on a single CPU where the
+// other side cannot run meanwhile, and the longest sleep between checks
+// that the other side is still there
+static const int SPINS = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 1000 : 0;
+static const long WAIT_NS = 100 * 1000 * 1000;
+
+static long futex(atomic<unsigned int> &word, int op, unsigned int val, const timespec *timeout) {
+	return syscall(SYS_futex, (unsigned int *) &word, op, val, timeout, NULL, 0);
+}
+
+// Connects a socket of family to addr. Returns -1, having printed why, on
+// failure.
+static int connect_socket(int family, const sockaddr *addr, socklen_t len) {
+	int sock = ::socket(family, SOCK_STREAM, 0);
+	if (sock == -1){
+		perror("socket");
+		return -1;
+	}
+	if (::connect(sock, addr, len) == -1){
+		perror("connect");
+		::close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// Connects to the server at a mount string.
+bool Channel::connect(const string &fs_loc) {
+	size_t divider = fs_loc.find(':');
+	if (divider == string::npos){
+		fprintf(stderr, "%s: mount string must be server:port, unix:path or shm:path\n", fs_loc.c_str());
+		return false;
+	}
+	string host = fs_loc.substr(0, divider);
+	string rest = fs_loc.substr(divider + 1);
+
+	// Unix domain socket, carrying the shared memory segment if asked for
+	if (host == "unix" || host == "shm"){
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof addr);
+		addr.sun_family = AF_UNIX;
+		if (rest.length() >= sizeof addr.sun_path){
+			fprintf(stderr, "%s: socket path too long\n", rest.c_str());
+			return false;
+		}
+		strcpy(addr.sun_path, rest.c_str());
+		fd = connect_socket(AF_UNIX, (sockaddr *) &addr, sizeof addr);
+		if (fd == -1 || host == "unix")
+			return fd != -1;
+
+		// sealed at its size, so the server can map it without fear of it
+		// shrinking under the mapping
+		int shm = memfd_create("nfs-channel", MFD_ALLOW_SEALING);
+		if (shm == -1 || ftruncate(shm, sizeof(ShmSegment)) == -1 ||
+		    fcntl(shm, F_ADD_SEALS, SHM_SEALS) == -1){
+			perror("memfd");
+			close();
+			return false;
+		}
+		void *mapping = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+		if (mapping == MAP_FAILED){
+			perror("mmap");
+			::close(shm);
+			close();
+			return false;
+		}
+		seg = (ShmSegment *) mapping;
+
+		// the new file is zeroed, which is the empty state of the rings
+		char control[CMSG_SPACE(sizeof(int))];
+		memset(control, 0, sizeof control);
+		iovec iov = { (void *) SHM_HELLO, sizeof SHM_HELLO - 1 };
+		msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &shm, sizeof(int));
+		ssize_t x = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		::close(shm);
+		if (x != (ssize_t) iov.iov_len){
+			perror("sendmsg");
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	// TCP
+	addrinfo hints, *res;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (int rv = getaddrinfo(host.c_str(), rest.c_str(), &hints, &res)){
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return false;
+	}
+	fd = connect_socket(res->ai_family, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	if (fd == -1)
+		return false;
+	// requests are single small writes; don't let Nagle delay them
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+	return true;
+}
+
+// Server side of a Unix domain socket connection.
+bool Channel::accept_local(int sock, string &buf) {
+	fd = sock;
+	char data[4096];
+	char control[CMSG_SPACE(sizeof(int))];
+	iovec iov = { data, sizeof data };
+	msghdr msg;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	ssize_t x;
+	do {
+		x = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (x == -1 && errno == EINTR);
+	if (x <= 0)
+		return false;
+
+	int shm = -1;
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&shm, CMSG_DATA(cmsg), sizeof(int));
+	if (shm == -1){
+		buf.append(data, x);
+		return true;
+	}
+
+	// a shared memory client: map its segment, if sealed at its size
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	int seals = fcntl(shm, F_GET_SEALS);
+	if (x == (ssize_t) sizeof SHM_HELLO - 1 && memcmp(data, SHM_HELLO, x) == 0 &&
+	    seals != -1 && (seals & SHM_SEALS) == SHM_SEALS &&
+	    fstat(shm, &st) == 0 && st.st_size >= (off_t) sizeof(ShmSegment))
+		mapping = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+	::close(shm);
+	if (mapping == MAP_FAILED)
+		return false;
+	seg = (ShmSegment *) mapping;
+	server = true;
+	return true;
+}
+
+// Sleeps until word is no longer seen, or briefly.
+bool Channel::wait(atomic<unsigned int> &word, unsigned int seen, atomic<int> &waiting) {
+	for (int i = 0; i < SPINS; i++){
+		if (word.load() != seen)
+			return true;
+	}
+	// the waker checks waiting after moving word, so one of the two sees
+	// the other
+	waiting.store(1);
+	if (word.load() == seen && !seg->closed.load()){
+		timespec timeout = { 0, WAIT_NS };
+		futex(word, FUTEX_WAIT, seen, &timeout);
+	}
+	waiting.store(0);
+	if (seg->closed.load())
+		return word.load() != seen;
+	// a client that died without closing shows as the socket closing
+	char c;
+	return ::recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 0;
+}
+
+// Reads up to len bytes.
+ssize_t Channel::recv(void *buf, size_t len) {
+	if (!seg){
+		ssize_t x;
+		do {
+			x = ::recv(fd, buf, len, 0);
+		} while (x == -1 && errno == EINTR);
+		return x;
+	}
+	ShmRing &ring = server ? seg->to_server : seg->to_client;
+	unsigned int tail = ring.tail.load(memory_order_relaxed);
+	unsigned int head;
+	while ((head = ring.head.load()) == tail){
+		if (!wait(ring.head, head, ring.reader_waiting))
+			return 0;
+	}
+	// the other side can write the counts too; ones further apart than
+	// the ring holds mean it is broken, or hostile
+	size_t n = head - tail;
+	if (n > SHM_RING_SIZE){
+		errno = EPIPE;
+		return -1;
+	}
+	if (n > len)
+		n = len;
+	size_t pos = tail % SHM_RING_SIZE;
+	size_t first = n < SHM_RING_SIZE - pos ? n : SHM_RING_SIZE - pos;
+	memcpy(buf, ring.data + pos, first);
+	memcpy((char *) buf + first, ring.data, n - first);
+	ring.tail.store(tail + n);
+	if (ring.writer_waiting.load())
+		futex(ring.tail, FUTEX_WAKE, INT_MAX, NULL);
+	return n;
+}
+
+// Writes up to len bytes.
+ssize_t Channel::send(const void *buf, size_t len) {
+	if (!seg){
+		ssize_t x;
+		do {
+			x = ::send(fd, buf, len, MSG_NOSIGNAL);
+			// not a socket, e.g. /dev/null standing in for one
+			if (x == -1 && errno == ENOTSOCK)
+				x = ::write(fd, buf, len);
+		} while (x == -1 && errno == EINTR);
+		return x;
+	}
+	ShmRing &ring = server ? seg->to_client : seg->to_server;
+	unsigned int head = ring.head.load(memory_order_relaxed);
+	unsigned int tail;
+	while (head - (tail = ring.tail.load()) == SHM_RING_SIZE){
+		if (!wait(ring.tail, tail, ring.writer_waiting)){
+			errno = EPIPE;
+			return -1;
+		}
+	}
+	if (head - tail > SHM_RING_SIZE){
+		errno = EPIPE;
+		return -1;
+	}
+	size_t n = SHM_RING_SIZE - (head - tail);
+	if (n > len)
+		n = len;
+	size_t pos = head % SHM_RING_SIZE;
+	size_t first = n < SHM_RING_SIZE - pos ? n : SHM_RING_SIZE - pos;
+	memcpy(ring.data + pos, buf, first);
+	memcpy(ring.data, (const char *) buf + first, n - first);
+	ring.head.store(head + n);
+	if (ring.reader_waiting.load())
+		futex(ring.head, FUTEX_WAKE, INT_MAX, NULL);
+	return n;
+}
+
+// Closes the channel, waking the other side if it is waiting.
+void Channel::close() {
+	if (seg){
+		seg->closed.store(1);
+		futex(seg->to_server.head, FUTEX_WAKE, INT_MAX, NULL);
+		futex(seg->to_server.tail, FUTEX_WAKE, INT_MAX, NULL);
+		futex(seg->to_client.head, FUTEX_WAKE, INT_MAX, NULL);
+		futex(seg->to_client.tail, FUTEX_WAKE, INT_MAX, NULL);
+		munmap(seg, sizeof(ShmSegment));
+		seg = NULL;
+	}
+	if (fd != -1)
+		::close(fd);
+	fd = -1;
+}
@@ -0,0 +1,85 @@
+// CPSC 3500: Channel
+// The byte stream between a client and the server. The mount string picks
+// the transport:
+//   server:port   TCP
+//   unix:path     Unix domain socket at path (nfsserver -u path)
+//   shm:path      a pair of rings in shared memory, for clients on the
+//                 server's host. The client creates the segment and passes
+//                 it over the Unix domain socket at path, which then only
+//                 tells either side that the other has gone. Requests and
+//                 responses go through the rings, with a futex to wake a
+//                 side that sleeps waiting for bytes or space.
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <string>
+#include <atomic>
+#include <sys/types.h>
+
+using namespace std;
+
+// Bytes in each direction's ring
+const unsigned int SHM_RING_SIZE = 1 << 16;
+
+// One direction of a shared memory channel, with one reader and one writer
+struct ShmRing {
+	atomic<unsigned int> head;	// bytes ever written
+	atomic<unsigned int> tail;	// bytes ever read
+	atomic<int> reader_waiting;	// reader asleep on head
+	atomic<int> writer_waiting;	// writer asleep on tail
+	char data[SHM_RING_SIZE];
+};
+
+// The shared memory segment of one connection
+struct ShmSegment {
+	ShmRing to_server;
+	ShmRing to_client;
+	atomic<int> closed;		// set by the side that closes first
+};
+
+class Channel {
+
+  public:
+    Channel() : fd(-1), seg(NULL), server(false) {
+    }
+
+    // A channel over an open descriptor: a socket, or any file
+    Channel(int fd) : fd(fd), seg(NULL), server(false) {
+    }
+
+    // Connects to the server at a mount string. Returns false, having
+    // printed why, on failure.
+    bool connect(const string &fs_loc);
+
+    // Server side of a Unix domain socket connection: reads the first
+    // bytes, switching to shared memory if they carry a client's segment.
+    // Other bytes are the start of the first request, and are left in buf.
+    // Returns false if the client has gone.
+    bool accept_local(int sock, string &buf);
+
+    // Reads up to len bytes, waiting for at least one. Returns the number
+    // read, 0 once the other side has closed, or -1 on error.
+    ssize_t recv(void *buf, size_t len);
+
+    // Writes up to len bytes, waiting for room for at least one. Returns the
+    // number written or -1 on error.
+    ssize_t send(const void *buf, size_t len);
+
+    // Closes the channel.
+    void close();
+
+    // The socket (or descriptor) underneath, -1 if closed.
+    int socket() const { return fd; }
+
+  private:
+    int fd;		// socket; for shared memory, the Unix domain socket
+    ShmSegment *seg;	// shared memory segment, if any
+    bool server;	// server end of a shared memory channel
+
+    // Sleeps until word is no longer seen, or briefly; false if the other
+    // side has gone.
+    bool wait(atomic<unsigned int> &word, unsigned int seen, atomic<int> &waiting);
+};
+
+#endif
@@ -0,0 +1,100 @@
+// CPSC 3500: Connection
+// A client connection to the network file system server, used by the
+// benchmarking and replay tools to issue requests and read whole responses.
+
+#include <cstdlib>
+
+#include "Connection.h"
+#include "Lz.h"
+
+// Connects to a server given as a mount string.
+bool Connection::open(string fs_loc) {
+	return chan.connect(fs_loc);
+}
+
+// Closes the connection.
+void Connection::close() {
+	chan.close();
+	buf.clear();
+	compressing = false;
+}
+
+// Asks the server to compress large bodies.
+bool Connection::compress() {
+	string status, body;
+	if (!request("compress lz", status, body) || status.compare(0, 3, "200") != 0)
+		return false;
+	compressing = true;
+	return true;
+}
+
+// Sends one request line and waits for the response.
+bool Connection::request(const string &req, string &status, string &body) {
+	string line = req + "\r\n";
+	string packed;
+	if (compressing && line.length() >= LZ_MIN_SIZE &&
+	    lz_compress(line.data(), line.length(), packed, line.length() - line.length() / 8))
+		line = "z " + to_string(packed.length()) + "\r\n" + packed;
+	size_t numbytes = 0;
+	while (numbytes < line.length()){
+		ssize_t x = chan.send(line.c_str() + numbytes, line.length() - numbytes);
+		if (x <= 0)
+			return false;
+		numbytes += x;
+	}
+
+	// Status line
+	size_t end = fill_until("\r\n");
+	if (end == string::npos)
+		return false;
+	status = buf.substr(0, end);
+	buf.erase(0, end + 2);
+
+	// Length header, and Compressed if the body is, terminated by an
+	// empty line
+	end = fill_until("\r\n\r\n");
+	if (end == string::npos)
+		return false;
+	size_t length = 0;
+	if (buf.compare(0, 7, "Length:") == 0)
+		length = strtoul(buf.c_str() + 7, NULL, 10);
+	size_t compressed_pos = buf.find("Compressed:");
+	bool compressed = compressed_pos < end;
+	size_t original = compressed ? strtoul(buf.c_str() + compressed_pos + 11, NULL, 10) : 0;
+	buf.erase(0, end + 4);
+
+	// Body
+	if (!fill(length))
+		return false;
+	body = buf.substr(0, length);
+	buf.erase(0, length);
+	if (compressed){
+		string unpacked;
+		if (!lz_decompress(body.data(), body.length(), unpacked, original) || unpacked.length() != original)
+			return false;
+		body.swap(unpacked);
+	}
+	return true;
+}
+
+// Receives until buf holds at least n bytes.
+bool Connection::fill(size_t n) {
+	char chunk[4096];
+	while (buf.length() < n){
+		ssize_t x = chan.recv(chunk, sizeof chunk);
+		if (x <= 0)
+			return false;
+		buf.append(chunk, x);
+	}
+	return true;
+}
+
+// Receives until buf contains delim.
+size_t Connection::fill_until(const string &delim) {
+	size_t pos;
+	while ((pos = buf.find(delim)) == string::npos){
+		if (!fill(buf.length() + 1))
+			return string::npos;
+	}
+	return pos;
+}
@@ -0,0 +1,47 @@
+// CPSC 3500: Connection
+// A client connection to the network file system server, used by the
+// benchmarking and replay tools to issue requests and read whole responses.
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <string>
+#include "Channel.h"
+
+using namespace std;
+
+class Connection {
+
+  public:
+    Connection() : compressing(false) {
+    }
+
+    // Connects to a server given as a mount string (see Channel.h).
+    // Returns false on failure.
+    bool open(string fs_loc);
+
+    // Closes the connection.
+    void close();
+
+    // Asks the server to compress large response bodies, and compresses
+    // large requests from then on. Returns false if it refused.
+    bool compress();
+
+    // Sends one request line (without the trailing CRLF) and waits for the
+    // response. The status line is stored without its CRLF. Returns false
+    // if the connection was lost.
+    bool request(const string &req, string &status, string &body);
+
+  private:
+    Channel chan;	// channel to the server
+    string buf;	// received bytes not yet consumed
+    bool compressing;	// the server agreed to compression
+
+    // Receives until buf holds at least n bytes. Returns false on EOF/error.
+    bool fill(size_t n);
+
+    // Receives until buf contains delim. Returns its position or npos.
+    size_t fill_until(const string &delim);
+};
+
+#endif
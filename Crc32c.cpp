@@ -0,0 +1,96 @@
+// CPSC 3500: CRC32C
+// The Castagnoli CRC that checksums disk blocks.
+
+#include <cstdint>
+#include <cstring>
+
+#include "Crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// The polynomial, bit-reversed
+static const uint32_t POLY = 0x82F63B78;
+
+// table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t table[8][256];
+
+static bool make_tables() {
+	for (int b = 0; b < 256; b++){
+		uint32_t crc = b;
+		for (int bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+		table[0][b] = crc;
+	}
+	for (int b = 0; b < 256; b++){
+		for (int k = 1; k < 8; k++)
+			table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+	}
+	return true;
+}
+
+// Slicing-by-8: eight table lookups fold in eight bytes at once.
+static uint32_t crc_tables(uint32_t crc, const unsigned char *p, size_t len) {
+	while (len >= 8){
+		uint64_t v;
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = table[7][v & 0xFF] ^ table[6][(v >> 8) & 0xFF] ^
+		      table[5][(v >> 16) & 0xFF] ^ table[4][(v >> 24) & 0xFF] ^
+		      table[3][(v >> 32) & 0xFF] ^ table[2][(v >> 40) & 0xFF] ^
+		      table[1][(v >> 48) & 0xFF] ^ table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+	return crc;
+}
+
+#if defined(__x86_64__)
+// The SSE4.2 crc32 instruction, eight bytes at a time. Compiled for SSE4.2
+// whatever the build's target, and only called on CPUs that have it.
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t c = crc;
+	while (len >= 8){
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t) c;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+static bool detect_sse42() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+static const bool have_sse42 = detect_sse42();
+#else
+static const bool have_sse42 = false;
+#endif
+
+static const bool tables_made = make_tables();
+
+// CRC32C of len bytes at data, continuing from crc.
+unsigned int crc32c(unsigned int crc, const void *data, size_t len) {
+	const unsigned char *p = (const unsigned char *) data;
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (have_sse42)
+		return ~crc_sse42(crc, p, len);
+#endif
+	return ~crc_tables(crc, p, len);
+}
+
+// The implementation in use.
+const char *crc32c_method() {
+	return have_sse42 ? "sse4.2" : "slicing-by-8";
+}
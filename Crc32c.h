@@ -0,0 +1,18 @@
+// CPSC 3500: CRC32C
+// The Castagnoli CRC that checksums disk blocks, as ext4 and iSCSI use.
+// On x86 CPUs with SSE4.2 it is computed with the crc32 instruction,
+// eight bytes at a time; elsewhere with slicing-by-8 tables.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+
+// CRC32C of len bytes at data. To checksum data in pieces, pass the
+// result for the pieces before as crc; start with 0.
+unsigned int crc32c(unsigned int crc, const void *data, size_t len);
+
+// The implementation in use: "sse4.2" or "slicing-by-8".
+const char *crc32c_method();
+
+#endif
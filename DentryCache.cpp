@@ -0,0 +1,74 @@
+// CPSC 3500: Dentry Cache
+// Remembers the result of looking a name up in a directory, including
+// names that do not exist.
+
+#include "DentryCache.h"
+using namespace std;
+
+DentryCache::DentryCache(size_t cache_capacity) : stats("dentry"),
+  capacity(cache_capacity)
+{
+}
+
+// The directory's block number in two bytes, then the name
+string DentryCache::key(short dir, const string &name)
+{
+  string k(2, '\0');
+  k[0] = (char) (dir & 0xFF);
+  k[1] = (char) ((dir >> 8) & 0xFF);
+  return k + name;
+}
+
+// Looks up name in directory dir.
+bool DentryCache::find(short dir, const string &name, short &block, bool &is_dir)
+{
+  auto it = index.find(key(dir, name));
+  if (it == index.end()) {
+    stats.misses.fetch_add(1, memory_order_relaxed);
+    return false;
+  }
+  stats.hits.fetch_add(1, memory_order_relaxed);
+  lru.splice(lru.begin(), lru, it->second);
+  block = it->second->block;
+  is_dir = it->second->is_dir;
+  return true;
+}
+
+// Records that name in directory dir is block (0: does not exist).
+void DentryCache::insert(short dir, const string &name, short block, bool is_dir)
+{
+  string k = key(dir, name);
+  auto it = index.find(k);
+  if (it != index.end()) {
+    it->second->block = block;
+    it->second->is_dir = is_dir;
+    lru.splice(lru.begin(), lru, it->second);
+    return;
+  }
+  if (index.size() >= capacity) {
+    index.erase(lru.back().key);
+    lru.pop_back();
+  }
+  lru.push_front({k, block, is_dir});
+  index[k] = lru.begin();
+}
+
+// Forgets every name in directory dir.
+void DentryCache::invalidate_dir(short dir)
+{
+  string prefix = key(dir, "");
+  for (auto it = lru.begin(); it != lru.end(); ) {
+    if (it->key.compare(0, 2, prefix) == 0) {
+      index.erase(it->key);
+      it = lru.erase(it);
+    }
+    else ++it;
+  }
+}
+
+// Forgets everything.
+void DentryCache::clear()
+{
+  lru.clear();
+  index.clear();
+}
@@ -0,0 +1,50 @@
+// CPSC 3500: Dentry Cache
+// Remembers the result of looking a name up in a directory, including
+// names that do not exist, so resolving a path is mostly memory lookups
+// instead of directory block scans. Bounded, least recently used entries
+// are dropped first. Callers hold the file system lock.
+
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include "Stats.h"
+
+class DentryCache {
+
+  public:
+    DentryCache(size_t capacity = 1024);
+
+    // Looks up name in directory dir. Returns false if the cache does not
+    // know; otherwise block is the name's block, 0 if it does not exist.
+    bool find(short dir, const std::string &name, short &block, bool &is_dir);
+
+    // Records that name in directory dir is block (0: does not exist).
+    void insert(short dir, const std::string &name, short block, bool is_dir);
+
+    // Forgets every name in directory dir, whose block was freed.
+    void invalidate_dir(short dir);
+
+    // Forgets everything, for a disk whose blocks were all replaced.
+    void clear();
+
+    // Hits and misses, reported by the stats command
+    CacheStats stats;
+
+  private:
+    struct Entry {
+      std::string key;	// dir and name, see key()
+      short block;
+      bool is_dir;
+    };
+
+    size_t capacity;
+    std::list<Entry> lru;	// most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+    static std::string key(short dir, const std::string &name);
+};
+
+#endif
@@ -12,6 +12,8 @@ using namespace std;
 #include "Disk.h"
 #include "Blocks.h"
 
+thread_local DiskStats Disk::stats;
+
 // Opens the file "file_name" that represents the disk.  If the file does
 // not exist, file is created. Returns true if a file is created and false if
 // the file parameter fd exists. Any other error aborts the program.
@@ -42,7 +44,7 @@ void Disk::read_block(int block_num, void *block)
   off_t new_offset;
   ssize_t size; 
 
-  if (block_num < 0 || block_num >= NUM_BLOCKS) {
+  if (block_num < 0 || block_num >= DISK_BLOCKS) {
     cerr << "Invalid block size" << endl;
     exit(-1);
   }
@@ -55,6 +57,8 @@ void Disk::read_block(int block_num, void *block)
   }
 
   size = read(fd, block, BLOCK_SIZE);
+  stats.reads++;
+  stats.syscalls += 2;
   if (size != BLOCK_SIZE) {
     cerr << "Failed to read entire block" << endl;
     exit(-1);
@@ -68,7 +72,7 @@ void Disk::write_block(int block_num, void *block)
   off_t new_offset;
   ssize_t size; 
 
-  if (block_num < 0 || block_num >= NUM_BLOCKS) {
+  if (block_num < 0 || block_num >= DISK_BLOCKS) {
     cerr << "Invalid block size" << endl;
     exit(-1);
   }
@@ -81,8 +85,52 @@ void Disk::write_block(int block_num, void *block)
   }
 
   size = write(fd, block, BLOCK_SIZE);
+  stats.writes++;
+  stats.syscalls += 2;
   if (size != BLOCK_SIZE) {
     cerr << "Failed to write entire block" << endl;
     exit(-1);
   }
 }
+
+// Writes count consecutive blocks starting at block_num with a single
+// system call.
+void Disk::write_blocks(int block_num, int count, const void *blocks)
+{
+  ssize_t size;
+
+  if (block_num < 0 || count < 0 || block_num + count > DISK_BLOCKS) {
+    cerr << "Invalid block size" << endl;
+    exit(-1);
+  }
+
+  size = pwrite(fd, blocks, count * BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
+  stats.writes += count;
+  stats.syscalls++;
+  if (size != count * BLOCK_SIZE) {
+    cerr << "Failed to write entire block" << endl;
+    exit(-1);
+  }
+}
+
+// Waits until everything written so far is on stable storage.
+void Disk::sync()
+{
+  stats.syncs++;
+  stats.syscalls++;
+  if (fdatasync(fd) == -1) {
+    cerr << "Failed to sync disk" << endl;
+    exit(-1);
+  }
+}
+
+// Number of blocks in the disk file.
+int Disk::num_blocks()
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    cerr << "Could not stat disk" << endl;
+    exit(-1);
+  }
+  return st.st_size / BLOCK_SIZE;
+}
@@ -4,7 +4,18 @@
 #ifndef DISK_H
 #define DISK_H
 
-class Disk {
+#include "Storage.h"
+
+// Counters of the I/O a thread has issued to any disk, so a caller can
+// attribute disk work to the operation it is running.
+struct DiskStats {
+  long reads;		// blocks read
+  long writes;		// blocks written
+  long syscalls;	// system calls issued (seeks, reads, writes and syncs)
+  long syncs;		// fdatasync calls
+};
+
+class Disk : public Storage {
 
   public:
     // Opens the file "file_name" that represents the disk.  If the file does
@@ -21,6 +32,19 @@ class Disk {
     // Writes the data in block to disk block block_num.
     void write_block(int block_num, void *block);
 
+    // Writes count consecutive blocks starting at block_num with a single
+    // system call.
+    void write_blocks(int block_num, int count, const void *blocks);
+
+    // Waits until everything written so far is on stable storage.
+    void sync();
+
+    // Number of blocks in the disk file.
+    int num_blocks();
+
+    // I/O issued by the calling thread since it started.
+    static thread_local DiskStats stats;
+
   private:
     int fd;	// file descriptor that represents the disk
 };
@@ -4,6 +4,9 @@
 // March 2nd, 2021
 
 #include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
 #include <iostream>
 #include <unistd.h>
 #include <sys/types.h>
@@ -14,113 +17,255 @@ using namespace std;
 #include "FileSys.h"
 #include "BasicFileSys.h"
 #include "Blocks.h"
+#include "Stats.h"
+#include "Latency.h"
+#include "Lz.h"
 
 // mounts the file system
-void FileSys::mount(int sock) {
-  bfs.mount();
+void FileSys::mount(Channel chan, BasicFileSys *disk) {
+  Volume vol = { "", disk };
+  mount(chan, vector<Volume>(1, vol));
+}
+
+// mounts the file system on several volumes
+void FileSys::mount(Channel chan, const vector<Volume> &vols) {
+  volumes = vols;
+  curr_vol = cmd_vol = 0;
+  bfs = volumes[0].disk;
   curr_dir = 1; //by default current directory is home directory, in disk block #1
-  fs_sock = sock; //use this socket to receive file system operations from the client and send back response messages
+  curr_frees = 0; // the root is never freed
+  curr_in_snapshot = false;
+  fs_chan = chan; //use this channel to receive file system operations from the client and send back response messages
+  status_code = 0;
+  sent = 0;
+  compressing = false;
+}
+
+// picks the volume a command runs on
+BasicFileSys *FileSys::route(const string &command, string &arg, string &arg2){
+	cmd_vol = curr_vol < 0 ? 0 : curr_vol;
+	if (command == "sync"){
+		sync();
+		return NULL;
+	}
+	if (command == "df"){
+		df();
+		return NULL;
+	}
+	if (volumes.size() > 1){
+		if (command == "happend" || command == "hcat" || command == "hhead" || command == "hstat"){
+			// the first two hex digits of a handle are its volume
+			if (arg.length() >= 2 && isxdigit((unsigned char) arg[0]) && isxdigit((unsigned char) arg[1]))
+				cmd_vol = strtol(arg.substr(0, 2).c_str(), NULL, 16);
+			else
+				cmd_vol = -1;
+			if (cmd_vol < 0 || cmd_vol >= (int) volumes.size()){
+				network_send("509 Stale file handle");
+				return NULL;
+			}
+			arg.erase(0, 2);
+		}
+		else if (command == "home")
+			cmd_vol = 0;
+		else if (command == "mkdir" || command == "ls" || command == "lsl" || command == "cd" ||
+		         command == "rmdir" || command == "create" || command == "append" || command == "stat" ||
+		         command == "cat" || command == "head" || command == "rm" || command == "rmr" ||
+		         command == "du" || command == "tree" || command == "open" || command == "mv" ||
+		         command == "cp" || command == "truncate"){
+			cmd_vol = path_volume(arg);
+			if (cmd_vol >= 0 && (command == "mv" || command == "cp") && path_volume(arg2) != cmd_vol){
+				network_send("513 Not within one volume");
+				return NULL;
+			}
+			if (cmd_vol == -2){
+				network_send("503 File does not exist");
+				return NULL;
+			}
+			if (cmd_vol == -1){
+				volume_root(command);
+				return NULL;
+			}
+		}
+	}
+	bfs = volumes[cmd_vol].disk;
+	return bfs;
 }
 
-// unmounts the file system
+// splits path into its volume and the path within it
+int FileSys::path_volume(string &path){
+	if (path[0] != '/' && curr_vol >= 0)
+		return curr_vol;
+	size_t start = path.find_first_not_of('/');
+	if (start == string::npos)
+		return -1;
+	size_t end = path.find('/', start);
+	string name = path.substr(start, end == string::npos ? string::npos : end - start);
+	for (size_t i = 0; i < volumes.size(); i++){
+		if (volumes[i].name == name){
+			path = end == string::npos ? "/" : path.substr(end);
+			return i;
+		}
+	}
+	return -2;
+}
+
+// responds to a command on "/", which lists the volumes
+void FileSys::volume_root(const string &command){
+	string body;
+	if (command == "cd"){
+		curr_vol = -1;
+		network_send("200 OK");
+		return;
+	}
+	if (command != "ls" && command != "lsl"){
+		network_send("513 Not within one volume");
+		return;
+	}
+	for (size_t i = 0; i < volumes.size(); i++){
+		char line[64];
+		if (command == "lsl")
+			snprintf(line, sizeof line, "d %4d %5s %3d %s/\n", 1, "-", 1, volumes[i].name.c_str());
+		else
+			snprintf(line, sizeof line, "%s/\n", volumes[i].name.c_str());
+		body.append(line);
+	}
+	network_send("200 OK", body);
+}
+
+// sends the connection home on its volume if its directory was removed
+void FileSys::check_cwd(){
+	if (cmd_vol != curr_vol || bfs->times_freed(curr_dir) == curr_frees)
+		return;
+	curr_dir = 1;
+	curr_frees = 0;
+	curr_in_snapshot = false;
+}
+
+// unmounts the file system (the disk stays mounted for other connections)
 void FileSys::unmount() {
-  bfs.unmount();
-  close(fs_sock);
+  fs_chan.close();
 }
 
 // make a directory
-void FileSys::mkdir(const char *name) {
+void FileSys::mkdir(const char *path) {
+	short dir;
+	string name;
+	if (!resolve(path, dir, name) || read_only())
+		return;
+	if (name.empty()){
+		network_send("502 File exists");
+		return;
+	}
 	// Check name length
-	if ((int) strlen(name) > MAX_FNAME_SIZE) {
+	if ((int) name.length() > MAX_FNAME_SIZE) {
 		network_send("504 File name is too long");
 		return;
 	}
 	// Check for duplicate
 	dirblock_t curr;
-	bfs.read_block(curr_dir, (void*) &curr);
+	bfs->read_block(dir, (void*) &curr);
 	for(int i=0; i<curr.num_entries; i++){
-		if (!strcmp(curr.dir_entries[i].name, name)){
+		if (name == curr.dir_entries[i].name){
 			network_send("502 File exists");
 			return;
 		}
 	}
+	// Check if directory is full (before allocating, so no block leaks)
+	if (curr.num_entries == MAX_DIR_ENTRIES){
+		network_send("506 Directory is full");
+		return;
+	}
 	// Check if disk is full
-	short block = bfs.get_free_block();
+	short block = bfs->get_free_block();
 	if (!block){
 		network_send("505 Disk is full");
 		return;
 	}
-	// Check if directory is full
-	if (curr.num_entries == MAX_DIR_ENTRIES){
-		network_send("506 Directory is full");
-		return;
-	}
 	// Create directory
-	dirblock_t dir = {
+	dirblock_t new_dir = {
 		DIR_MAGIC_NUM,	// magic
 		0,				// num_entries
 	};
 	for (int i=0; i<MAX_DIR_ENTRIES; i++)
-		dir.dir_entries[i].block_num = 0;
+		new_dir.dir_entries[i].block_num = 0;
 	
-	bfs.write_block(block, (void*) &dir);
+	bfs->write_block(block, (void*) &new_dir);
 	
-	// Update current directory
-	strcpy(curr.dir_entries[curr.num_entries].name, name);
+	// Update parent directory
+	strcpy(curr.dir_entries[curr.num_entries].name, name.c_str());
 	curr.dir_entries[curr.num_entries].block_num = block;
 	curr.num_entries++;
-	bfs.write_block(curr_dir, (void*) &curr);
+	bfs->write_block(dir, (void*) &curr);
+	bfs->dentries.insert(dir, name, block, true);
+	bfs->add_inodes(1);
 	network_send("200 OK");
 }
 
 // switch to a directory
-void FileSys::cd(const char *name) {
-	dirblock_t curr;
-	dirblock_t dir;
-	bfs.read_block(curr_dir, (void*) &curr);
-	for(int i=0; i<curr.num_entries; i++){
-		if (!strcmp(curr.dir_entries[i].name, name)){
-			// Check if file is directory
-			if (!is_directory(curr.dir_entries[i].block_num)){
-				network_send("500 File is not a directory");
-				return;
-			}
-			curr_dir = curr.dir_entries[i].block_num;
-			network_send("200 OK");
+void FileSys::cd(const char *path) {
+	short dir;
+	string name;
+	bool is_dir;
+	if (!resolve(path, dir, name))
+		return;
+	if (!name.empty()){
+		short block = lookup(dir, name, is_dir);
+		if (!block){
+			network_send("503 File does not exist");
+			return;
+		}
+		// Check if file is directory
+		if (!is_dir){
+			network_send("500 File is not a directory");
 			return;
 		}
+		dir = block;
 	}
-	network_send("503 File does not exist");
+	curr_vol = cmd_vol;
+	curr_dir = dir;
+	curr_frees = bfs->times_freed(dir);
+	curr_in_snapshot = in_snapshot;
+	network_send("200 OK");
 }
 
 // switch to home directory
 void FileSys::home() {
+	curr_vol = 0;
 	curr_dir = 1;
+	curr_frees = 0;
+	curr_in_snapshot = false;
 	network_send("200 OK");
 }
 
 // remove a directory
-void FileSys::rmdir(const char *name){
+void FileSys::rmdir(const char *path){
+	short dir;
+	string name;
 	dirblock_t curr;
 	dirblock_t del;
-	bfs.read_block(curr_dir, (void*) &curr);
-	for(int i=0; i<curr.num_entries; i++){
-		if (!strcmp(curr.dir_entries[i].name, name)){
+	if (!resolve(path, dir, name) || read_only())
+		return;
+	bfs->read_block(dir, (void*) &curr);
+	for(int i=0; i<curr.num_entries && !name.empty(); i++){
+		if (name == curr.dir_entries[i].name){
+			short block = curr.dir_entries[i].block_num;
 			// Check if file is directory
-			if (!is_directory(curr.dir_entries[i].block_num)){
+			if (!is_directory(block)){
 				network_send("500 File is not a directory");
 				return;
 			}
-			bfs.read_block(curr.dir_entries[i].block_num, (void*) &del);
+			bfs->read_block(block, (void*) &del);
 			// Check that directory is empty
 			if (del.num_entries){
 				network_send("507 Directory is not empty");
 				return;
 			}
-			bfs.reclaim_block(curr.dir_entries[i].block_num);
-			curr.dir_entries[i].block_num = 0;
-			curr.num_entries--;
-			bfs.write_block(curr_dir, (void*) &curr);
+			bfs->reclaim_block(block);
+			bfs->add_inodes(-1);
+			remove_entry(curr, i);
+			bfs->write_block(dir, (void*) &curr);
+			bfs->dentries.insert(dir, name, 0, false);
+			bfs->dentries.invalidate_dir(block);
 			network_send("200 OK");
 			return;
 		}
@@ -128,122 +273,222 @@ void FileSys::rmdir(const char *name){
 	network_send("503 File does not exist");
 }
 
-// list the contents of current directory
-void FileSys::ls(){
+// list the contents of a directory, the current one if path is empty
+void FileSys::ls(const char *path){
+	short dir;
+	string name;
+	bool is_dir;
 	string body;
 	dirblock_t curr;
-	bfs.read_block(curr_dir, (void*) &curr);
+	if (!resolve(path, dir, name))
+		return;
+	if (!name.empty()){
+		short block = lookup(dir, name, is_dir);
+		if (!block){
+			network_send("503 File does not exist");
+			return;
+		}
+		if (!is_dir){
+			network_send("500 File is not a directory");
+			return;
+		}
+		dir = block;
+	}
+	bfs->read_block(dir, (void*) &curr);
 	for(int i=0; i<curr.num_entries; i++){
 		body.append(curr.dir_entries[i].name);
-		if (is_directory(curr.dir_entries[i].block_num))
+		// the cache usually knows the type, saving a read per entry
+		short block;
+		if (!bfs->dentries.find(dir, curr.dir_entries[i].name, block, is_dir) ||
+		    block != curr.dir_entries[i].block_num){
+			is_dir = is_directory(curr.dir_entries[i].block_num);
+			bfs->dentries.insert(dir, curr.dir_entries[i].name, curr.dir_entries[i].block_num, is_dir);
+		}
+		if (is_dir)
 			body.append("/");
 		body.append("\n");
 	}
 	network_send("200 OK", body);
 }
 
+// list a directory with attributes, reading each entry's block once
+void FileSys::lsl(const char *path){
+	short dir;
+	string name;
+	bool is_dir;
+	string body;
+	dirblock_t curr;
+	if (!resolve(path, dir, name))
+		return;
+	if (!name.empty()){
+		short block = lookup(dir, name, is_dir);
+		if (!block){
+			network_send("503 File does not exist");
+			return;
+		}
+		if (!is_dir){
+			network_send("500 File is not a directory");
+			return;
+		}
+		dir = block;
+	}
+	bfs->read_block(dir, (void*) &curr);
+	for(int i=0; i<curr.num_entries; i++){
+		short block = curr.dir_entries[i].block_num;
+		inode_t node;
+		char line[64];
+		bfs->read_block(block, (void*) &node);
+		is_dir = node.magic == DIR_MAGIC_NUM;
+		bfs->dentries.insert(dir, curr.dir_entries[i].name, block, is_dir);
+		if (is_dir)
+			snprintf(line, sizeof line, "d %4d %5s %3d %s/\n", block, "-", 1, curr.dir_entries[i].name);
+		else
+			snprintf(line, sizeof line, "- %4d %5u %3d %s\n", block, node.size, file_blocks(node), curr.dir_entries[i].name);
+		body.append(line);
+	}
+	network_send("200 OK", body);
+}
+
 // create an empty data file
-void FileSys::create(const char *name){
+void FileSys::create(const char *path){
+	short dir;
+	string name;
+	if (!resolve(path, dir, name) || read_only())
+		return;
+	if (name.empty()){
+		network_send("502 File exists");
+		return;
+	}
 	// Check name length
-	if ((int) strlen(name) > MAX_FNAME_SIZE) {
+	if ((int) name.length() > MAX_FNAME_SIZE) {
 		network_send("504 File name is too long");
 		return;
 	}
 	// Check for duplicate
 	dirblock_t curr;
-	bfs.read_block(curr_dir, (void*) &curr);
+	bfs->read_block(dir, (void*) &curr);
 	for(int i=0; i<curr.num_entries; i++){
-		if (!strcmp(curr.dir_entries[i].name, name)){
+		if (name == curr.dir_entries[i].name){
 			network_send("502 File exists");
 			return;
 		}
 	}
+	// Check if directory is full (before allocating, so no block leaks)
+	if (curr.num_entries == MAX_DIR_ENTRIES){
+		network_send("506 Directory is full");
+		return;
+	}
 	// Check if disk is full
-	short block = bfs.get_free_block();
+	short block = bfs->get_free_block();
 	if (!block){
 		network_send("505 Disk is full");
 		return;
 	}
-	// Check if directory is full
-	if (curr.num_entries == MAX_DIR_ENTRIES){
-		network_send("506 Directory is full");
-		return;
-	}
 	
 	inode_t node = {
 		INODE_MAGIC_NUM,	// magic
 		0,					// size
+		bfs->new_generation(),	// generation
 	};
 	for(int i=0; i<MAX_DATA_BLOCKS; i++)
 		node.blocks[i] = 0;
 	
-	bfs.write_block(block, (void*) &node);
+	bfs->write_block(block, (void*) &node);
 	
-	// Update current directory
-	strcpy(curr.dir_entries[curr.num_entries].name, name);
+	// Update parent directory
+	strcpy(curr.dir_entries[curr.num_entries].name, name.c_str());
 	curr.dir_entries[curr.num_entries].block_num = block;
 	curr.num_entries++;
-	bfs.write_block(curr_dir, (void*) &curr);
+	bfs->write_block(dir, (void*) &curr);
+	bfs->dentries.insert(dir, name, block, false);
+	bfs->add_inodes(1);
 	network_send("200 OK");
 }
 
 // append data to a data file
-void FileSys::append(const char *name, const char *data){
-	dirblock_t curr;
+void FileSys::append(const char *path, const char *data){
+	short block = find_file(path);
+	if (block)
+		append_file(block, data);
+}
+
+// append data to the file a handle refers to
+void FileSys::happend(const char *handle, const char *data){
+	short block = find_handle(handle);
+	if (block)
+		append_file(block, data);
+}
+
+// display the contents of a data file
+void FileSys::cat(const char *path){
+	short block = find_file(path);
+	if (block)
+		read_file(block, MAX_FILE_SIZE);
+}
+
+// display the contents of the file a handle refers to
+void FileSys::hcat(const char *handle){
+	short block = find_handle(handle);
+	if (block)
+		read_file(block, MAX_FILE_SIZE);
+}
+
+// display the first N bytes of the file
+void FileSys::head(const char *path, unsigned int n){
+	short block = find_file(path);
+	if (block)
+		read_file(block, n);
+}
+
+// set the size of a data file
+void FileSys::truncate(const char *path, unsigned long size){
+	short block = find_file(path);
+	if (block)
+		resize_file(block, size);
+}
+
+// display the first N bytes of the file a handle refers to
+void FileSys::hhead(const char *handle, unsigned int n){
+	short block = find_handle(handle);
+	if (block)
+		read_file(block, n);
+}
+
+// open a data file, returning a handle for the h* commands
+void FileSys::open(const char *path){
 	inode_t file;
-	size_t len = strlen(data);
-	// Finding file
-	bfs.read_block(curr_dir, (void*) &curr);
-	for(int i=0; i<curr.num_entries; i++){
-		if (!strcmp(curr.dir_entries[i].name, name)){
+	short block = find_file(path);
+	if (!block)
+		return;
+	bfs->read_block(block, (void*) &file);
+	char handle[16];
+	snprintf(handle, sizeof handle, "%04x%08x", (unsigned int) block, file.generation);
+	// with several volumes, two hex digits of volume come first
+	if (volumes.size() > 1)
+		snprintf(handle, sizeof handle, "%02x%04x%08x", cmd_vol, (unsigned int) block, file.generation);
+	network_send("200 OK", handle);
+}
+
+// delete a data file
+void FileSys::rm(const char *path){
+	short dir;
+	string name;
+	dirblock_t curr;
+	if (!resolve(path, dir, name) || read_only())
+		return;
+	bfs->read_block(dir, (void*) &curr);
+	for(int i=0; i<curr.num_entries && !name.empty(); i++){
+		if (name == curr.dir_entries[i].name){
+			short block = curr.dir_entries[i].block_num;
 			// Check if file is directory
-			if (is_directory(curr.dir_entries[i].block_num)){
+			if (is_directory(block)){
 				network_send("501 File is a directory");
 				return;
 			}
-			bfs.read_block(curr.dir_entries[i].block_num, (void*) &file);
-			// Checking filesize
-			if ((file.size + (int) len) > MAX_FILE_SIZE){
-				network_send("508 Append exceeds maximum file size");
-				return;
-			}
-			int curr_block = file.size/BLOCK_SIZE;
-			int head = file.size - (BLOCK_SIZE * curr_block);
-			datablock_t write;
-			// Load block if it has been allocated
-			if (file.blocks[curr_block])
-				bfs.read_block(file.blocks[curr_block],(void*) &write);
-			
-			for(int j=0; j<(int) len; j++){
-				// If block is full
-				if (head == BLOCK_SIZE){
-					head = 0;
-					if (!file.blocks[curr_block]){
-						file.blocks[curr_block] = bfs.get_free_block();
-						// Check if disk is full
-						if (!file.blocks[curr_block]){
-							network_send("505 Disk is full");
-							return;
-						}
-					}
-					bfs.write_block(file.blocks[curr_block], (void*) &write);
-					curr_block++;
-				}
-				write.data[head] = data[j];
-				head++;
-				file.size++;
-			}
-			// Final write
-			if (!file.blocks[curr_block]){
-				file.blocks[curr_block] = bfs.get_free_block();
-				// Check if disk is full
-				if (!file.blocks[curr_block]){
-					network_send("505 Disk is full");
-					return;
-				}
-			}
-			bfs.write_block(file.blocks[curr_block], (void*) &write);
-			bfs.write_block(curr.dir_entries[i].block_num, (void*) &file);
+			free_file(block);
+			remove_entry(curr, i);
+			bfs->write_block(dir, (void*) &curr);
+			bfs->dentries.insert(dir, name, 0, false);
 			network_send("200 OK");
 			return;
 		}
@@ -251,198 +496,1006 @@ void FileSys::append(const char *name, const char *data){
 	network_send("503 File does not exist");
 }
 
-// display the contents of a data file
-void FileSys::cat(const char *name){
+// delete a data file or a whole subtree, freeing its blocks with one
+// update of the bitmap
+void FileSys::rmr(const char *path){
+	short dir;
+	string name;
+	bool is_dir;
+	if (!resolve(path, dir, name) || read_only())
+		return;
+	short block = name.empty() ? 0 : lookup(dir, name, is_dir);
+	if (!block){
+		network_send("503 File does not exist");
+		return;
+	}
+	vector<short> freed;
+	int removed;
+	if (is_dir)
+		removed = collect_tree(block, freed);
+	else {
+		inode_t file;
+		bfs->read_block(block, (void*) &file);
+		removed = collect_file(block, file, freed);
+	}
 	dirblock_t curr;
-	inode_t file;
-	datablock_t read;
+	bfs->read_block(dir, (void*) &curr);
+	remove_entry(curr, find_entry(curr, name));
+	bfs->write_block(dir, (void*) &curr);
+	bfs->reclaim_blocks(&freed[0], freed.size());
+	bfs->add_inodes(-removed);
+	bfs->dentries.insert(dir, name, 0, false);
+	network_send("200 OK");
+}
+
+// display the space used below a directory
+void FileSys::du(const char *path){
+	short dir;
+	string name;
+	bool is_dir;
 	string body;
-	// Finding file
-	bfs.read_block(curr_dir, (void*) &curr);
+	if (!resolve(path, dir, name))
+		return;
+	if (!name.empty()){
+		short block = lookup(dir, name, is_dir);
+		if (!block){
+			network_send("503 File does not exist");
+			return;
+		}
+		if (!is_dir){
+			network_send("500 File is not a directory");
+			return;
+		}
+		dir = block;
+	}
+	int blocks = 0;
+	long bytes = 0;
+	du_dir(dir, *path ? path : ".", body, blocks, bytes);
+	network_send("200 OK", body);
+}
+
+// display the tree below a directory
+void FileSys::tree(const char *path){
+	short dir;
+	string name;
+	bool is_dir;
+	if (!resolve(path, dir, name))
+		return;
+	if (!name.empty()){
+		short block = lookup(dir, name, is_dir);
+		if (!block){
+			network_send("503 File does not exist");
+			return;
+		}
+		if (!is_dir){
+			network_send("500 File is not a directory");
+			return;
+		}
+		dir = block;
+	}
+	string body = string(*path ? path : ".") + "\n";
+	int dirs = 0, files = 0;
+	tree_dir(dir, "", body, dirs, files);
+	body.append("\n" + to_string(dirs) + " directories, " + to_string(files) + " files\n");
+	network_send("200 OK", body);
+}
+
+// move or rename a file or directory
+void FileSys::mv(const char *from, const char *to){
+	short src_dir, dst_dir;
+	string src_name, dst_name;
+	bool is_dir, target_is_dir = false;
+	if (!resolve(from, src_dir, src_name) || read_only())
+		return;
+	short block = src_name.empty() ? 0 : lookup(src_dir, src_name, is_dir);
+	if (!block){
+		network_send("503 File does not exist");
+		return;
+	}
+	if (!resolve(to, dst_dir, dst_name) || read_only())
+		return;
+	// Moving into a directory keeps the name
+	short target = dst_name.empty() ? dst_dir : lookup(dst_dir, dst_name, target_is_dir);
+	if (dst_name.empty() || (target && target_is_dir && target != block)){
+		dst_dir = target;
+		dst_name = src_name;
+		target = lookup(dst_dir, dst_name, target_is_dir);
+	}
+	if (target == block){
+		network_send("200 OK");
+		return;
+	}
+	if ((int) dst_name.length() > MAX_FNAME_SIZE){
+		network_send("504 File name is too long");
+		return;
+	}
+	// Only a data file can replace a data file
+	if (target && (is_dir || target_is_dir)){
+		network_send("502 File exists");
+		return;
+	}
+	if (is_dir && contains(block, dst_dir)){
+		network_send("510 Cannot move a directory into itself");
+		return;
+	}
+	dirblock_t src, dst;
+	bfs->read_block(src_dir, (void*) &src);
+	dirblock_t &dest = dst_dir == src_dir ? src : dst;
+	if (dst_dir != src_dir)
+		bfs->read_block(dst_dir, (void*) &dst);
+	if (!target && dst_dir != src_dir && dst.num_entries == MAX_DIR_ENTRIES){
+		network_send("506 Directory is full");
+		return;
+	}
+	// Drop the file being replaced, then relink
+	if (target){
+		free_file(target);
+		remove_entry(dest, find_entry(dest, dst_name));
+	}
+	remove_entry(src, find_entry(src, src_name));
+	strcpy(dest.dir_entries[dest.num_entries].name, dst_name.c_str());
+	dest.dir_entries[dest.num_entries].block_num = block;
+	dest.num_entries++;
+	bfs->write_block(src_dir, (void*) &src);
+	if (dst_dir != src_dir)
+		bfs->write_block(dst_dir, (void*) &dst);
+	bfs->dentries.insert(src_dir, src_name, 0, false);
+	bfs->dentries.insert(dst_dir, dst_name, block, is_dir);
+	network_send("200 OK");
+}
+
+// copy a data file, sharing its data blocks
+void FileSys::cp(const char *from, const char *to){
+	short dst_dir;
+	string dst_name;
+	bool target_is_dir = false;
+	short block = find_file(from);
+	if (!block)
+		return;
+	if (!resolve(to, dst_dir, dst_name) || read_only())
+		return;
+	// Copying into a directory keeps the name
+	short target = dst_name.empty() ? dst_dir : lookup(dst_dir, dst_name, target_is_dir);
+	if (dst_name.empty() || (target && target_is_dir)){
+		dst_dir = target;
+		const char *slash = strrchr(from, '/');
+		dst_name = slash ? slash + 1 : from;
+		target = lookup(dst_dir, dst_name, target_is_dir);
+	}
+	if (target == block || (target && target_is_dir)){
+		network_send("502 File exists");
+		return;
+	}
+	if ((int) dst_name.length() > MAX_FNAME_SIZE){
+		network_send("504 File name is too long");
+		return;
+	}
+	dirblock_t dst;
+	bfs->read_block(dst_dir, (void*) &dst);
+	if (!target && dst.num_entries == MAX_DIR_ENTRIES){
+		network_send("506 Directory is full");
+		return;
+	}
+	// An overwritten file keeps its inode, and so its handles
+	inode_t copy, old;
+	bfs->read_block(block, (void*) &copy);
+	short node = target;
+	if (target){
+		bfs->read_block(target, (void*) &old);
+		copy.generation = old.generation;
+		for (int j=0; old.size > MAX_INLINE_SIZE && j<MAX_DATA_BLOCKS; j++){
+			if (old.blocks[j])
+				bfs->reclaim_block(old.blocks[j]);
+		}
+	}
+	else {
+		node = bfs->get_free_block();
+		if (!node){
+			network_send("505 Disk is full");
+			return;
+		}
+		copy.generation = bfs->new_generation();
+	}
+	for (int j=0; copy.size > MAX_INLINE_SIZE && j<MAX_DATA_BLOCKS; j++){
+		if (copy.blocks[j])
+			bfs->share_block(copy.blocks[j]);
+	}
+	bfs->write_block(node, (void*) &copy);
+	if (!target){
+		strcpy(dst.dir_entries[dst.num_entries].name, dst_name.c_str());
+		dst.dir_entries[dst.num_entries].block_num = node;
+		dst.num_entries++;
+		bfs->write_block(dst_dir, (void*) &dst);
+		bfs->dentries.insert(dst_dir, dst_name, node, false);
+		bfs->add_inodes(1);
+	}
+	network_send("200 OK");
+}
+
+// freeze the current tree as snapshot name
+void FileSys::snapshot(const char *name){
+	if (!*name || strlen(name) > MAX_FNAME_SIZE){
+		network_send("504 File name is too long");
+		return;
+	}
+	dirblock_t snaps;
+	bfs->read_block(SNAPSHOT_BLOCK, (void*) &snaps);
+	if (find_entry(snaps, name) != -1){
+		network_send("502 File exists");
+		return;
+	}
+	if (snaps.num_entries == MAX_DIR_ENTRIES){
+		network_send("506 Directory is full");
+		return;
+	}
+	// fail before copying anything rather than leave half a snapshot
+	int copies = count_tree(1);
+	if (copies > bfs->num_free_blocks()){
+		network_send("505 Disk is full");
+		return;
+	}
+	// the copies, the bitmap, the snapshot directory, and at worst every
+	// block of reference counts, checksums and dedup bitmap must fit in
+	// one journal transaction
+	if (copies + 3 + REFCOUNT_BLOCKS + CHECKSUM_BLOCKS > JOURNAL_MAX_BLOCKS){
+		network_send("517 Too many files for one snapshot");
+		return;
+	}
+	short root = freeze_tree(1);
+	bfs->add_inodes(copies);
+	strcpy(snaps.dir_entries[snaps.num_entries].name, name);
+	snaps.dir_entries[snaps.num_entries].block_num = root;
+	snaps.num_entries++;
+	bfs->write_block(SNAPSHOT_BLOCK, (void*) &snaps);
+	bfs->dentries.insert(SNAPSHOT_BLOCK, name, root, true);
+	network_send("200 OK");
+}
+
+// delete snapshot name
+void FileSys::rmsnap(const char *name){
+	dirblock_t snaps;
+	bfs->read_block(SNAPSHOT_BLOCK, (void*) &snaps);
+	int i = find_entry(snaps, name);
+	if (i == -1){
+		network_send("503 File does not exist");
+		return;
+	}
+	vector<short> freed;
+	int removed = collect_tree(snaps.dir_entries[i].block_num, freed);
+	remove_entry(snaps, i);
+	bfs->write_block(SNAPSHOT_BLOCK, (void*) &snaps);
+	bfs->reclaim_blocks(&freed[0], freed.size());
+	bfs->add_inodes(-removed);
+	bfs->dentries.insert(SNAPSHOT_BLOCK, name, 0, false);
+	network_send("200 OK");
+}
+
+// Number of directories and files below dir, dir included.
+int FileSys::count_tree(short dir){
+	dirblock_t curr;
+	int count = 1;
+	bfs->read_block(dir, (void*) &curr);
 	for(int i=0; i<curr.num_entries; i++){
-		if (!strcmp(curr.dir_entries[i].name, name)){
-			// Check if file is directory
-			if (is_directory(curr.dir_entries[i].block_num)){
-				network_send("501 File is a directory");
+		short block = curr.dir_entries[i].block_num;
+		count += is_directory(block) ? count_tree(block) : 1;
+	}
+	return count;
+}
+
+// Copies directory dir and everything below it, except the data blocks,
+// which the copies share. Returns the copy of dir.
+short FileSys::freeze_tree(short dir){
+	dirblock_t curr;
+	bfs->read_block(dir, (void*) &curr);
+	for(int i=0; i<curr.num_entries; i++){
+		short block = curr.dir_entries[i].block_num;
+		inode_t node;
+		bfs->read_block(block, (void*) &node);
+		if (node.magic == DIR_MAGIC_NUM){
+			curr.dir_entries[i].block_num = freeze_tree(block);
+			continue;
+		}
+		for (int j=0; node.size > MAX_INLINE_SIZE && j<MAX_DATA_BLOCKS; j++){
+			if (node.blocks[j])
+				bfs->share_block(node.blocks[j]);
+		}
+		node.generation = bfs->new_generation() | SNAPSHOT_GENERATION;
+		curr.dir_entries[i].block_num = bfs->get_free_block();
+		bfs->write_block(curr.dir_entries[i].block_num, (void*) &node);
+	}
+	short copy = bfs->get_free_block();
+	bfs->write_block(copy, (void*) &curr);
+	return copy;
+}
+
+// display stats about file or directory
+void FileSys::stat(const char *path){
+	short dir;
+	string name;
+	bool is_dir = true;
+	string body;
+	if (!resolve(path, dir, name))
+		return;
+	short block = dir;
+	if (!name.empty())
+		block = lookup(dir, name, is_dir);
+	if (!block){
+		network_send("503 File does not exist");
+		return;
+	}
+	// Directory
+	if (is_dir){
+		body.append("Directory name: ");
+		body.append(name);
+		body.append("/\nDirectory block: " + to_string(block) + "\n");
+	}
+	// File
+	else {
+		stat_file(block);
+		return;
+	}
+	network_send("200 OK", body);
+}
+
+// display stats about the file a handle refers to
+void FileSys::hstat(const char *handle){
+	short block = find_handle(handle);
+	if (block)
+		stat_file(block);
+}
+
+// display the server's statistics
+void FileSys::stats(){
+	network_send("200 OK", server_stats.report());
+}
+
+// write every volume kept in memory to its image file now
+void FileSys::sync(){
+	for (size_t i = 0; i < volumes.size(); i++)
+		volumes[i].disk->save();
+	network_send("200 OK");
+}
+
+// display the space and inodes used and free on every volume. Any free
+// block can hold an inode, so free inodes are free blocks.
+void FileSys::df(){
+	char line[128];
+	snprintf(line, sizeof line, "%-10s %7s %7s %7s %4s %7s %7s\n",
+	         "Volume", "Blocks", "Used", "Free", "Use%", "Inodes", "IFree");
+	string body = line;
+	for (size_t i = 0; i < volumes.size(); i++){
+		int free_blocks = volumes[i].disk->num_free_blocks();
+		int used = NUM_BLOCKS - free_blocks;
+		snprintf(line, sizeof line, "%-10s %7d %7d %7d %3d%% %7d %7d\n",
+		         volumes[i].name.empty() ? "/" : volumes[i].name.c_str(), NUM_BLOCKS, used,
+		         free_blocks, (used * 100 + NUM_BLOCKS - 1) / NUM_BLOCKS,
+		         volumes[i].disk->num_inodes(), free_blocks);
+		body.append(line);
+	}
+	network_send("200 OK", body);
+}
+
+// compress response bodies from now on
+void FileSys::compress(const char *codec){
+	if (strcmp(codec, "lz") != 0 && strcmp(codec, "none") != 0){
+		network_send("512 Unsupported compression");
+		return;
+	}
+	compressing = strcmp(codec, "lz") == 0;
+	network_send("200 OK");
+}
+
+// sends the response of the last command
+void FileSys::send_response(){
+	send_bytes(response);
+	response.clear();
+}
+
+// takes the response of the last command without sending it
+string FileSys::take_response(){
+	string taken;
+	taken.swap(response);
+	return taken;
+}
+
+// prepares a response the server makes itself
+void FileSys::respond(const string &status, const string &body){
+	network_send(status, body);
+}
+
+// status code of the last response
+int FileSys::last_status(){
+	return status_code;
+}
+
+// total bytes sent to the client
+long long FileSys::bytes_sent(){
+	return sent;
+}
+
+// HELPER FUNCTIONS (optional)
+
+// Appends data to the file whose inode is in block.
+void FileSys::append_file(short block, const char *data){
+	inode_t file;
+	size_t len = strlen(data);
+	bfs->read_block(block, (void*) &file);
+	inode_t orig = file;
+	// a handle may name a file in a snapshot
+	if (file.generation & SNAPSHOT_GENERATION){
+		network_send("514 Snapshot is read-only");
+		return;
+	}
+	// Checking filesize
+	if ((file.size + (int) len) > MAX_FILE_SIZE){
+		network_send("508 Append exceeds maximum file size");
+		return;
+	}
+	// Small files stay inside the inode
+	if (file.size + len <= MAX_INLINE_SIZE){
+		memcpy(file.data + file.size, data, len);
+		file.size += len;
+		bfs->write_block(block, (void*) &file);
+		network_send("200 OK");
+		return;
+	}
+	int curr_block = file.size/BLOCK_SIZE;
+	int head = file.size - (BLOCK_SIZE * curr_block);
+	// a block the file no longer uses, reclaimed once the append can't fail
+	short released = 0;
+	// A hole, and the rest of a block past the end, are zeros
+	datablock_t write;
+	memset(write.data, 0, BLOCK_SIZE);
+	// Outgrowing the inode: its contents start the first data block
+	if (file.size <= MAX_INLINE_SIZE){
+		memcpy(write.data, file.data, file.size);
+		for(int j=0; j<MAX_DATA_BLOCKS; j++)
+			file.blocks[j] = 0;
+	}
+	// Load block if it has been allocated. One shared with a copy of the
+	// file is written to a new block instead.
+	else if (file.blocks[curr_block]){
+		bfs->read_block(file.blocks[curr_block],(void*) &write);
+		if (bfs->is_shared(file.blocks[curr_block])){
+			released = file.blocks[curr_block];
+			file.blocks[curr_block] = 0;
+		}
+	}
+	
+	for(int j=0; j<(int) len; j++){
+		// If block is full
+		if (head == BLOCK_SIZE){
+			head = 0;
+			// Check if disk is full
+			if (!write_file_block(file, curr_block, write, true, released)){
+				undo_append(orig, file);
+				network_send("505 Disk is full");
 				return;
 			}
-			bfs.read_block(curr.dir_entries[i].block_num, (void*) &file);
-			int block = 0;
-			for(int j=0; j<file.size; j++){
-				if (!(j%BLOCK_SIZE))
-					bfs.read_block(file.blocks[block++], (void*) &read);
-				body.append(1, read.data[j%BLOCK_SIZE]);
-			}
-			network_send("200 OK", body);
-			return;
+			curr_block++;
 		}
+		write.data[head] = data[j];
+		head++;
+		file.size++;
 	}
-	network_send("503 File does not exist");
+	// Final write
+	if (!write_file_block(file, curr_block, write, head == BLOCK_SIZE, released)){
+		undo_append(orig, file);
+		network_send("505 Disk is full");
+		return;
+	}
+	bfs->write_block(block, (void*) &file);
+	if (released)
+		bfs->reclaim_block(released);
+	network_send("200 OK");
 }
 
-// display the first N bytes of the file
-void FileSys::head(const char *name, unsigned int n){
-	string body;
-	dirblock_t curr;
+// Writes data as block i of file. With deduplication on, a full block
+// already on disk, in this file or another, is shared rather than written.
+bool FileSys::write_file_block(inode_t &file, int i, datablock_t &data, bool full, short &released){
+	short shared = full ? bfs->find_duplicate(&data) : 0;
+	if (shared){
+		if (file.blocks[i])
+			released = file.blocks[i];
+		file.blocks[i] = shared;
+		return true;
+	}
+	if (!file.blocks[i]){
+		file.blocks[i] = bfs->get_free_block();
+		if (!file.blocks[i])
+			return false;
+	}
+	bfs->write_block(file.blocks[i], (void*) &data);
+	if (full)
+		bfs->index_block(file.blocks[i]);
+	return true;
+}
+
+// Sends the first n bytes of the file whose inode is in block.
+void FileSys::read_file(short block, unsigned int n){
 	inode_t file;
 	datablock_t read;
-	// Finding file
-	bfs.read_block(curr_dir, (void*) &curr);
-	for(int i=0; i<curr.num_entries; i++){
-		// Check if file is directory
-		if (!strcmp(curr.dir_entries[i].name, name)){
-			if (is_directory(curr.dir_entries[i].block_num)){
-				network_send("501 File is a directory");
+	string body;
+	bfs->read_block(block, (void*) &file);
+	int data_block = 0;
+	if (n > file.size)
+		n = file.size;
+	if (file.size <= MAX_INLINE_SIZE)
+		body.append(file.data, n);
+	else for(int j=0; j<n; j++){
+		if (!(j%BLOCK_SIZE)){
+			short p = file.blocks[data_block++];
+			// a hole reads as zeros without touching the disk
+			if (p)
+				bfs->read_block(p, (void*) &read);
+			else
+				memset(read.data, 0, BLOCK_SIZE);
+		}
+		body.append(1, read.data[j%BLOCK_SIZE]);
+	}
+	network_send("200 OK", body);
+}
+
+// Sends stats about the file whose inode is in block.
+void FileSys::stat_file(short block){
+	inode_t node;
+	string body;
+	bfs->read_block(block, (void*) &node);
+	body.append("Inode block: " + to_string(block) + "\nBytes in file: " + to_string(node.size) + "\nNumber of blocks: ");
+	body.append(to_string(file_blocks(node)));
+	// a small file is all inode
+	short first = node.size > MAX_INLINE_SIZE ? node.blocks[0] : 0;
+	body.append("\nFirst block: " + to_string(first) + "\n");
+	network_send("200 OK", body);
+}
+
+// Sets the size of the file whose inode is in block.
+void FileSys::resize_file(short block, unsigned long size){
+	inode_t file;
+	bfs->read_block(block, (void*) &file);
+	if (file.generation & SNAPSHOT_GENERATION){
+		network_send("514 Snapshot is read-only");
+		return;
+	}
+	if (size > MAX_FILE_SIZE){
+		network_send("508 Size exceeds maximum file size");
+		return;
+	}
+	short released = 0;
+	datablock_t data;
+	memset(data.data, 0, BLOCK_SIZE);
+	if (size <= MAX_INLINE_SIZE){
+		// Small enough to move back into the inode
+		if (file.size > MAX_INLINE_SIZE){
+			if (file.blocks[0])
+				bfs->read_block(file.blocks[0], (void*) &data);
+			drop_blocks(file, 0);
+			memcpy(file.data, data.data, size);
+		}
+		if (size > file.size)
+			memset(file.data + file.size, 0, size - file.size);
+	}
+	else if (file.size <= MAX_INLINE_SIZE){
+		// Outgrowing the inode: its contents start the first data block,
+		// the rest is a hole
+		short first = 0;
+		if (file.size){
+			first = bfs->get_free_block();
+			if (!first){
+				network_send("505 Disk is full");
 				return;
 			}
-			bfs.read_block(curr.dir_entries[i].block_num, (void*) &file);
-			int block = 0;
-			if (n > file.size)
-				n = file.size;
-			for(int j=0; j<n; j++){
-				if (!(j%BLOCK_SIZE))
-					bfs.read_block(file.blocks[block++], (void*) &read);
-				body.append(1, read.data[j%BLOCK_SIZE]);
+			memcpy(data.data, file.data, file.size);
+			bfs->write_block(first, (void*) &data);
+		}
+		for (int j=0; j<MAX_DATA_BLOCKS; j++)
+			file.blocks[j] = 0;
+		file.blocks[0] = first;
+	}
+	else if (size < file.size)
+		drop_blocks(file, (size + BLOCK_SIZE - 1)/BLOCK_SIZE);
+	else {
+		// Bytes past the old end, left by an earlier shrink, must read as
+		// zeros now that the file covers them
+		int last = file.size/BLOCK_SIZE;
+		int tail = file.size%BLOCK_SIZE;
+		if (tail && file.blocks[last]){
+			bfs->read_block(file.blocks[last], (void*) &data);
+			bool stale = false;
+			for (int j=tail; j<BLOCK_SIZE && !stale; j++)
+				stale = data.data[j] != 0;
+			if (stale){
+				memset(data.data + tail, 0, BLOCK_SIZE - tail);
+				// One shared with a copy of the file is written to a new block
+				if (bfs->is_shared(file.blocks[last])){
+					released = file.blocks[last];
+					file.blocks[last] = bfs->get_free_block();
+					if (!file.blocks[last]){
+						network_send("505 Disk is full");
+						return;
+					}
+				}
+				bfs->write_block(file.blocks[last], (void*) &data);
+			}
+		}
+	}
+	file.size = size;
+	bfs->write_block(block, (void*) &file);
+	if (released)
+		bfs->reclaim_block(released);
+	network_send("200 OK");
+}
+
+// Frees the data blocks of file from block from on.
+void FileSys::drop_blocks(inode_t &file, int from){
+	vector<short> freed;
+	for (int j=from; j<MAX_DATA_BLOCKS; j++){
+		if (file.blocks[j])
+			freed.push_back(file.blocks[j]);
+		file.blocks[j] = 0;
+	}
+	if (!freed.empty())
+		bfs->reclaim_blocks(&freed[0], freed.size());
+}
+
+// Blocks a data file occupies, its inode included.
+int FileSys::file_blocks(const inode_t &file){
+	if (file.size <= MAX_INLINE_SIZE)
+		return 1;
+	int blocks = 1;
+	for (int j=0; j<(int) (file.size + BLOCK_SIZE - 1)/BLOCK_SIZE; j++){
+		if (file.blocks[j])
+			blocks++;
+	}
+	return blocks;
+}
+
+// Checks a handle from open: 4 hex digits of inode block, then 8 of
+// generation. Sends 509 and returns 0 if the file it named is gone,
+// which the bitmap and generation show without any directory lookup.
+short FileSys::find_handle(const char *handle){
+	inode_t file;
+	bool hex = strlen(handle) == 12;
+	for (int i = 0; hex && i < 12; i++)
+		hex = isxdigit((unsigned char) handle[i]);
+	unsigned long long h = strtoull(handle, NULL, 16);
+	short block = (short) (h >> 32);
+	if (!hex || block < 2 || block >= NUM_BLOCKS ||
+	    !bfs->is_allocated(block)){
+		network_send("509 Stale file handle");
+		return 0;
+	}
+	bfs->read_block(block, (void*) &file);
+	if (file.magic != INODE_MAGIC_NUM || file.generation != (unsigned int) h){
+		network_send("509 Stale file handle");
+		return 0;
+	}
+	return block;
+}
+
+// Resolves path, absolute or relative to the current directory, to the
+// directory holding its last component and that component's name. "."
+// is skipped and ".." goes to the parent, the root's being the root. The
+// name is empty if path names a directory itself, e.g. "/" or "..".
+// Sends the error and returns false if a directory along the way is
+// missing.
+bool FileSys::resolve(const char *path, short &dir, string &name){
+	dir = path[0] == '/' ? 1 : curr_dir;
+	in_snapshot = path[0] == '/' ? false : curr_in_snapshot;
+	name.clear();
+	vector<short> walked;	// directories passed through, for ".."
+	const char *p = path;
+	while (1){
+		while (*p == '/')
+			p++;
+		const char *end = strchr(p, '/');
+		if (!end)
+			end = p + strlen(p);
+		const char *next = end;
+		while (*next == '/')
+			next++;
+		string component(p, end - p);
+		if (component == ".."){
+			if (!walked.empty()){
+				dir = walked.back();
+				walked.pop_back();
 			}
-			network_send("200 OK", body);
-			return;
+			else
+				dir = parent(dir);
+			in_snapshot = in_snapshot && dir != 1;
 		}
+		else if (component != "." && !*next){
+			name = component;
+			in_snapshot = in_snapshot || (dir == 1 && name == SNAPSHOT_DIR_NAME);
+			return true;
+		}
+		else if (component != "."){
+			bool is_dir;
+			short block = lookup(dir, component, is_dir);
+			if (!block){
+				network_send("503 File does not exist");
+				return false;
+			}
+			if (!is_dir){
+				network_send("500 File is not a directory");
+				return false;
+			}
+			walked.push_back(dir);
+			dir = block;
+			in_snapshot = in_snapshot || dir == SNAPSHOT_BLOCK;
+		}
+		// "." and ".." last name the directory itself
+		if (!*next)
+			return true;
+		p = next;
 	}
-	network_send("503 File does not exist");
 }
 
-// delete a data file
-void FileSys::rm(const char *name){
+// Looks name up in directory dir, through the dentry cache. Returns its
+// block, 0 if it does not exist.
+short FileSys::lookup(short dir, const string &name, bool &is_dir){
+	short block;
+	// the snapshots are a hidden directory of the root
+	if (dir == 1 && name == SNAPSHOT_DIR_NAME){
+		is_dir = true;
+		return SNAPSHOT_BLOCK;
+	}
+	if (bfs->dentries.find(dir, name, block, is_dir))
+		return block;
 	dirblock_t curr;
+	bfs->read_block(dir, (void*) &curr);
+	block = 0;
+	is_dir = false;
+	for(int i=0; i<curr.num_entries; i++){
+		if (name == curr.dir_entries[i].name){
+			block = curr.dir_entries[i].block_num;
+			is_dir = is_directory(block);
+			break;
+		}
+	}
+	bfs->dentries.insert(dir, name, block, is_dir);
+	return block;
+}
+
+// Finds the data file at path. Sends the error and returns 0 if it is
+// missing or a directory.
+short FileSys::find_file(const char *path){
+	short dir;
+	string name;
+	bool is_dir;
+	if (!resolve(path, dir, name))
+		return 0;
+	short block = name.empty() ? dir : lookup(dir, name, is_dir);
+	if (!block){
+		network_send("503 File does not exist");
+		return 0;
+	}
+	if (name.empty() || is_dir){
+		network_send("501 File is a directory");
+		return 0;
+	}
+	return block;
+}
+
+// True, with 514 sent, if the path resolve last walked is in a snapshot.
+bool FileSys::read_only(){
+	if (in_snapshot)
+		network_send("514 Snapshot is read-only");
+	return in_snapshot;
+}
+
+// Frees a data file's blocks and inode.
+void FileSys::free_file(short block){
 	inode_t del;
-	bfs.read_block(curr_dir, (void*) &curr);
+	vector<short> freed;
+	bfs->read_block(block, (void*) &del);
+	bfs->add_inodes(-collect_file(block, del, freed));
+	bfs->reclaim_blocks(&freed[0], freed.size());
+}
+
+// Adds a data file's blocks, then its inode, to freed. Returns 1, the
+// one file added.
+int FileSys::collect_file(short block, const inode_t &file, vector<short> &freed){
+	// a small file has no data blocks allocated, a hole none either
+	for (int j=0; file.size > MAX_INLINE_SIZE && j<MAX_DATA_BLOCKS; j++){
+		if (file.blocks[j])
+			freed.push_back(file.blocks[j]);
+	}
+	freed.push_back(block);
+	return 1;
+}
+
+// Adds every block below directory dir, then dir itself, to freed.
+// Returns the files and directories added, dir included.
+int FileSys::collect_tree(short dir, vector<short> &freed){
+	dirblock_t curr;
+	int count = 1;
+	bfs->read_block(dir, (void*) &curr);
 	for(int i=0; i<curr.num_entries; i++){
-		if (!strcmp(curr.dir_entries[i].name, name)){
-			// Check if file is directory
-			if (is_directory(curr.dir_entries[i].block_num)){
-				network_send("501 File is a directory");
-				return;
-			}
-			bfs.read_block(curr.dir_entries[i].block_num, (void*) &del);
-			// Delete Blocks
-			for (int j=0; j<(del.size/BLOCK_SIZE)+1; j++){
-				bfs.reclaim_block(del.blocks[j]);
-			}
-			// Delete inode
-			bfs.reclaim_block(curr.dir_entries[i].block_num);
-			curr.dir_entries[i].block_num = 0;
-			curr.num_entries--;
-			bfs.write_block(curr_dir, (void*) &curr);
-			network_send("200 OK");
-			return;
+		short block = curr.dir_entries[i].block_num;
+		inode_t node;
+		bfs->read_block(block, (void*) &node);
+		if (node.magic == DIR_MAGIC_NUM)
+			count += collect_tree(block, freed);
+		else
+			count += collect_file(block, node, freed);
+	}
+	bfs->dentries.invalidate_dir(dir);
+	freed.push_back(dir);
+	return count;
+}
+
+// Adds the blocks and bytes below directory dir to the totals, appending
+// a line for dir after the lines of its subdirectories.
+void FileSys::du_dir(short dir, const string &path, string &body, int &blocks, long &bytes){
+	dirblock_t curr;
+	int dir_blocks = 1;
+	long dir_bytes = 0;
+	bfs->read_block(dir, (void*) &curr);
+	for(int i=0; i<curr.num_entries; i++){
+		short block = curr.dir_entries[i].block_num;
+		inode_t node;
+		bfs->read_block(block, (void*) &node);
+		if (node.magic == DIR_MAGIC_NUM)
+			du_dir(block, (path == "/" ? "/" : path + "/") + curr.dir_entries[i].name, body, dir_blocks, dir_bytes);
+		else {
+			dir_blocks += file_blocks(node);
+			dir_bytes += node.size;
 		}
 	}
-	network_send("503 File does not exist");
+	char line[32];
+	snprintf(line, sizeof line, "%5d %7ld ", dir_blocks, dir_bytes);
+	body.append(line + path + "\n");
+	blocks += dir_blocks;
+	bytes += dir_bytes;
 }
 
-// display stats about file or directory
-void FileSys::stat(const char *name){
-	string body;
+// Appends the entries below directory dir to body, each line indented by
+// prefix, counting the directories and files.
+void FileSys::tree_dir(short dir, const string &prefix, string &body, int &dirs, int &files){
 	dirblock_t curr;
-	bfs.read_block(curr_dir, (void*) &curr);
+	bfs->read_block(dir, (void*) &curr);
 	for(int i=0; i<curr.num_entries; i++){
-		if (!strcmp(curr.dir_entries[i].name, name)){
-			// Directory
-			if (is_directory(curr.dir_entries[i].block_num)){
-				body.append("Directory name: ");
-				body.append(curr.dir_entries[i].name);
-				body.append("/\nDirectory block: " + to_string(curr.dir_entries[i].block_num) + "\n");
-			}
-			// File
-			else {
-				inode_t node;
-				bfs.read_block(curr.dir_entries[i].block_num, (void*) &node);
-				body.append("Inode block: " + to_string(curr.dir_entries[i].block_num) + "\nBytes in file: " + to_string(node.size) + "\nNumber of blocks: ");
-				if (node.blocks[0])
-					body.append(to_string(node.size/BLOCK_SIZE + 2));
-				else
-					body.append("1");
-				body.append("\nFirst block: " + to_string(node.blocks[0]) + "\n");
-			}
-			network_send("200 OK", body);
-			return;
+		short block = curr.dir_entries[i].block_num;
+		bool last = i == (int) curr.num_entries - 1;
+		body.append(prefix + (last ? "`-- " : "|-- ") + curr.dir_entries[i].name);
+		if (is_directory(block)){
+			body.append("/\n");
+			dirs++;
+			tree_dir(block, prefix + (last ? "    " : "|   "), body, dirs, files);
+		}
+		else {
+			body.append("\n");
+			files++;
 		}
 	}
-	network_send("503 File does not exist");
 }
 
-// HELPER FUNCTIONS (optional)
+// Index of name in a directory block, -1 if absent.
+int FileSys::find_entry(const dirblock_t &dir, const string &name){
+	for(int i=0; i<dir.num_entries; i++){
+		if (name == dir.dir_entries[i].name)
+			return i;
+	}
+	return -1;
+}
+
+// True if directory dir is target or has it below. Directories have no
+// parent links, so this searches dir's subtree.
+bool FileSys::contains(short dir, short target){
+	if (dir == target)
+		return true;
+	dirblock_t curr;
+	bfs->read_block(dir, (void*) &curr);
+	for(int i=0; i<curr.num_entries; i++){
+		short block = curr.dir_entries[i].block_num;
+		if (is_directory(block) && contains(block, target))
+			return true;
+	}
+	return false;
+}
+
+// The directory holding directory dir, found by searching the tree and
+// the snapshots; the root is its own parent.
+short FileSys::parent(short dir){
+	if (dir == 1 || dir == SNAPSHOT_BLOCK)
+		return 1;
+	short found = find_parent(1, dir);
+	if (!found)
+		found = find_parent(SNAPSHOT_BLOCK, dir);
+	return found ? found : 1;
+}
+
+// The directory at or below dir with an entry for target, 0 if none.
+short FileSys::find_parent(short dir, short target){
+	dirblock_t curr;
+	bfs->read_block(dir, (void*) &curr);
+	for(int i=0; i<curr.num_entries; i++){
+		if (curr.dir_entries[i].block_num == target)
+			return dir;
+	}
+	for(int i=0; i<curr.num_entries; i++){
+		short block = curr.dir_entries[i].block_num;
+		short found = is_directory(block) ? find_parent(block, target) : 0;
+		if (found)
+			return found;
+	}
+	return 0;
+}
+
 bool FileSys::is_directory(short block){
 	dirblock_t dir;
-	bfs.read_block(block, (void*) &dir);
+	bfs->read_block(block, (void*) &dir);
 	return dir.magic == DIR_MAGIC_NUM;
 }
 
-// Send response with no body
-void FileSys::network_send(string message){
-	message.append("\r\n");
-	string length = "Length:0\r\n\r\n";
-	int numbytes, x;
-	numbytes = 0;
-	while (numbytes < (int) message.length()){
-		x = send(fs_sock, (void*) message.c_str(), message.length(), 0);
-		if (x == -1)
-			perror("send");
-		else if (x == 0){
-			unmount();
-			exit(0);
-		}
-		numbytes += x;
-	}
-	numbytes = 0;
-	while (numbytes < (int) length.length()){
-		x = send(fs_sock, (void*) length.c_str(), length.length(), 0);
-		if (x == -1)
-			perror("send");
-		else if (x == 0){
-			unmount();
-			exit(0);
-		}
-		numbytes += x;
+// Reclaims the data blocks a failed append allocated, leaving the file as
+// it was before the append.
+void FileSys::undo_append(const inode_t &orig, const inode_t &file){
+	bool was_inline = orig.size <= MAX_INLINE_SIZE;
+	for (int j=0; j<MAX_DATA_BLOCKS; j++){
+		if (file.blocks[j] && (was_inline || file.blocks[j] != orig.blocks[j]))
+			bfs->reclaim_block(file.blocks[j]);
 	}
 }
 
-// Send response with a body
+// Removes entry i from a directory block. The last entry is moved into the
+// hole so that entries stay in 0..num_entries-1, which every lookup assumes.
+void FileSys::remove_entry(dirblock_t &dir, int i){
+	int last = dir.num_entries - 1;
+	if (i != last)
+		dir.dir_entries[i] = dir.dir_entries[last];
+	dir.dir_entries[last].name[0] = '\0';
+	dir.dir_entries[last].block_num = 0;
+	dir.num_entries--;
+}
+
+// Prepare response with no body
+void FileSys::network_send(string message){
+	network_send(message, "");
+}
+
+// Prepare response with a body, sent by send_response in one write so the
+// body isn't held back by Nagle's algorithm
 void FileSys::network_send(string message, string body){
-	message.append("\r\n");
-	string length = "Length:" + to_string((int) body.length()) + "\r\n\r\n";
-	int numbytes, x;
-	numbytes = 0;
-	while (numbytes < (int) message.length()){
-		x = send(fs_sock, (void*) message.c_str(), message.length() - numbytes, 0);
-		if (x == -1)
-			perror("send");
-		else if (x == 0){
-			unmount();
-			exit(0);
-		}
-		numbytes += x;
-	}
-	numbytes = 0;
-	while (numbytes < (int) length.length()){
-		x = send(fs_sock, (void*) length.c_str(), length.length() - numbytes, 0);
-		if (x == -1)
-			perror("send");
-		else if (x == 0){
-			unmount();
-			exit(0);
+	status_code = atoi(message.c_str());
+	response = message;
+	response.append("\r\n");
+
+	// a body that compresses by at least an eighth goes compressed
+	if (compressing && body.length() >= LZ_MIN_SIZE){
+		long long start = now_ns();
+		string packed;
+		bool smaller = lz_compress(body.data(), body.length(), packed, body.length() - body.length() / 8);
+		server_stats.compress_ns.fetch_add(now_ns() - start, memory_order_relaxed);
+		if (smaller){
+			server_stats.compressed.fetch_add(1, memory_order_relaxed);
+			server_stats.compress_in.fetch_add(body.length(), memory_order_relaxed);
+			server_stats.compress_out.fetch_add(packed.length(), memory_order_relaxed);
+			response.append("Length:" + to_string((int) packed.length()) + "\r\n");
+			response.append("Compressed:" + to_string((int) body.length()) + "\r\n\r\n");
+			response.append(packed);
+			return;
 		}
-		numbytes += x;
+		server_stats.incompressible.fetch_add(1, memory_order_relaxed);
 	}
-	numbytes = 0;
-	while (numbytes < (int) body.length()){
-		x = send(fs_sock, (void*) body.c_str(), body.length() - numbytes, 0);
-		if (x == -1)
+	response.append("Length:" + to_string((int) body.length()) + "\r\n\r\n");
+	response.append(body);
+}
+
+// Send raw bytes to the client. A lost client is noticed by the server's
+// receive loop, which closes the connection. Any descriptor, e.g. /dev/null
+// in the microbenchmarks, can stand in for the socket.
+bool FileSys::send_bytes(const string &data){
+	size_t numbytes = 0;
+	while (numbytes < data.length()){
+		ssize_t x = fs_chan.send(data.c_str() + numbytes, data.length() - numbytes);
+		if (x == -1){
 			perror("send");
-		else if (x == 0){
-			unmount();
-			exit(0);
+			return false;
 		}
 		numbytes += x;
+		sent += x;
 	}
+	return true;
 }
@@ -5,63 +5,258 @@
 #define FILESYS_H
 
 #include <string>
+#include <vector>
 #include "BasicFileSys.h"
+#include "Channel.h"
+#include "Blocks.h"
 
 using namespace std;
 
+// Every command taking a name accepts a slash-separated path, absolute or
+// relative to the current directory, in which "." and ".." name the
+// directory itself and its parent.
 class FileSys {
   
   public:
-    // mounts the file system
-    void mount(int sock);
+    // mounts the file system on an already mounted disk that may be shared
+    // with other connections. Responses go to the client over chan, which
+    // may be a plain descriptor.
+    void mount(Channel chan, BasicFileSys *disk);
+
+    // mounts several disks as volumes. With more than one, "/" lists the
+    // volumes and /name/path is path on volume name; the connection starts
+    // at the root of the first. Handles carry their volume.
+    void mount(Channel chan, const vector<Volume> &vols);
+
+    // picks the volume a command runs on from its paths or handle, and
+    // makes them paths within that volume. Returns the volume's disk, to be
+    // locked around the command, or NULL with the response prepared if
+    // the command needs no volume (ls or cd of "/", sync, df) or was
+    // refused.
+    BasicFileSys *route(const string &command, string &arg, string &arg2);
+
+    // sends the connection to the root of its volume if its current
+    // directory was removed since it went there, by this connection or
+    // another. Called with the command's volume locked, before the command.
+    void check_cwd();
 
     // unmounts the file system
     void unmount();
 
     // make a directory
-    void mkdir(const char *name);
+    void mkdir(const char *path);
 
     // switch to a directory
-    void cd(const char *name);
+    void cd(const char *path);
     
     // switch to home directory
     void home();
     
     // remove a directory
-    void rmdir(const char *name);
+    void rmdir(const char *path);
 
-    // list the contents of current directory
-    void ls();
+    // list the contents of a directory, the current one if path is empty
+    void ls(const char *path = "");
+
+    // list a directory with attributes, one line per entry: type (d or
+    // -), inode or directory block, size in bytes, blocks used, and name
+    void lsl(const char *path = "");
 
     // create an empty data file
-    void create(const char *name);
+    void create(const char *path);
 
     // append data to a data file
-    void append(const char *name, const char *data);
+    void append(const char *path, const char *data);
 
     // display the contents of a data file
-    void cat(const char *name);
+    void cat(const char *path);
 
     // display the first N bytes of the file
-    void head(const char *name, unsigned int n);
+    void head(const char *path, unsigned int n);
+
+    // set the size of a data file. Growing it leaves a hole, with no
+    // blocks allocated, that reads back as zeros; appending after the
+    // hole writes past the old end. Shrinking it frees the blocks past
+    // the new end.
+    void truncate(const char *path, unsigned long size);
 
     // delete a data file
-    void rm(const char *name);
+    void rm(const char *path);
+
+    // delete a data file, or a directory and everything below it
+    void rmr(const char *path);
+
+    // display the blocks and bytes used below a directory, one line per
+    // directory, subdirectories first. A block shared by copies of a file
+    // counts once for each file.
+    void du(const char *path = "");
+
+    // display the tree below a directory
+    void tree(const char *path = "");
 
     // display stats about file or directory
-    void stat(const char *name);
+    void stat(const char *path);
+
+    // move or rename a file or directory. If to is an existing directory
+    // the file moves into it; an existing data file there is replaced.
+    void mv(const char *from, const char *to);
+
+    // copy a data file. If to is an existing directory the copy goes into
+    // it; an existing data file there is overwritten. The copy shares the
+    // source's data blocks until either file appends to a shared block.
+    void cp(const char *from, const char *to);
+
+    // freeze the current tree as snapshot name, reached read-only as
+    // /.snapshot/name. Directories and inodes are copied; data blocks are
+    // shared, so a file written afterwards gets fresh blocks for what it
+    // changes while the snapshot keeps the old ones. Refused with 517 if
+    // the copies would not fit in one journal transaction.
+    void snapshot(const char *name);
+
+    // delete snapshot name, freeing what no file still shares
+    void rmsnap(const char *name);
+
+    // open a data file: returns a handle naming its inode and generation,
+    // which the h* commands below use instead of a path. A handle to a
+    // file that was removed is refused with 509.
+    void open(const char *path);
+
+    // append, cat, head and stat through a handle
+    void happend(const char *handle, const char *data);
+    void hcat(const char *handle);
+    void hhead(const char *handle, unsigned int n);
+    void hstat(const char *handle);
+
+    // display the server's statistics
+    void stats();
+
+    // write every volume kept in memory to its image file now, each as of
+    // a moment between commands. Locks the volumes itself, one at a time,
+    // so route runs it without a volume held.
+    void sync();
+
+    // display the space and inodes used and free on every volume, from
+    // counts kept up to date, without locking them
+    void df();
+
+    // compress response bodies from now on: codec is lz, or none to stop.
+    // Bodies of at least LZ_MIN_SIZE bytes are compressed unless that saves
+    // less than an eighth; their response carries a Compressed header
+    // giving the length before compression.
+    void compress(const char *codec);
+
+    // sends the response of the last command. Commands only prepare their
+    // response, so it can be held back until their changes are durable.
+    void send_response();
+
+    // takes the response of the last command, leaving none to send, and
+    // prepares a response the server makes itself, such as that of a
+    // compound request from its operations'
+    string take_response();
+    void respond(const string &status, const string &body);
+
+    // status code of the last response
+    int last_status();
+
+    // total bytes sent to the client
+    long long bytes_sent();
 
   private:
-    BasicFileSys bfs;	// basic file system
+    BasicFileSys *bfs;	// basic file system (shared between connections)
     short curr_dir;	// current directory
+    unsigned int curr_frees;	// times curr_dir's block was freed when it became current
+    vector<Volume> volumes;	// volumes the connection can reach
+    int curr_vol;	// volume of the current directory, -1 at "/"
+    int cmd_vol;	// volume of the command running
+    bool curr_in_snapshot;	// the current directory is in a snapshot
+    bool in_snapshot;	// the path resolve last walked is in a snapshot
 
-    int fs_sock;  // file server socket
+    Channel fs_chan;  // channel to the client
+    int status_code;  // status code of the last response
+    string response;  // response waiting for send_response
+    long long sent;   // total bytes sent to the client
+    bool compressing; // compress response bodies
 
+	// splits path into its volume, which it returns, and the path within
+	// it; -1 for "/" itself, -2 for a volume that does not exist
+	int path_volume(string &path);
+	
+	// responds to ls, lsl or cd of "/", which lists the volumes
+	void volume_root(const string &command);
+	
+	// resolves path to its parent directory and last component
+	bool resolve(const char *path, short &dir, string &name);
+	
+	// looks name up in directory dir through the dentry cache
+	short lookup(short dir, const string &name, bool &is_dir);
+	
+	// true, with 514 sent, if the path resolve last walked is in a
+	// snapshot, which no command may change
+	bool read_only();
+	
+	// finds the data file at path, 0 (error sent) if there is none
+	short find_file(const char *path);
+	
+	// finds the data file a handle refers to, 0 (error sent) if stale
+	short find_handle(const char *handle);
+	
+	// frees a data file's blocks and inode
+	void free_file(short block);
+	
+	// adds the blocks of a data file, or of a directory and everything
+	// below it, to freed, returning the number of files and directories
+	int collect_file(short block, const inode_t &file, vector<short> &freed);
+	int collect_tree(short dir, vector<short> &freed);
+	
+	// the recursive walks of snapshot, du and tree
+	int count_tree(short dir);
+	short freeze_tree(short dir);
+	void du_dir(short dir, const string &path, string &body, int &blocks, long &bytes);
+	void tree_dir(short dir, const string &prefix, string &body, int &dirs, int &files);
+	
+	// index of name in a directory block, -1 if absent
+	int find_entry(const dirblock_t &dir, const string &name);
+	
+	// true if directory dir is target or has it below
+	bool contains(short dir, short target);
+	
+	// the directory holding directory dir, searched for from the root as
+	// directories have no parent links
+	short parent(short dir);
+	short find_parent(short dir, short target);
+	
+	// the commands on a data file, given its inode block
+	void append_file(short block, const char *data);
+	void read_file(short block, unsigned int n);
+	void stat_file(short block);
+	void resize_file(short block, unsigned long size);
+	
+	// frees the data blocks of file from block from on, leaving holes
+	void drop_blocks(inode_t &file, int from);
+	
+	// blocks a data file occupies, its inode included; holes take none
+	int file_blocks(const inode_t &file);
+	
 	bool is_directory(short block);
 	
+	// writes data as block i of file, allocating the block if the file has
+	// none; a full block may share one already on disk instead, and a
+	// block of the file's own it replaces goes in released. False if the
+	// disk is full.
+	bool write_file_block(inode_t &file, int i, datablock_t &data, bool full, short &released);
+
+	// reclaims the blocks a failed append allocated
+	void undo_append(const inode_t &orig, const inode_t &file);
+	
+	// removes entry i from a directory block, keeping entries contiguous
+	void remove_entry(dirblock_t &dir, int i);
+	
 	void network_send(string message);
 	
 	void network_send(string message, string body);
+	
+	// sends raw bytes, returns false if the client is gone
+	bool send_bytes(const string &data);
 };
 
 #endif 
@@ -0,0 +1,323 @@
+// CPSC 3500: Journal
+// A write-ahead journal kept in the disk image after the file system
+// blocks, with group commit and replay at mount.
+//
+// The log is a ring of JOURNAL_LOG_BLOCKS blocks. A transaction is written
+// as a descriptor listing the home block numbers, the new contents of those
+// blocks, and a commit block carrying a checksum of everything before it,
+// all with one write. Since the whole transaction is covered by the
+// checksum, a single fdatasync makes it durable: if the crash tore the
+// write, replay sees a bad checksum and stops there.
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+#include "Journal.h"
+#include "Stats.h"
+
+// FNV-1a over one block, continuing from sum
+static unsigned int checksum(unsigned int sum, const void *block)
+{
+  const unsigned char *p = (const unsigned char *) block;
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    sum ^= p[i];
+    sum *= 16777619u;
+  }
+  return sum;
+}
+
+static const unsigned int CHECKSUM_SEED = 2166136261u;
+
+// Disk block of log block pos
+static int log_block(unsigned int pos)
+{
+  return JOURNAL_START + 1 + pos % JOURNAL_LOG_BLOCKS;
+}
+
+Journal::Journal() : disk(NULL), in_transaction(false), changes(NULL), next_seq(1), head(0),
+  used(0), written_seq(0), synced_seq(0), syncing(false)
+{
+}
+
+// Opens the journal of a mounted disk, creating an empty one if the disk
+// has none, and replays every committed transaction found in the log.
+void Journal::mount(Storage *d)
+{
+  disk = d;
+
+  // a disk made before the journal existed gets one
+  struct journal_header_t header;
+  if (disk->num_blocks() < JOURNAL_START + JOURNAL_BLOCKS) {
+    format();
+    return;
+  }
+  disk->read_block(JOURNAL_START, (void *) &header);
+  if (header.magic != JOURNAL_MAGIC_NUM || header.start >= (unsigned int) JOURNAL_LOG_BLOCKS) {
+    format();
+    return;
+  }
+
+  // replay transactions in order until one is missing or torn
+  next_seq = header.start_seq;
+  head = header.start;
+  int replayed = 0;
+  map<short, datablock_t> blocks;
+  while (int len = read_transaction(head, next_seq, blocks)) {
+    if (used + len > JOURNAL_LOG_BLOCKS) break;
+    for (auto &b : blocks) {
+      disk->write_block(b.first, (void *) &b.second);
+    }
+    blocks.clear();
+    head = (head + len) % JOURNAL_LOG_BLOCKS;
+    used += len;
+    next_seq++;
+    replayed++;
+  }
+  written_seq = synced_seq = next_seq - 1;
+
+  // the replayed blocks are home; start the log after them
+  if (replayed) {
+    cout << "Journal: replayed " << replayed << " transactions" << endl;
+    checkpoint();
+  }
+  used = 0;
+}
+
+// Writes an empty journal.
+void Journal::format()
+{
+  vector<datablock_t> journal(JOURNAL_BLOCKS);
+  memset(&journal[0], 0, JOURNAL_BLOCKS * BLOCK_SIZE);
+  struct journal_header_t *header = (struct journal_header_t *) &journal[0];
+  header->magic = JOURNAL_MAGIC_NUM;
+  header->start_seq = 1;
+  header->start = 0;
+  disk->write_blocks(JOURNAL_START, JOURNAL_BLOCKS, &journal[0]);
+  disk->sync();
+
+  next_seq = 1;
+  head = 0;
+  used = 0;
+  written_seq = synced_seq = 0;
+}
+
+// Checkpoints, leaving the log empty.
+void Journal::unmount()
+{
+  if (disk) checkpoint();
+  disk = NULL;
+}
+
+// Starts a transaction.
+void Journal::begin()
+{
+  in_transaction = true;
+  pending.clear();
+}
+
+// Appends the transaction to the log and ends it.
+unsigned int Journal::commit()
+{
+  in_transaction = false;
+  if (pending.empty()) {
+    lock_guard<mutex> guard(sync_lock);
+    return written_seq;
+  }
+  if (changes) changes->append(pending);
+
+  int count = pending.size();
+  int descs = (count + MAX_JOURNAL_TAGS - 1) / MAX_JOURNAL_TAGS;
+  int len = descs + count + 1;
+
+  // Commands, each operation of a compound included, stay within
+  // JOURNAL_MAX_BLOCKS; only the whole image a replica is sent is larger.
+  // It goes home unjournaled, which a crash can tear, but a replica
+  // fetches the whole image again on restart.
+  if (len > JOURNAL_LOG_BLOCKS) {
+    checkpoint();
+    for (auto &b : pending) {
+      disk->write_block(b.first, (void *) &b.second);
+    }
+    disk->sync();
+    pending.clear();
+    lock_guard<mutex> guard(sync_lock);
+    return written_seq;
+  }
+  if (used + len > JOURNAL_LOG_BLOCKS) checkpoint();
+
+  // lay the transaction out: descriptor, its blocks, ..., commit
+  unsigned int seq = next_seq++;
+  unsigned int sum = CHECKSUM_SEED;
+  vector<datablock_t> log(len);
+  int pos = 0;
+  auto it = pending.begin();
+  while (it != pending.end()) {
+    struct journal_desc_t *desc = (struct journal_desc_t *) &log[pos++];
+    memset(desc, 0, BLOCK_SIZE);
+    desc->magic = JOURNAL_DESC_MAGIC_NUM;
+    desc->seq = seq;
+    int first = pos;
+    while (it != pending.end() && desc->count < (unsigned int) MAX_JOURNAL_TAGS) {
+      desc->blocks[desc->count++] = it->first;
+      log[pos++] = it->second;
+      ++it;
+    }
+    desc->more = it != pending.end();
+    sum = checksum(sum, desc);
+    for (int i = first; i < pos; i++) {
+      sum = checksum(sum, &log[i]);
+    }
+  }
+  struct journal_commit_t *commit = (struct journal_commit_t *) &log[pos];
+  memset(commit, 0, BLOCK_SIZE);
+  commit->magic = JOURNAL_COMMIT_MAGIC_NUM;
+  commit->seq = seq;
+  commit->checksum = sum;
+  write_log(head, len, &log[0]);
+
+  head = (head + len) % JOURNAL_LOG_BLOCKS;
+  used += len;
+  for (auto &b : pending) {
+    dirty[b.first] = b.second;
+  }
+  pending.clear();
+  server_stats.journal_commits.fetch_add(1, memory_order_relaxed);
+  server_stats.journal_blocks.fetch_add(count, memory_order_relaxed);
+
+  lock_guard<mutex> guard(sync_lock);
+  written_seq = seq;
+  return seq;
+}
+
+// Blocks until transaction seq and every one before it are on stable
+// storage. The first waiter to find no fdatasync running starts one that
+// covers every transaction written so far; the others wait for it.
+void Journal::wait_durable(unsigned int seq)
+{
+  unique_lock<mutex> guard(sync_lock);
+  while (synced_seq < seq) {
+    if (syncing) {
+      synced.wait(guard);
+      continue;
+    }
+    syncing = true;
+    unsigned int target = written_seq;
+    guard.unlock();
+    disk->sync();
+    server_stats.journal_syncs.fetch_add(1, memory_order_relaxed);
+    guard.lock();
+    syncing = false;
+    if (target > synced_seq) synced_seq = target;
+    synced.notify_all();
+  }
+}
+
+// Latest committed or pending contents of block_num.
+bool Journal::read(short block_num, void *block)
+{
+  auto it = pending.find(block_num);
+  if (it == pending.end()) {
+    it = dirty.find(block_num);
+    if (it == dirty.end()) return false;
+  }
+  memcpy(block, &it->second, BLOCK_SIZE);
+  return true;
+}
+
+// Adds block to the open transaction.
+bool Journal::write(short block_num, const void *block)
+{
+  if (!in_transaction) {
+    // the caller's write home supersedes any copy held here
+    dirty.erase(block_num);
+    return false;
+  }
+  memcpy(&pending[block_num], block, BLOCK_SIZE);
+  return true;
+}
+
+// Appends every transaction committed from now on to log as well.
+void Journal::ship_to(ChangeLog *log)
+{
+  changes = log;
+}
+
+// Reads transaction seq starting at log block pos into blocks.
+int Journal::read_transaction(unsigned int pos, unsigned int seq,
+                              map<short, datablock_t> &blocks)
+{
+  unsigned int sum = CHECKSUM_SEED;
+  int len = 0;
+  struct journal_desc_t desc;
+  do {
+    if (len >= JOURNAL_LOG_BLOCKS) return 0;
+    disk->read_block(log_block(pos + len++), (void *) &desc);
+    if (desc.magic != JOURNAL_DESC_MAGIC_NUM || desc.seq != seq ||
+        desc.count > (unsigned int) MAX_JOURNAL_TAGS) return 0;
+    sum = checksum(sum, &desc);
+    for (unsigned int i = 0; i < desc.count; i++) {
+      if (len >= JOURNAL_LOG_BLOCKS) return 0;
+      if (desc.blocks[i] < 0 || (desc.blocks[i] >= NUM_BLOCKS && desc.blocks[i] < REFCOUNT_START) ||
+          desc.blocks[i] >= DISK_BLOCKS) return 0;
+      struct datablock_t block;
+      disk->read_block(log_block(pos + len++), (void *) &block);
+      sum = checksum(sum, &block);
+      blocks[desc.blocks[i]] = block;
+    }
+  } while (desc.more);
+
+  struct journal_commit_t commit;
+  if (len >= JOURNAL_LOG_BLOCKS) return 0;
+  disk->read_block(log_block(pos + len++), (void *) &commit);
+  if (commit.magic != JOURNAL_COMMIT_MAGIC_NUM || commit.seq != seq ||
+      commit.checksum != sum) return 0;
+  return len;
+}
+
+// Writes len log blocks starting at log block pos, wrapping around.
+void Journal::write_log(unsigned int pos, int len, const datablock_t *blocks)
+{
+  int first = JOURNAL_LOG_BLOCKS - pos;
+  if (first > len) first = len;
+  disk->write_blocks(log_block(pos), first, blocks);
+  if (first < len) disk->write_blocks(log_block(0), len - first, blocks + first);
+}
+
+// Makes the log durable, writes the dirty blocks home and empties the log.
+void Journal::checkpoint()
+{
+  // home blocks may only change once the log can redo them
+  sync();
+  for (auto &b : dirty) {
+    disk->write_block(b.first, (void *) &b.second);
+  }
+  disk->sync();
+
+  // the header must be durable before the log space is reused
+  struct journal_header_t header;
+  memset(&header, 0, sizeof header);
+  header.magic = JOURNAL_MAGIC_NUM;
+  header.start_seq = next_seq;
+  header.start = head;
+  disk->write_block(JOURNAL_START, (void *) &header);
+  disk->sync();
+
+  dirty.clear();
+  used = 0;
+  server_stats.journal_checkpoints.fetch_add(1, memory_order_relaxed);
+}
+
+// fdatasync, then marks everything written before it as durable.
+void Journal::sync()
+{
+  unique_lock<mutex> guard(sync_lock);
+  unsigned int target = written_seq;
+  guard.unlock();
+  disk->sync();
+  server_stats.journal_syncs.fetch_add(1, memory_order_relaxed);
+  guard.lock();
+  if (target > synced_seq) synced_seq = target;
+  synced.notify_all();
+}
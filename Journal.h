@@ -0,0 +1,93 @@
+// CPSC 3500: Journal
+// A write-ahead journal kept in the disk image after the file system
+// blocks. The block writes of one file system command are collected into a
+// transaction and appended to the log when the command commits; the
+// commands that commit while an fdatasync is running share the next one
+// (group commit). Committed blocks reach their home locations at
+// checkpoints, and a crash before that is repaired at mount by replaying
+// the log.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include "Storage.h"
+#include "Blocks.h"
+#include "ChangeLog.h"
+
+class Journal {
+
+  public:
+    Journal();
+
+    // Opens the journal of a mounted disk, creating an empty one if the disk
+    // has none, and replays every committed transaction found in the log.
+    void mount(Storage *disk);
+
+    // Checkpoints, leaving the log empty.
+    void unmount();
+
+    // Starts a transaction. Called with the file system lock held.
+    void begin();
+
+    // Appends the transaction to the log and ends it. Returns the sequence
+    // number to pass to wait_durable. A transaction that wrote nothing
+    // returns the last one committed, since the command may have read its
+    // blocks.
+    unsigned int commit();
+
+    // Blocks until transaction seq and every one before it are on stable
+    // storage. Called without the file system lock.
+    void wait_durable(unsigned int seq);
+
+    // Latest committed or pending contents of block_num, if the journal
+    // holds a copy newer than the one at its home location.
+    bool read(short block_num, void *block);
+
+    // Adds block to the open transaction. Returns false if there is none,
+    // in which case the caller writes the block home directly.
+    bool write(short block_num, const void *block);
+
+    // Appends every transaction committed from now on to log as well, for
+    // replicas to follow.
+    void ship_to(ChangeLog *log);
+
+  private:
+    Storage *disk;
+    bool in_transaction;
+    std::map<short, datablock_t> pending;	// writes of the open transaction
+    std::map<short, datablock_t> dirty;	// committed, not yet checkpointed
+    ChangeLog *changes;		// where committed transactions are shipped
+
+    unsigned int next_seq;	// sequence number of the next transaction
+    unsigned int head;		// log block the next transaction starts at
+    int used;			// log blocks holding live transactions
+
+    std::mutex sync_lock;	// guards the fields below
+    std::condition_variable synced;
+    unsigned int written_seq;	// last transaction written to the log
+    unsigned int synced_seq;	// last transaction on stable storage
+    bool syncing;		// a thread is running the group's fdatasync
+
+    // Writes an empty journal.
+    void format();
+
+    // Reads transaction seq starting at log block pos into blocks. Returns
+    // its length in log blocks, or 0 if no intact transaction seq is there.
+    int read_transaction(unsigned int pos, unsigned int seq,
+                         std::map<short, datablock_t> &blocks);
+
+    // Writes len log blocks starting at log block pos, wrapping around.
+    void write_log(unsigned int pos, int len, const datablock_t *blocks);
+
+    // Makes the log durable, writes the dirty blocks home and empties the
+    // log. Called with the file system lock held.
+    void checkpoint();
+
+    // fdatasync, then marks everything written before it as durable.
+    void sync();
+};
+
+#endif
@@ -0,0 +1,67 @@
+// CPSC 3500: Latency
+// Collects latency samples and reports percentiles for the benchmarking
+// tools.
+
+#include <algorithm>
+#include <cmath>
+#include <time.h>
+
+#include "Latency.h"
+
+// Current time from the monotonic clock, in nanoseconds.
+long long now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Current time from the real-time clock, in nanoseconds.
+long long wall_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Records one sample in nanoseconds.
+void LatencyRecorder::add(long long ns) {
+	if (!samples.empty() && ns < samples.back())
+		sorted = false;
+	samples.push_back(ns);
+	total += ns;
+}
+
+// Adds every sample of other to this recorder.
+void LatencyRecorder::merge(const LatencyRecorder &other) {
+	samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+	total += other.total;
+	sorted = false;
+}
+
+// Number of samples recorded.
+size_t LatencyRecorder::count() const {
+	return samples.size();
+}
+
+// Mean of all samples in nanoseconds, 0 if empty.
+double LatencyRecorder::mean() const {
+	if (samples.empty())
+		return 0;
+	return (double) total / samples.size();
+}
+
+// The p-th percentile (0-100) in nanoseconds using the nearest-rank method,
+// 0 if empty.
+long long LatencyRecorder::percentile(double p) {
+	if (samples.empty())
+		return 0;
+	if (!sorted){
+		sort(samples.begin(), samples.end());
+		sorted = true;
+	}
+	size_t rank = (size_t) ceil(p / 100.0 * samples.size());
+	if (rank < 1)
+		rank = 1;
+	if (rank > samples.size())
+		rank = samples.size();
+	return samples[rank - 1];
+}
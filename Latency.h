@@ -0,0 +1,46 @@
+// CPSC 3500: Latency
+// Collects latency samples and reports percentiles for the benchmarking
+// tools.
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <vector>
+
+using namespace std;
+
+// Current time from the monotonic clock, in nanoseconds.
+long long now_ns();
+
+// Current time from the real-time clock, in nanoseconds; comparable
+// between processes, and between hosts whose clocks are synchronized.
+long long wall_ns();
+
+class LatencyRecorder {
+
+  public:
+    LatencyRecorder() : sorted(true), total(0) {
+    }
+
+    // Records one sample in nanoseconds.
+    void add(long long ns);
+
+    // Adds every sample of other to this recorder.
+    void merge(const LatencyRecorder &other);
+
+    // Number of samples recorded.
+    size_t count() const;
+
+    // Mean of all samples in nanoseconds, 0 if empty.
+    double mean() const;
+
+    // The p-th percentile (0-100) in nanoseconds, 0 if empty.
+    long long percentile(double p);
+
+  private:
+    vector<long long> samples;
+    bool sorted;	// samples is in ascending order
+    long long total;	// sum of all samples
+};
+
+#endif
@@ -0,0 +1,117 @@
+// CPSC 3500: Lz
+// A small LZ77 codec in the style of LZ4; the format is described in Lz.h.
+
+#include <cstring>
+#include <cstdint>
+
+#include "Lz.h"
+
+// Positions of recent 4-byte strings, by hash
+static const int HASH_BITS = 12;
+
+// Farthest back a match can start
+static const size_t MAX_OFFSET = 65535;
+
+static unsigned int hash4(const char *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Appends the extra bytes of a length whose nibble was 15.
+static void put_length(string &out, size_t n) {
+	for (n -= 15; n >= 255; n -= 255)
+		out.push_back((char) 255);
+	out.push_back((char) n);
+}
+
+// Adds the extra bytes of a length whose nibble was 15, reading from src
+// at i. Returns false if the input ends first.
+static bool get_length(const char *src, size_t len, size_t &i, size_t &n) {
+	unsigned char b;
+	do {
+		if (i == len)
+			return false;
+		b = src[i++];
+		n += b;
+	} while (b == 255);
+	return true;
+}
+
+// Appends a sequence: literals, then a match unless it is the last.
+static void put_sequence(string &out, const char *lit, size_t lit_len, size_t offset, size_t match_len) {
+	size_t m = match_len ? match_len - LZ_MIN_MATCH : 0;
+	out.push_back((char) ((lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15)));
+	if (lit_len >= 15)
+		put_length(out, lit_len);
+	out.append(lit, lit_len);
+	if (!match_len)
+		return;
+	out.push_back((char) (offset & 0xff));
+	out.push_back((char) (offset >> 8));
+	if (m >= 15)
+		put_length(out, m);
+}
+
+// Compresses len bytes at src into out.
+bool lz_compress(const char *src, size_t len, string &out, size_t limit) {
+	size_t table[1 << HASH_BITS];	// position + 1, 0 if none
+	memset(table, 0, sizeof table);
+	out.clear();
+	size_t anchor = 0, i = 0;
+	while (i + LZ_MIN_MATCH <= len){
+		unsigned int h = hash4(src + i);
+		size_t candidate = table[h];
+		table[h] = i + 1;
+		if (!candidate || i - (candidate - 1) > MAX_OFFSET ||
+		    memcmp(src + candidate - 1, src + i, LZ_MIN_MATCH) != 0){
+			i++;
+			continue;
+		}
+		size_t from = candidate - 1, n = LZ_MIN_MATCH;
+		while (i + n < len && src[from + n] == src[i + n])
+			n++;
+		put_sequence(out, src + anchor, i - anchor, i - from, n);
+		if (out.size() > limit)
+			return false;
+		i += n;
+		anchor = i;
+	}
+	put_sequence(out, src + anchor, len - anchor, 0, 0);
+	return out.size() <= limit;
+}
+
+// Decompresses len bytes at src into out.
+bool lz_decompress(const char *src, size_t len, string &out, size_t limit) {
+	out.clear();
+	size_t i = 0;
+	while (i < len){
+		unsigned char token = src[i++];
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !get_length(src, len, i, lit_len))
+			return false;
+		if (lit_len > len - i || out.size() + lit_len > limit)
+			return false;
+		out.append(src + i, lit_len);
+		i += lit_len;
+
+		// only the last sequence ends after its literals
+		if (i == len)
+			return (token & 15) == 0;
+		if (len - i < 2)
+			return false;
+		size_t offset = (unsigned char) src[i] | (unsigned char) src[i + 1] << 8;
+		i += 2;
+		size_t match_len = token & 15;
+		if (match_len == 15 && !get_length(src, len, i, match_len))
+			return false;
+		match_len += LZ_MIN_MATCH;
+		if (!offset || offset > out.size() || out.size() + match_len > limit)
+			return false;
+		// byte by byte, since a match may overlap the bytes it produces
+		size_t from = out.size() - offset;
+		for (size_t k = 0; k < match_len; k++)
+			out.push_back(out[from + k]);
+	}
+	return true;
+}
@@ -0,0 +1,35 @@
+// CPSC 3500: Lz
+// A small LZ77 codec in the style of LZ4, used to compress request and
+// response bodies on connections that ask for it. There is no entropy
+// coding: it finds repeats, which text has plenty of, and is fast.
+//
+// A compressed body is a series of sequences. Each starts with a token
+// byte: the high 4 bits are the number of literal bytes that follow, the
+// low 4 bits the length of the match after them, less LZ_MIN_MATCH. A
+// nibble of 15 is continued by bytes that are added on, up to and
+// including the first that is not 255. After the literals come the
+// match's offset back into the output, 2 bytes little-endian, and the
+// match length's extra bytes. The last sequence has literals only.
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <string>
+
+using namespace std;
+
+// Shortest match encoded
+const size_t LZ_MIN_MATCH = 4;
+
+// Bodies smaller than this are sent as they are
+const size_t LZ_MIN_SIZE = 256;
+
+// Compresses len bytes at src into out. Returns false, leaving out
+// unspecified, if the result would be longer than limit bytes.
+bool lz_compress(const char *src, size_t len, string &out, size_t limit);
+
+// Decompresses len bytes at src into out. Returns false if the input is
+// corrupt or would decompress to more than limit bytes.
+bool lz_decompress(const char *src, size_t len, string &out, size_t limit);
+
+#endif
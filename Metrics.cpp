@@ -0,0 +1,277 @@
+// CPSC 3500: Metrics
+// Prometheus text exposition of the server's statistics, served over HTTP
+// on a separate port.
+
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "Metrics.h"
+#include "Stats.h"
+#include "Blocks.h"
+
+// Upper bounds of the exported latency buckets, in seconds. Each
+// Histogram bucket is counted under the first bound at or above its
+// largest value, so counts can shift by up to 1/16 of a bound.
+static const double LATENCY_BOUNDS[] = {
+	0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+	0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5
+};
+static const int NUM_BOUNDS = sizeof LATENCY_BOUNDS / sizeof LATENCY_BOUNDS[0];
+
+// Appends "# HELP" and "# TYPE" lines for a metric.
+static void header(string &out, const char *name, const char *type, const char *help) {
+	out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+	out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+// Appends one sample line.
+static void sample(string &out, const string &name, const string &labels, double value) {
+	char num[32];
+	snprintf(num, sizeof num, "%.17g", value);
+	out.append(name);
+	if (!labels.empty())
+		out.append("{").append(labels).append("}");
+	out.append(" ").append(num).append("\n");
+}
+
+// Appends one per-command counter.
+static void op_counter(string &out, const char *name, const char *help,
+                       atomic<long long> OpStats::*field) {
+	header(out, name, "counter", help);
+	for (int op = 0; op < NUM_STAT_OPS; op++){
+		OpStats &s = server_stats.ops[op];
+		if (s.count.load(memory_order_relaxed))
+			sample(out, name, string("op=\"") + Stats::op_name(op) + "\"",
+			       (s.*field).load(memory_order_relaxed));
+	}
+}
+
+// The current metrics in Prometheus text format.
+string prometheus_metrics(const vector<Volume> &volumes) {
+	string out;
+
+	header(out, "nfs_requests_total", "counter", "Requests handled, by command and response status.");
+	for (int op = 0; op < NUM_STAT_OPS; op++){
+		OpStats &s = server_stats.ops[op];
+		for (int i = 0; i < NUM_STATUS_CODES; i++){
+			long long n = s.status[i].load(memory_order_relaxed);
+			if (!n)
+				continue;
+			int code = Stats::status_code(i);
+			sample(out, "nfs_requests_total", string("op=\"") + Stats::op_name(op) +
+			       "\",code=\"" + (code ? to_string(code) : "other") + "\"", n);
+		}
+	}
+
+	header(out, "nfs_request_duration_seconds", "histogram",
+	       "Time from receiving a request to sending its response.");
+	for (int op = 0; op < NUM_STAT_OPS; op++){
+		OpStats &s = server_stats.ops[op];
+		if (!s.count.load(memory_order_relaxed))
+			continue;
+		long long counts[NUM_BOUNDS + 1] = {};
+		for (int b = 0; b < Histogram::NUM_BUCKETS; b++){
+			long long n = s.latency.count(b);
+			if (!n)
+				continue;
+			double max = Histogram::bucket_max(b) / 1e9;
+			int i = 0;
+			while (i < NUM_BOUNDS && LATENCY_BOUNDS[i] < max)
+				i++;
+			counts[i] += n;
+		}
+		string op_label = string("op=\"") + Stats::op_name(op) + "\"";
+		long long cumulative = 0;
+		char le[32];
+		for (int i = 0; i < NUM_BOUNDS; i++){
+			cumulative += counts[i];
+			snprintf(le, sizeof le, "%g", LATENCY_BOUNDS[i]);
+			sample(out, "nfs_request_duration_seconds_bucket", op_label + ",le=\"" + le + "\"", cumulative);
+		}
+		cumulative += counts[NUM_BOUNDS];
+		sample(out, "nfs_request_duration_seconds_bucket", op_label + ",le=\"+Inf\"", cumulative);
+		sample(out, "nfs_request_duration_seconds_sum", op_label, s.total_ns.load(memory_order_relaxed) / 1e9);
+		sample(out, "nfs_request_duration_seconds_count", op_label, cumulative);
+	}
+
+	op_counter(out, "nfs_received_bytes_total", "Request bytes received, by command.", &OpStats::bytes_in);
+	op_counter(out, "nfs_sent_bytes_total", "Response bytes sent, by command.", &OpStats::bytes_out);
+	op_counter(out, "nfs_disk_reads_total", "Disk blocks read, by command.", &OpStats::disk_reads);
+	op_counter(out, "nfs_disk_writes_total", "Disk blocks written, by command.", &OpStats::disk_writes);
+
+	header(out, "nfs_active_connections", "gauge", "Client connections currently open.");
+	sample(out, "nfs_active_connections", "", server_stats.active_conns.load(memory_order_relaxed));
+	header(out, "nfs_connections_total", "counter", "Client connections accepted.");
+	sample(out, "nfs_connections_total", "", server_stats.total_conns.load(memory_order_relaxed));
+
+	header(out, "nfs_free_blocks", "gauge", "Free blocks on each volume.");
+	for (size_t i = 0; i < volumes.size(); i++)
+		sample(out, "nfs_free_blocks", "volume=\"" + volumes[i].name + "\"", volumes[i].disk->num_free_blocks());
+	header(out, "nfs_blocks", "gauge", "Total blocks on each volume.");
+	for (size_t i = 0; i < volumes.size(); i++)
+		sample(out, "nfs_blocks", "volume=\"" + volumes[i].name + "\"", NUM_BLOCKS);
+	header(out, "nfs_inodes", "gauge", "Files and directories on each volume, snapshots included.");
+	for (size_t i = 0; i < volumes.size(); i++)
+		sample(out, "nfs_inodes", "volume=\"" + volumes[i].name + "\"", volumes[i].disk->num_inodes());
+
+	header(out, "nfs_journal_commits_total", "counter", "Transactions written to the journal.");
+	sample(out, "nfs_journal_commits_total", "", server_stats.journal_commits.load(memory_order_relaxed));
+	header(out, "nfs_journal_blocks_total", "counter", "Blocks written to the journal.");
+	sample(out, "nfs_journal_blocks_total", "", server_stats.journal_blocks.load(memory_order_relaxed));
+	header(out, "nfs_journal_syncs_total", "counter", "fdatasync calls made for the journal.");
+	sample(out, "nfs_journal_syncs_total", "", server_stats.journal_syncs.load(memory_order_relaxed));
+	header(out, "nfs_journal_checkpoints_total", "counter", "Journal checkpoints.");
+	sample(out, "nfs_journal_checkpoints_total", "", server_stats.journal_checkpoints.load(memory_order_relaxed));
+
+	header(out, "nfs_compress_bodies_total", "counter", "Response bodies sent compressed.");
+	sample(out, "nfs_compress_bodies_total", "", server_stats.compressed.load(memory_order_relaxed));
+	header(out, "nfs_compress_in_bytes_total", "counter", "Response body bytes before compression.");
+	sample(out, "nfs_compress_in_bytes_total", "", server_stats.compress_in.load(memory_order_relaxed));
+	header(out, "nfs_compress_out_bytes_total", "counter", "Response body bytes after compression.");
+	sample(out, "nfs_compress_out_bytes_total", "", server_stats.compress_out.load(memory_order_relaxed));
+	header(out, "nfs_compress_skipped_total", "counter", "Response bodies sent uncompressed because they did not compress.");
+	sample(out, "nfs_compress_skipped_total", "", server_stats.incompressible.load(memory_order_relaxed));
+	header(out, "nfs_compress_seconds_total", "counter", "Time spent compressing response bodies.");
+	sample(out, "nfs_compress_seconds_total", "", server_stats.compress_ns.load(memory_order_relaxed) / 1e9);
+	header(out, "nfs_decompress_requests_total", "counter", "Compressed requests unpacked.");
+	sample(out, "nfs_decompress_requests_total", "", server_stats.unpacked.load(memory_order_relaxed));
+	header(out, "nfs_decompress_in_bytes_total", "counter", "Compressed request bytes received.");
+	sample(out, "nfs_decompress_in_bytes_total", "", server_stats.unpack_in.load(memory_order_relaxed));
+	header(out, "nfs_decompress_out_bytes_total", "counter", "Request bytes after decompression.");
+	sample(out, "nfs_decompress_out_bytes_total", "", server_stats.unpack_out.load(memory_order_relaxed));
+	header(out, "nfs_decompress_seconds_total", "counter", "Time spent decompressing requests.");
+	sample(out, "nfs_decompress_seconds_total", "", server_stats.unpack_ns.load(memory_order_relaxed) / 1e9);
+
+	header(out, "nfs_image_saves_total", "counter", "Images of volumes kept in memory written to their files.");
+	sample(out, "nfs_image_saves_total", "", server_stats.image_saves.load(memory_order_relaxed));
+	header(out, "nfs_image_save_blocks_total", "counter", "Blocks written in images of volumes kept in memory.");
+	sample(out, "nfs_image_save_blocks_total", "", server_stats.image_blocks.load(memory_order_relaxed));
+	header(out, "nfs_image_save_seconds_total", "counter", "Time spent writing images of volumes kept in memory.");
+	sample(out, "nfs_image_save_seconds_total", "", server_stats.image_save_ns.load(memory_order_relaxed) / 1e9);
+
+	header(out, "nfs_checksum_verified_total", "counter", "Blocks read from disk checked against their checksums.");
+	sample(out, "nfs_checksum_verified_total", "", server_stats.checksum_verified.load(memory_order_relaxed));
+	header(out, "nfs_checksum_verify_seconds_total", "counter", "Time spent checking blocks against their checksums.");
+	sample(out, "nfs_checksum_verify_seconds_total", "", server_stats.checksum_verify_ns.load(memory_order_relaxed) / 1e9);
+	header(out, "nfs_checksum_failures_total", "counter", "Blocks read from disk that did not match their checksums.");
+	sample(out, "nfs_checksum_failures_total", "", server_stats.checksum_failures.load(memory_order_relaxed));
+	header(out, "nfs_checksum_updates_total", "counter", "Checksums computed for blocks written.");
+	sample(out, "nfs_checksum_updates_total", "", server_stats.checksum_updated.load(memory_order_relaxed));
+	header(out, "nfs_checksum_update_seconds_total", "counter", "Time spent computing checksums for blocks written.");
+	sample(out, "nfs_checksum_update_seconds_total", "", server_stats.checksum_update_ns.load(memory_order_relaxed) / 1e9);
+
+	header(out, "nfs_dedup_lookups_total", "counter", "Full data blocks looked up by fingerprint.");
+	sample(out, "nfs_dedup_lookups_total", "", server_stats.dedup_lookups.load(memory_order_relaxed));
+	header(out, "nfs_dedup_hits_total", "counter", "Full data blocks that shared a block already on disk.");
+	sample(out, "nfs_dedup_hits_total", "", server_stats.dedup_hits.load(memory_order_relaxed));
+	header(out, "nfs_dedup_collisions_total", "counter", "Fingerprint matches whose data differed.");
+	sample(out, "nfs_dedup_collisions_total", "", server_stats.dedup_collisions.load(memory_order_relaxed));
+	header(out, "nfs_dedup_seconds_total", "counter", "Time spent looking up full data blocks.");
+	sample(out, "nfs_dedup_seconds_total", "", server_stats.dedup_ns.load(memory_order_relaxed) / 1e9);
+	header(out, "nfs_dedup_indexed_blocks", "gauge", "Data blocks indexed for deduplication.");
+	sample(out, "nfs_dedup_indexed_blocks", "", server_stats.dedup_indexed.load(memory_order_relaxed));
+
+	header(out, "nfs_replicas", "gauge", "Replicas following this server.");
+	sample(out, "nfs_replicas", "", server_stats.replicas.load(memory_order_relaxed));
+	header(out, "nfs_shipped_changes_total", "counter", "Transactions shipped to replicas.");
+	sample(out, "nfs_shipped_changes_total", "", server_stats.shipped_changes.load(memory_order_relaxed));
+	header(out, "nfs_shipped_blocks_total", "counter", "Blocks shipped to replicas in transactions.");
+	sample(out, "nfs_shipped_blocks_total", "", server_stats.shipped_blocks.load(memory_order_relaxed));
+	header(out, "nfs_shipped_images_total", "counter", "Full volume copies shipped to replicas.");
+	sample(out, "nfs_shipped_images_total", "", server_stats.shipped_images.load(memory_order_relaxed));
+
+	int num_replicas = server_stats.num_replicas.load();
+	if (num_replicas){
+		header(out, "nfs_replica_connected", "gauge", "1 if the volume is following its primary.");
+		for (int i = 0; i < num_replicas; i++)
+			sample(out, "nfs_replica_connected", string("volume=\"") + server_stats.replica_volumes[i]->name + "\"",
+			       server_stats.replica_volumes[i]->connected.load(memory_order_relaxed));
+		header(out, "nfs_replica_lag_seconds", "gauge", "How far the volume is behind its primary.");
+		for (int i = 0; i < num_replicas; i++){
+			ReplicaStats *r = server_stats.replica_volumes[i];
+			if (r->synced_ns.load(memory_order_relaxed))
+				sample(out, "nfs_replica_lag_seconds", string("volume=\"") + r->name + "\"", r->lag_ns() / 1e9);
+		}
+		header(out, "nfs_replica_changes_total", "counter", "Transactions applied from the primary.");
+		for (int i = 0; i < num_replicas; i++)
+			sample(out, "nfs_replica_changes_total", string("volume=\"") + server_stats.replica_volumes[i]->name + "\"",
+			       server_stats.replica_volumes[i]->changes.load(memory_order_relaxed));
+	}
+
+	vector<CacheStats *> caches;
+	for (int i = 0; i < server_stats.num_caches.load(); i++){
+		CacheStats *cache = server_stats.caches[i].load();
+		if (cache)
+			caches.push_back(cache);
+	}
+	if (!caches.empty()){
+		header(out, "nfs_cache_hits_total", "counter", "Cache lookups that hit, by cache.");
+		for (size_t i = 0; i < caches.size(); i++)
+			sample(out, "nfs_cache_hits_total", string("cache=\"") + caches[i]->name + "\"",
+			       caches[i]->hits.load(memory_order_relaxed));
+		header(out, "nfs_cache_misses_total", "counter", "Cache lookups that missed, by cache.");
+		for (size_t i = 0; i < caches.size(); i++)
+			sample(out, "nfs_cache_misses_total", string("cache=\"") + caches[i]->name + "\"",
+			       caches[i]->misses.load(memory_order_relaxed));
+	}
+	return out;
+}
+
+// Sends all of data, giving up on errors.
+static void send_all(int sock, const string &data) {
+	size_t numbytes = 0;
+	while (numbytes < data.length()){
+		ssize_t x = send(sock, data.c_str() + numbytes, data.length() - numbytes, MSG_NOSIGNAL);
+		if (x == -1 && errno == EINTR)
+			continue;
+		if (x <= 0)
+			return;
+		numbytes += x;
+	}
+}
+
+// Answers HTTP scrapes on listen_sock forever, one at a time.
+void serve_metrics(int listen_sock, const vector<Volume> *volumes) {
+	char chunk[1024];
+	while (1){
+		int sock = accept(listen_sock, NULL, NULL);
+		if (sock == -1){
+			if (errno != EINTR)
+				perror("metrics: accept");
+			continue;
+		}
+		// a stuck scraper must not hold up the next one
+		timeval timeout = { 2, 0 };
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+		// read the request head
+		string req;
+		while (req.find("\r\n\r\n") == string::npos && req.length() < 8192){
+			ssize_t x = recv(sock, chunk, sizeof chunk, 0);
+			if (x <= 0)
+				break;
+			req.append(chunk, x);
+		}
+		size_t path_end = req.find(' ', 4);
+		string path = req.compare(0, 4, "GET ") == 0 && path_end != string::npos ?
+			req.substr(4, path_end - 4) : "";
+
+		string status = "200 OK", body;
+		if (path == "/metrics" || path == "/")
+			body = prometheus_metrics(*volumes);
+		else {
+			status = "404 Not Found";
+			body = "not found\n";
+		}
+		send_all(sock, "HTTP/1.1 " + status + "\r\n"
+		         "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		         "Content-Length: " + to_string(body.length()) + "\r\n"
+		         "Connection: close\r\n\r\n" + body);
+		close(sock);
+	}
+}
@@ -0,0 +1,22 @@
+// CPSC 3500: Metrics
+// Prometheus text exposition of the server's statistics, served over HTTP
+// on a separate port. Everything is read from atomics, so a scrape never
+// takes the file system lock or slows down request handling.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include "BasicFileSys.h"
+
+using namespace std;
+
+// The current metrics in Prometheus text format (version 0.0.4).
+string prometheus_metrics(const vector<Volume> &volumes);
+
+// Answers HTTP scrapes on listen_sock forever, one at a time. GET /metrics
+// (or /) returns the metrics, anything else 404.
+void serve_metrics(int listen_sock, const vector<Volume> *volumes);
+
+#endif
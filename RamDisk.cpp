@@ -0,0 +1,127 @@
+// CPSC 3500: RAM Disk
+// A volume kept wholly in memory and saved to its file now and then.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <cstdlib>
+using namespace std;
+
+#include "RamDisk.h"
+#include "Disk.h"
+#include "Stats.h"
+#include "Latency.h"
+
+RamDisk::RamDisk() : changed(false), unsaved(false)
+{
+}
+
+// Reads the file into memory if it exists.
+bool RamDisk::mount(const char *name)
+{
+  file_name = name;
+  blocks.clear();
+  int fd = open(name, O_RDONLY);
+  if (fd == -1) return true;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    cerr << "Could not stat disk" << endl;
+    exit(-1);
+  }
+  blocks.resize(st.st_size / BLOCK_SIZE);
+  ssize_t size = pread(fd, blocks.data(), blocks.size() * BLOCK_SIZE, 0);
+  close(fd);
+  if (size != (ssize_t) (blocks.size() * BLOCK_SIZE)) {
+    cerr << "Failed to read disk" << endl;
+    exit(-1);
+  }
+  return false;
+}
+
+// Saves the volume and forgets it.
+void RamDisk::unmount()
+{
+  take_image();
+  save_image();
+  blocks.clear();
+}
+
+// Reads block block_num into block.
+void RamDisk::read_block(int block_num, void *block)
+{
+  if (block_num < 0 || block_num >= (int) blocks.size()) {
+    cerr << "Failed to read entire block" << endl;
+    exit(-1);
+  }
+  memcpy(block, &blocks[block_num], BLOCK_SIZE);
+  Disk::stats.reads++;
+}
+
+// Writes the data in block to block block_num, growing the disk to hold it.
+void RamDisk::write_block(int block_num, void *block)
+{
+  write_blocks(block_num, 1, block);
+}
+
+// Writes count consecutive blocks starting at block_num.
+void RamDisk::write_blocks(int block_num, int count, const void *data)
+{
+  if (block_num < 0 || count < 0 || block_num + count > DISK_BLOCKS) {
+    cerr << "Invalid block size" << endl;
+    exit(-1);
+  }
+  if (block_num + count > (int) blocks.size()) blocks.resize(block_num + count);
+  memcpy(&blocks[block_num], data, count * BLOCK_SIZE);
+  Disk::stats.writes += count;
+  changed.store(true, memory_order_relaxed);
+}
+
+// Nothing to wait for.
+void RamDisk::sync()
+{
+}
+
+// Number of blocks held.
+int RamDisk::num_blocks()
+{
+  return blocks.size();
+}
+
+// Copies the volume if it changed since the last copy.
+void RamDisk::take_image()
+{
+  if (!changed.exchange(false)) return;
+  lock_guard<mutex> guard(save_lock);
+  image = blocks;
+  unsaved = true;
+}
+
+// Writes the last copy to a temporary file, then puts that in place of
+// the file.
+void RamDisk::save_image()
+{
+  lock_guard<mutex> guard(save_lock);
+  if (!unsaved) return;
+  long long start = now_ns();
+  string temp = file_name + ".saving";
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ssize_t size = fd == -1 ? -1 : pwrite(fd, image.data(), image.size() * BLOCK_SIZE, 0);
+  if (size != (ssize_t) (image.size() * BLOCK_SIZE) || fdatasync(fd) == -1 ||
+      rename(temp.c_str(), file_name.c_str()) == -1) {
+    // the old image is still whole; keep this one for the next try
+    perror(file_name.c_str());
+    if (fd != -1) close(fd);
+    unlink(temp.c_str());
+    return;
+  }
+  close(fd);
+  unsaved = false;
+  server_stats.image_saves.fetch_add(1, memory_order_relaxed);
+  server_stats.image_blocks.fetch_add(image.size(), memory_order_relaxed);
+  server_stats.image_save_ns.fetch_add(now_ns() - start, memory_order_relaxed);
+}
@@ -0,0 +1,57 @@
+// CPSC 3500: RAM Disk
+// A volume kept wholly in memory, for scratch workloads that need not
+// reach the file on every write. The file is read at mount and written
+// back, whole, when the server saves the volume: on a timer, on the sync
+// command, and at unmount. An image is written to a temporary file that
+// then replaces the old one, so the file always holds some complete image;
+// since it is copied between commands, journal included, mounting it
+// finds a consistent file system. Changes since the last save are lost in
+// a crash.
+
+#ifndef RAM_DISK_H
+#define RAM_DISK_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "Storage.h"
+#include "Blocks.h"
+
+class RamDisk : public Storage {
+
+  public:
+    RamDisk();
+
+    // Reads the file into memory if it exists.
+    bool mount(const char *file_name);
+
+    // Saves the volume and forgets it.
+    void unmount();
+
+    void read_block(int block_num, void *block);
+    void write_block(int block_num, void *block);
+    void write_blocks(int block_num, int count, const void *blocks);
+
+    // Nothing to wait for.
+    void sync();
+
+    int num_blocks();
+
+    // Copies the volume if it changed since the last copy.
+    void take_image();
+
+    // Writes the last copy to the file, unless it is there already.
+    void save_image();
+
+  private:
+    std::string file_name;
+    std::vector<datablock_t> blocks;
+    std::atomic<bool> changed;	// written since the last copy
+
+    std::mutex save_lock;	// guards the fields below
+    std::vector<datablock_t> image;	// last copy taken
+    bool unsaved;		// image is newer than the file
+};
+
+#endif
@@ -0,0 +1,205 @@
+// CPSC 3500: Replica
+// Read-only replicas kept in step with a primary server by shipping its
+// committed transactions; the protocol is described in Replica.h.
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <chrono>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "Replica.h"
+#include "Latency.h"
+
+// Longest wait between attempts to reach a primary that is down
+static const int MAX_RETRY_MS = 8000;
+
+// Bytes of one block record in a frame
+static const size_t RECORD_SIZE = 2 + BLOCK_SIZE;
+
+// Appends a frame to out.
+static void frame(string &out, const char *kind, unsigned int seq, long long time,
+                  const map<short, datablock_t> &blocks) {
+	out.append(kind).append(" ").append(to_string(seq)).append(" ");
+	out.append(to_string(blocks.size())).append(" ").append(to_string(time)).append("\r\n");
+	for (auto &b : blocks){
+		out.push_back((char) (b.first & 0xFF));
+		out.push_back((char) ((b.first >> 8) & 0xFF));
+		out.append((const char *) &b.second, BLOCK_SIZE);
+	}
+}
+
+// Sends all of data. Returns false if the other side is gone.
+static bool send_all(Channel &chan, const string &data) {
+	size_t numbytes = 0;
+	while (numbytes < data.length()){
+		ssize_t x = chan.send(data.data() + numbytes, data.length() - numbytes);
+		if (x <= 0)
+			return false;
+		numbytes += x;
+	}
+	return true;
+}
+
+// Receives until len bytes are buffered in buf, then moves them to out.
+static bool receive_bytes(Channel &chan, string &buf, size_t len, string &out) {
+	char chunk[4096];
+	while (buf.length() < len){
+		ssize_t x = chan.recv(chunk, sizeof chunk);
+		if (x <= 0)
+			return false;
+		buf.append(chunk, x);
+	}
+	out = buf.substr(0, len);
+	buf.erase(0, len);
+	return true;
+}
+
+// Receives a line, moving it without its CRLF from buf to line.
+static bool receive_line(Channel &chan, string &buf, string &line) {
+	char chunk[4096];
+	size_t end;
+	while ((end = buf.find("\r\n")) == string::npos){
+		ssize_t x = chan.recv(chunk, sizeof chunk);
+		if (x <= 0)
+			return false;
+		buf.append(chunk, x);
+	}
+	line = buf.substr(0, end);
+	buf.erase(0, end + 2);
+	return true;
+}
+
+// Copies disk, returning the transaction the copy is current as of. The
+// first copy also starts following the disk's change log.
+static unsigned int copy_disk(BasicFileSys *disk, map<short, datablock_t> &blocks, bool first) {
+	blocks.clear();
+	disk->lock();
+	disk->image(blocks);
+	unsigned int seq = first ? disk->changes.subscribe() : disk->changes.last();
+	disk->unlock();
+	server_stats.shipped_images.fetch_add(1, memory_order_relaxed);
+	return seq;
+}
+
+// Sends the changes of disk over chan until the replica disconnects.
+void ship_changes(Channel &chan, BasicFileSys *disk) {
+	server_stats.replicas.fetch_add(1, memory_order_relaxed);
+	map<short, datablock_t> blocks;
+	unsigned int seq = copy_disk(disk, blocks, true);
+	string out;
+	frame(out, "image", seq, wall_ns(), blocks);
+	vector<Change> batch;
+	while (send_all(chan, out)){
+		out.clear();
+		batch.clear();
+
+		// fallen behind what the log keeps: start over from a copy
+		if (!disk->changes.wait(seq, batch, HEARTBEAT_MS)){
+			seq = copy_disk(disk, blocks, false);
+			frame(out, "image", seq, wall_ns(), blocks);
+			continue;
+		}
+		for (auto &change : batch){
+			frame(out, "change", change.seq, change.time_ns, change.blocks);
+			seq = change.seq;
+			server_stats.shipped_changes.fetch_add(1, memory_order_relaxed);
+			server_stats.shipped_blocks.fetch_add(change.blocks.size(), memory_order_relaxed);
+		}
+
+		// idle: the time is read first, so nothing committed before it
+		// can be missing if the log has not moved since
+		if (batch.empty()){
+			long long time = wall_ns();
+			if (disk->changes.last() == seq)
+				frame(out, "change", seq, time, map<short, datablock_t>());
+		}
+	}
+	disk->changes.unsubscribe();
+	server_stats.replicas.fetch_sub(1, memory_order_relaxed);
+}
+
+// Follows the primary over a connected chan until it is lost. Returns true
+// if any frame arrived.
+static bool follow(Channel &chan, const string &name, BasicFileSys *disk, ReplicaStats *stats) {
+	// a primary that vanished without closing the connection is noticed
+	// by its heartbeats stopping
+	timeval timeout = { REPLICA_TIMEOUT_MS / 1000, (REPLICA_TIMEOUT_MS % 1000) * 1000 };
+	setsockopt(chan.socket(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	if (!send_all(chan, "replicate " + name + "\r\n"))
+		return false;
+
+	string buf, line, body;
+	char kind[8];
+	unsigned int seq = 0, frame_seq;
+	size_t count;
+	long long time;
+	bool synced = false;
+	while (receive_line(chan, buf, line)){
+		if (sscanf(line.c_str(), "%7s %u %zu %lld", kind, &frame_seq, &count, &time) != 4){
+			cerr << "Replica " << name << ": primary answered " << line << endl;
+			break;
+		}
+		bool image = strcmp(kind, "image") == 0;
+		if ((!image && strcmp(kind, "change") != 0) || count > (size_t) DISK_BLOCKS ||
+		    !receive_bytes(chan, buf, count * RECORD_SIZE, body))
+			break;
+		// changes must follow on from what the replica has
+		if (!image && (!synced || frame_seq != seq + (count ? 1 : 0)))
+			break;
+
+		map<short, datablock_t> blocks;
+		bool valid = true;
+		for (size_t i = 0; i < count; i++){
+			const char *record = body.data() + i * RECORD_SIZE;
+			short b = (short) ((unsigned char) record[0] | (unsigned char) record[1] << 8);
+			valid = valid && b >= 0 && (b < NUM_BLOCKS || b >= REFCOUNT_START) && b <= DEDUP_BLOCK;
+			memcpy(&blocks[b], record + 2, BLOCK_SIZE);
+		}
+		if (!valid)
+			break;
+		if (count){
+			disk->lock();
+			disk->begin();
+			disk->apply(blocks, image);
+			disk->commit();
+			disk->unlock();
+		}
+
+		if (image){
+			stats->images.fetch_add(1, memory_order_relaxed);
+			cout << "Replica " << name << ": copied from the primary at transaction " << frame_seq << endl;
+		}
+		else if (count){
+			stats->changes.fetch_add(1, memory_order_relaxed);
+			stats->blocks.fetch_add(count, memory_order_relaxed);
+		}
+		stats->synced_ns.store(time, memory_order_relaxed);
+		stats->connected.store(1, memory_order_relaxed);
+		seq = frame_seq;
+		synced = true;
+	}
+	stats->connected.store(0, memory_order_relaxed);
+	return synced;
+}
+
+// Keeps volume name on disk in step with the primary, forever.
+void replicate(string primary, string name, BasicFileSys *disk, ReplicaStats *stats) {
+	int retry_ms = 1000;
+	while (1){
+		Channel chan;
+		if (chan.connect(primary)){
+			if (follow(chan, name, disk, stats)){
+				cerr << "Replica " << name << ": lost the primary, reconnecting" << endl;
+				retry_ms = 1000;
+			}
+			chan.close();
+		}
+		this_thread::sleep_for(chrono::milliseconds(retry_ms));
+		if (retry_ms < MAX_RETRY_MS)
+			retry_ms *= 2;
+	}
+}
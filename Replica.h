@@ -0,0 +1,45 @@
+// CPSC 3500: Replica
+// Read-only replicas kept in step with a primary server by shipping its
+// committed transactions, so reads can be spread over several server
+// processes. A replica (nfsserver -r primary) connects to the primary once
+// per volume, as a client, and sends
+//   replicate name\r\n
+// naming the volume, which has the same name on both. An unknown volume is
+// answered with a normal 503 response. Otherwise the connection carries
+// frames from then on, each a line
+//   kind seq count time\r\n
+// and count records of a block number, 2 bytes little-endian, and the
+// block's BLOCK_SIZE bytes. The first frame, kind "image", is every block
+// of the volume as of transaction seq. Each later one, kind "change", is
+// transaction seq, committed at time (wall clock, in nanoseconds); one with
+// no blocks repeats the last seq and says nothing newer had been committed
+// at time, and is sent when the primary is idle. A replica that falls too
+// far behind is sent a new image. The replica applies each frame as one
+// transaction of its own, so its readers never see half of one.
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <string>
+#include "BasicFileSys.h"
+#include "Channel.h"
+#include "Stats.h"
+
+using namespace std;
+
+// Most time between frames while the primary is idle
+const int HEARTBEAT_MS = 100;
+
+// A replica that hears nothing for this long reconnects
+const int REPLICA_TIMEOUT_MS = 2000;
+
+// Primary side: sends the changes of disk over chan until the replica
+// disconnects.
+void ship_changes(Channel &chan, BasicFileSys *disk);
+
+// Replica side: keeps volume name on disk in step with the primary at the
+// mount string primary, reconnecting whenever the connection is lost.
+// Runs forever.
+void replicate(string primary, string name, BasicFileSys *disk, ReplicaStats *stats);
+
+#endif
@@ -7,47 +7,19 @@
 using namespace std;
 
 #include "Shell.h"
+#include "Lz.h"
 
 static const string PROMPT_STRING = "NFS> ";	// shell prompt
 
-// Mount the network file system with server name and port number in the format of server:port
+// Mount the network file system with a mount string: server:port for TCP,
+// unix:path or shm:path for a server on this host (see Channel.h)
 void Shell::mountNFS(string fs_loc) {
-	//create the socket cs_sock and connect it to the server and port specified in fs_loc
+	//connect the channel to the server specified in fs_loc
 	//if all the above operations are completed successfully, set is_mounted to true  
-	size_t divider = fs_loc.find(':');
-	char ip_addr[(int) divider];
-	char port[(int)fs_loc.length() - (int) divider];
-	strcpy(ip_addr, (fs_loc.substr(0, divider)).c_str());
-	strcpy(port, (fs_loc.substr(divider+1)).c_str());
-	
-	sockaddr_storage their_addr;
-    socklen_t addr_size;
-	addrinfo hints, *res;
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
-
-    if(int rv = getaddrinfo(ip_addr, port, &hints, &res)){
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+	cout << "Client: connecting to " << fs_loc << endl;
+	if (!chan.connect(fs_loc))
 		exit(1);
-	}
-
-    // make a socket, connect to it
-    cs_sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if (cs_sock == -1){
-		perror("socket");
-		exit(errno);
-	}
-    if(connect(cs_sock, res->ai_addr, res->ai_addrlen) == -1){
-		close(cs_sock);
-		perror("connect");
-		exit(errno);
-	}
-	sockaddr_in* addr = (sockaddr_in*) res->ai_addr;
-	cout << "Client: connecting to " << inet_ntoa((in_addr)addr->sin_addr) << endl;
-	freeaddrinfo(res);
+	cs_sock = chan.socket();
 	is_mounted = true;
 	cout << "Connected!\n";
 }
@@ -55,10 +27,23 @@ void Shell::mountNFS(string fs_loc) {
 // Unmount the network file system if it was mounted
 void Shell::unmountNFS() {
 	// close the socket if it was mounted
-	close(cs_sock);
+	chan.close();
+	cs_sock = -1;
 	is_mounted = false;
 }
 
+// Ask the server to compress large bodies; requests are compressed too
+// once it agrees
+void Shell::enable_compression() {
+	network_send("compress lz\r\n");
+	string status, body;
+	receive_response(status, body);
+	if (status.compare(0, 3, "200") == 0)
+		compressing = true;
+	else
+		cout << status;
+}
+
 // Remote procedure call on mkdir
 void Shell::mkdir_rpc(string dname) {
 	dname.append("\r\n");
@@ -93,8 +78,20 @@ void Shell::rmdir_rpc(string dname) {
 }
 
 // Remote procedure call on ls
-void Shell::ls_rpc() {
-	network_send("ls\r\n");
+void Shell::ls_rpc(string dname) {
+	string com = "ls";
+	if (!dname.empty())
+		com = com + " " + dname;
+	network_send(com + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on lsl
+void Shell::lsl_rpc(string dname) {
+	string com = "lsl";
+	if (!dname.empty())
+		com = com + " " + dname;
+	network_send(com + "\r\n");
 	network_receive();
 }
 
@@ -135,6 +132,12 @@ void Shell::head_rpc(string fname, int n) {
 	network_receive();
 }
 
+// Remote procedure call on truncate
+void Shell::truncate_rpc(string fname, unsigned long size) {
+	network_send("truncate " + fname + " " + to_string(size) + "\r\n");
+	network_receive();
+}
+
 // Remote procedure call on rm
 void Shell::rm_rpc(string fname) {
 	fname.append("\r\n");
@@ -144,6 +147,36 @@ void Shell::rm_rpc(string fname) {
 	network_receive();
 }
 
+// Remote procedure call on rmr
+void Shell::rmr_rpc(string fname) {
+	network_send("rmr " + fname + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on du
+void Shell::du_rpc(string dname) {
+	network_send(dname.empty() ? "du\r\n" : "du " + dname + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on tree
+void Shell::tree_rpc(string dname) {
+	network_send(dname.empty() ? "tree\r\n" : "tree " + dname + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on snapshot
+void Shell::snapshot_rpc(string name) {
+	network_send("snapshot " + name + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on rmsnap
+void Shell::rmsnap_rpc(string name) {
+	network_send("rmsnap " + name + "\r\n");
+	network_receive();
+}
+
 // Remote procedure call on stat
 void Shell::stat_rpc(string fname) {
 	fname.append("\r\n");
@@ -153,6 +186,114 @@ void Shell::stat_rpc(string fname) {
 	network_receive();
 }
 
+// Remote procedure call on mv
+void Shell::mv_rpc(string from, string to) {
+	network_send("mv " + from + " " + to + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on cp
+void Shell::cp_rpc(string from, string to) {
+	network_send("cp " + from + " " + to + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on open
+void Shell::open_rpc(string fname) {
+	network_send("open " + fname + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on happend
+void Shell::happend_rpc(string handle, string data) {
+	network_send("happend " + handle + " " + data + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on hcat
+void Shell::hcat_rpc(string handle) {
+	network_send("hcat " + handle + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on hhead
+void Shell::hhead_rpc(string handle, int n) {
+	network_send("hhead " + handle + " " + to_string(n) + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on hstat
+void Shell::hstat_rpc(string handle) {
+	network_send("hstat " + handle + "\r\n");
+	network_receive();
+}
+
+// Remote procedure call on stats
+void Shell::stats_rpc() {
+	network_send("stats\r\n");
+	network_receive();
+}
+
+// Remote procedure call on sync
+void Shell::sync_rpc() {
+	network_send("sync\r\n");
+	network_receive();
+}
+
+// Remote procedure call on df
+void Shell::df_rpc() {
+	network_send("df\r\n");
+	network_receive();
+}
+
+// Remote procedure call on compound
+void Shell::compound_rpc(const vector<struct Command> &commands) {
+	string com = "compound " + to_string(commands.size()) + "\r\n";
+	for (size_t k = 0; k < commands.size(); k++)
+		com += request_line(commands[k]);
+	network_send(com);
+	
+	// the body holds the full response of each command run
+	string status, body;
+	receive_response(status, body);
+	size_t pos = 0, k = 0;
+	while (pos < body.length()) {
+		size_t header_end = body.find("\r\n\r\n", pos);
+		size_t length_pos = body.find("Length:", pos);
+		if (header_end == string::npos || length_pos == string::npos)
+			break;
+		int length = atoi(body.c_str() + length_pos + 7);
+		string response = body.substr(header_end + 4, length);
+		decompress_body(body.substr(pos, header_end - pos), response);
+		cout << body.substr(pos, body.find("\r\n", pos) + 2 - pos);
+		cout << response;
+		pos = header_end + 4 + length;
+		k++;
+	}
+	// a command the server did not know stopped the request with no response
+	if (status.compare(0, 3, "511") == 0)
+		cout << status;
+	for (; k < commands.size(); k++)
+		cout << "Not run: " << request_line(commands[k]);
+}
+
+// Request line of a parsed command. "ls -l" and "rm -r" are the lsl and
+// rmr requests.
+string Shell::request_line(const struct Command &command) {
+	string name = command.name, arg = command.file_name, arg2 = command.append_data;
+	if ((name == "ls" && arg == "-l") || (name == "rm" && arg == "-r")) {
+		name += arg[1];
+		arg = arg2;
+		arg2 = "";
+	}
+	string line = name;
+	if (!arg.empty())
+		line += " " + arg;
+	if (!arg2.empty())
+		line += " " + arg2;
+	return line + "\r\n";
+}
+
 // Executes the shell until the user quits.
 void Shell::run()
 {
@@ -211,6 +352,24 @@ void Shell::run_script(char *file_name)
 // Executes the command. Returns true for quit and false otherwise.
 bool Shell::execute_command(string command_str)
 {
+  // split a compound command line at each " ; "
+  if (command_str.find(" ; ") != string::npos) {
+    vector<struct Command> commands;
+    size_t start = 0, end;
+    do {
+      end = command_str.find(" ; ", start);
+      struct Command command = parse_command(command_str.substr(start, end - start));
+      if (command.name == "" || command.name == "quit") {
+        cerr << "Invalid command line: compound commands must all be file system commands" << endl;
+        return false;
+      }
+      commands.push_back(command);
+      start = end + 3;
+    } while (end != string::npos);
+    compound_rpc(commands);
+    return false;
+  }
+
   // parse the command line
   struct Command command = parse_command(command_str);
 
@@ -231,7 +390,10 @@ bool Shell::execute_command(string command_str)
     rmdir_rpc(command.file_name);
   }
   else if (command.name == "ls") {
-    ls_rpc();
+    if (command.file_name == "-l")
+      lsl_rpc(command.append_data);
+    else
+      ls_rpc(command.file_name);
   }
   else if (command.name == "create") {
     create_rpc(command.file_name);
@@ -242,23 +404,79 @@ bool Shell::execute_command(string command_str)
   else if (command.name == "cat") {
     cat_rpc(command.file_name);
   }
-  else if (command.name == "head") {
+  else if (command.name == "head" || command.name == "hhead") {
     errno = 0;
     unsigned long n = strtoul(command.append_data.c_str(), NULL, 0);
     if (0 == errno) {
-      head_rpc(command.file_name, n);
+      if (command.name == "head")
+        head_rpc(command.file_name, n);
+      else
+        hhead_rpc(command.file_name, n);
     } else {
       cerr << "Invalid command line: " << command.append_data;
       cerr << " is not a valid number of bytes" << endl;
       return false;
     }
   }
+  else if (command.name == "truncate") {
+    errno = 0;
+    unsigned long size = strtoul(command.append_data.c_str(), NULL, 0);
+    if (0 == errno) {
+      truncate_rpc(command.file_name, size);
+    } else {
+      cerr << "Invalid command line: " << command.append_data;
+      cerr << " is not a valid size" << endl;
+      return false;
+    }
+  }
   else if (command.name == "rm") {
-    rm_rpc(command.file_name);
+    if (command.file_name == "-r")
+      rmr_rpc(command.append_data);
+    else
+      rm_rpc(command.file_name);
+  }
+  else if (command.name == "du") {
+    du_rpc(command.file_name);
+  }
+  else if (command.name == "tree") {
+    tree_rpc(command.file_name);
+  }
+  else if (command.name == "snapshot") {
+    snapshot_rpc(command.file_name);
+  }
+  else if (command.name == "rmsnap") {
+    rmsnap_rpc(command.file_name);
   }
   else if (command.name == "stat") {
     stat_rpc(command.file_name);
   }
+  else if (command.name == "mv") {
+    mv_rpc(command.file_name, command.append_data);
+  }
+  else if (command.name == "cp") {
+    cp_rpc(command.file_name, command.append_data);
+  }
+  else if (command.name == "open") {
+    open_rpc(command.file_name);
+  }
+  else if (command.name == "happend") {
+    happend_rpc(command.file_name, command.append_data);
+  }
+  else if (command.name == "hcat") {
+    hcat_rpc(command.file_name);
+  }
+  else if (command.name == "hstat") {
+    hstat_rpc(command.file_name);
+  }
+  else if (command.name == "stats") {
+    stats_rpc();
+  }
+  else if (command.name == "sync") {
+    sync_rpc();
+  }
+  else if (command.name == "df") {
+    df_rpc();
+  }
   else if (command.name == "quit") {
     return true;
   }
@@ -297,8 +515,18 @@ Shell::Command Shell::parse_command(string command_str)
   }
     
   // Check for invalid command lines
-  if (command.name == "ls" ||
-      command.name == "home" ||
+  if (command.name == "ls" || command.name == "du" || command.name == "tree")
+  {
+    if (num_tokens > (command.name == "ls" && command.file_name == "-l" ? 3 : 2)) {
+      cerr << "Invalid command line: " << command.name;
+      cerr << " has improper number of arguments" << endl;
+      return empty;
+    }
+  }
+  else if (command.name == "home" ||
+      command.name == "stats" ||
+      command.name == "sync"  ||
+      command.name == "df"    ||
       command.name == "quit")
   {
     if (num_tokens != 1) {
@@ -312,8 +540,13 @@ Shell::Command Shell::parse_command(string command_str)
       command.name == "rmdir" ||
       command.name == "create"||
       command.name == "cat"   ||
-      command.name == "rm"    ||
-      command.name == "stat")
+      (command.name == "rm" && command.file_name != "-r") ||
+      command.name == "stat"  ||
+      command.name == "open"  ||
+      command.name == "snapshot" ||
+      command.name == "rmsnap" ||
+      command.name == "hcat"  ||
+      command.name == "hstat")
   {
     if (num_tokens != 2) {
       cerr << "Invalid command line: " << command.name;
@@ -321,7 +554,10 @@ Shell::Command Shell::parse_command(string command_str)
       return empty;
     }
   }
-  else if (command.name == "append" || command.name == "head")
+  else if (command.name == "append" || command.name == "head" || command.name == "mv" ||
+           command.name == "rm" ||
+           command.name == "cp" || command.name == "truncate" ||
+           command.name == "happend" || command.name == "hhead")
   {
     if (num_tokens != 3) {
       cerr << "Invalid command line: " << command.name;
@@ -338,103 +574,90 @@ Shell::Command Shell::parse_command(string command_str)
   return command;
 }
 
+// Sends a request. Once compression is on, a large one is sent as "z N"
+// and N bytes compressed, unless it does not compress by an eighth.
 void Shell::network_send(string message){
 	int numbytes, x;
 	numbytes = 0;
+	string packed;
+	if (compressing && message.length() >= LZ_MIN_SIZE &&
+	    lz_compress(message.data(), message.length(), packed, message.length() - message.length() / 8))
+		message = "z " + to_string(packed.length()) + "\r\n" + packed;
 	while (numbytes < (int) message.length()){
-		x = send(cs_sock, (void*) message.c_str(), message.length(), 0);
-		if (x == -1)
+		x = chan.send(message.c_str() + numbytes, message.length() - numbytes);
+		if (x == -1){
 			perror("send");
-		else if (x == 0){
 			unmountNFS();
-			exit(0);
+			exit(1);
 		}
 		numbytes += x;
 	}
 }
 
+// Receives one response (status line, Length header, blank line, body) and
+// prints the status line followed by the body.
 void Shell::network_receive(){
-	int status_len = 100;
-	int length_len = 25;
-	char* status;
-	char* length;
-	char* body = nullptr;
-	int numbytes;
+	string status, body;
+	receive_response(status, body);
+	cout << status << body;
+}
+
+// Receives one response. status keeps its CRLF.
+void Shell::receive_response(string &status, string &body){
+	string buf;
+	char chunk[4096];
+	size_t header_end;
 	int x;
-	// Receive Status
-	status = new char(status_len);
-	length = new char(length_len);
-	numbytes = 0;
-	while(status[-2] != '\r' && status[-1] != '\n'){
-		x = recv(cs_sock, (void*) status, (size_t) status_len - numbytes, 0);
-		if (x == -1){
+	// Receive status line and Length header
+	while ((header_end = buf.find("\r\n\r\n")) == string::npos){
+		x = chan.recv((void*) chunk, sizeof chunk);
+		if (x == -1)
 			perror("recv");
-		}
-		// Client Disconnected
-		else if (!x){
+		// Server Disconnected
+		if (x <= 0){
 			unmountNFS();
-			close(cs_sock);
 			exit(0);
 		}
-		status += x;
-		numbytes += x;
+		buf.append(chunk, x);
 	}
-	status -= numbytes;
-	status[numbytes] = '\0';
-	numbytes = 0;
+	size_t status_end = buf.find("\r\n");
+	status = buf.substr(0, status_end + 2);
+	size_t length_pos = buf.find("Length:", status_end);
+	int body_length = 0;
+	if (length_pos != string::npos && length_pos < header_end)
+		body_length = atoi(buf.c_str() + length_pos + 7);
+	string headers = buf.substr(0, header_end);
+	buf.erase(0, header_end + 4);
 	
-	// Receive Length
-	while(length[-4] != '\r' && length[-3] != '\n' && length[-2] != '\r' && length[-1] != '\n'){
-		x = recv(cs_sock, (void*) length, (size_t) length_len - numbytes, 0);
-		if (x == -1){
+	// Receive Body
+	while ((int) buf.length() < body_length){
+		x = chan.recv((void*) chunk, sizeof chunk);
+		if (x == -1)
 			perror("recv");
-		}
-		// Client Disconnected
-		else if (!x){
+		else if (x == 0){
 			unmountNFS();
-			close(cs_sock);
 			exit(0);
 		}
-		length += x;
-		numbytes += x;
+		if (x > 0)
+			buf.append(chunk, x);
 	}
-	// Pull length value from buffer
-	length -= (numbytes - 7);
-	char len_val[numbytes-11];
-	for(int j=0; j< numbytes-11; j++)
-		len_val[j] = length[j];
-	length -= 7;
-	int body_length = atoi(len_val);
 	
-	// Receive Body
-	if (body_length){
-		numbytes = 0;
-		body = new char(body_length+50);
-		while (numbytes < body_length){
-			x = recv(cs_sock, (void*) body, (size_t) body_length - numbytes, 0);
-			if (x == -1)
-				perror("send");
-			else if (x == 0){
-				unmountNFS();
-				exit(0);
-			}
-			numbytes += x;
-			body += x;
-		}
-		body -= numbytes;
-	}
-	
-	string total;
-	total.append(status);
-	if (body_length){
-		total.append(body);
-	}
-	cout << total;
-	
-	delete [] status;
-	delete [] length;
-	if (body_length){
-		delete [] body;
-	}
+	body.assign(buf, 0, body_length);
+	decompress_body(headers, body);
 }
 
+// Decompresses body if headers carry a Compressed header, which gives the
+// length before compression.
+void Shell::decompress_body(const string &headers, string &body){
+	size_t compressed_pos = headers.find("Compressed:");
+	if (compressed_pos == string::npos)
+		return;
+	string unpacked;
+	size_t length = strtoul(headers.c_str() + compressed_pos + 11, NULL, 10);
+	if (!lz_decompress(body.data(), body.length(), unpacked, length) || unpacked.length() != length){
+		cerr << "Client: corrupt compressed response" << endl;
+		unmountNFS();
+		exit(1);
+	}
+	body.swap(unpacked);
+}
@@ -5,6 +5,7 @@
 #define SHELL_H
 
 #include <string>
+#include <vector>
 #include <cstring>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -12,6 +13,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include "Channel.h"
 
 // Shell
 class Shell {
@@ -22,11 +24,15 @@ class Shell {
     }
 
     // Mount a network file system located in host:port, set is_mounted = true if success
-    void mountNFS(string fs_loc);  //fs_loc must be in the format of server:port
+    void mountNFS(string fs_loc);  //fs_loc must be in the format of server:port, unix:path or shm:path
 
     //unmount the mounted network file syste,
     void unmountNFS();
 
+    // Asks the server to compress large response bodies, and compresses
+    // large requests from then on.
+    void enable_compression();
+
     // Executes the shell until the user quits.
     void run();
 
@@ -36,9 +42,11 @@ class Shell {
   private:
     
     int cs_sock; //socket to the network file system server
+    Channel chan; //channel over cs_sock, or over shared memory
 
 
     bool is_mounted; //true if the network file system is mounted, false otherise
+    bool compressing = false; //true once the server agreed to compression
 
     // data structure for command line
     struct Command
@@ -49,8 +57,16 @@ class Shell {
     };
 
     // Executes the command. Returns true for quit and false otherwise.
+    // Commands separated by " ; " are sent as one compound request.
     bool execute_command(string command_str);
 
+    // Sends commands as one compound request, which the server runs in
+    // order until one fails, and prints each one's response.
+    void compound_rpc(const vector<struct Command> &commands);
+
+    // Request line of a parsed command.
+    string request_line(const struct Command &command);
+
     // Parses a command line into a command struct. Returned name is blank
     // for invalid command lines.
     struct Command parse_command(string command_str);
@@ -67,8 +83,11 @@ class Shell {
     // Remote procedure call on rmdir
     void rmdir_rpc(string dname);
 
-    // Remote procedure call on ls
-    void ls_rpc();
+    // Remote procedure call on ls (current directory if dname is empty)
+    void ls_rpc(string dname);
+
+    // Remote procedure call on lsl, for ls -l
+    void lsl_rpc(string dname);
 
     // Remote procedure call on create
     void create_rpc(string fname);
@@ -82,14 +101,54 @@ class Shell {
     // Remote procedure call on head
     void head_rpc(string fname, int n);
 
+    // Remote procedure call on truncate
+    void truncate_rpc(string fname, unsigned long size);
+
     // Remote procedure call on rm
     void rm_rpc(string fname);
 
+    // Remote procedure calls on rmr (rm -r), du and tree
+    void rmr_rpc(string fname);
+    void du_rpc(string dname);
+    void tree_rpc(string dname);
+
     // Remote procedure call on stat
     void stat_rpc(string fname); 
+
+    // Remote procedure call on mv
+    void mv_rpc(string from, string to);
+
+    // Remote procedure call on cp
+    void cp_rpc(string from, string to);
+
+    // Remote procedure calls on open and the handle-based commands
+    void open_rpc(string fname);
+    void happend_rpc(string handle, string data);
+    void hcat_rpc(string handle);
+    void hhead_rpc(string handle, int n);
+    void hstat_rpc(string handle);
+
+    // Remote procedure calls on snapshot and rmsnap
+    void snapshot_rpc(string name);
+    void rmsnap_rpc(string name);
+
+    // Remote procedure call on stats
+    void stats_rpc();
+
+    // Remote procedure call on sync
+    void sync_rpc();
+
+    // Remote procedure call on df
+    void df_rpc();
 	
 	void network_send(string message);
 	void network_receive();
+	
+	// Receives one response without printing it.
+	void receive_response(string &status, string &body);
+	
+	// Decompresses body if headers say it was compressed.
+	void decompress_body(const string &headers, string &body);
 };
 
 #endif
@@ -0,0 +1,297 @@
+// CPSC 3500: Stats
+// Server instrumentation: per-command counts, latency histograms, bytes
+// in/out and disk I/O, updated with relaxed atomics from the request path
+// and reported by the "stats" command.
+
+#include <cstdio>
+
+#include "Stats.h"
+#include "Latency.h"
+#include "Crc32c.h"
+
+Stats server_stats;
+
+static const char *OP_NAMES[NUM_STAT_OPS] = {
+	"mkdir", "ls", "cd", "home", "rmdir", "create", "append",
+	"stat", "cat", "head", "rm", "stats", "open", "happend",
+	"hcat", "hhead", "hstat", "mv", "cp", "lsl", "rmr", "du", "tree", "compound",
+	"compress", "snapshot", "rmsnap", "sync", "df", "truncate", "unknown"
+};
+
+Histogram::Histogram() {
+	for (int b = 0; b < NUM_BUCKETS; b++)
+		counts[b] = 0;
+}
+
+// Records one value in nanoseconds.
+void Histogram::record(long long ns) {
+	counts[bucket(ns)].fetch_add(1, memory_order_relaxed);
+}
+
+// Bucket that ns falls into.
+int Histogram::bucket(long long ns) {
+	if (ns < SUB_BUCKETS)
+		return ns < 0 ? 0 : (int) ns;
+	int exp = 63 - __builtin_clzll(ns);	// ns is in [2^exp, 2^(exp+1))
+	int sub = (int) (ns >> (exp - 4)) & (SUB_BUCKETS - 1);
+	int b = SUB_BUCKETS + (exp - 4) * SUB_BUCKETS + sub;
+	return b < NUM_BUCKETS ? b : NUM_BUCKETS - 1;
+}
+
+// The largest value bucket b holds.
+long long Histogram::bucket_max(int b) {
+	if (b < SUB_BUCKETS)
+		return b;
+	int exp = (b - SUB_BUCKETS) / SUB_BUCKETS + 4;
+	int sub = (b - SUB_BUCKETS) % SUB_BUCKETS;
+	return ((long long) (SUB_BUCKETS + sub + 1) << (exp - 4)) - 1;
+}
+
+// Number of values recorded in bucket b.
+long long Histogram::count(int b) const {
+	return counts[b].load(memory_order_relaxed);
+}
+
+// The p-th percentile (0-100) in nanoseconds.
+long long Histogram::percentile(double p) const {
+	long long total = 0;
+	for (int b = 0; b < NUM_BUCKETS; b++)
+		total += count(b);
+	if (!total)
+		return 0;
+	long long rank = (long long) (p / 100.0 * total + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	long long seen = 0;
+	for (int b = 0; b < NUM_BUCKETS; b++){
+		seen += count(b);
+		if (seen >= rank)
+			return bucket_max(b);
+	}
+	return bucket_max(NUM_BUCKETS - 1);
+}
+
+OpStats::OpStats() : count(0), errors(0), total_ns(0), bytes_in(0),
+	bytes_out(0), disk_reads(0), disk_writes(0) {
+	for (int i = 0; i < NUM_STATUS_CODES; i++)
+		status[i] = 0;
+}
+
+CacheStats::CacheStats(const char *cache_name) : name(cache_name), hits(0),
+	misses(0) {
+}
+
+ReplicaStats::ReplicaStats(const char *volume) : name(volume), connected(0),
+	synced_ns(0), images(0), changes(0), blocks(0) {
+}
+
+// How far behind the primary the volume is.
+long long ReplicaStats::lag_ns() {
+	long long synced = synced_ns.load(memory_order_relaxed);
+	long long lag = wall_ns() - synced;
+	return lag > 0 ? lag : 0;
+}
+
+Stats::Stats() : active_conns(0), total_conns(0), journal_commits(0),
+	journal_blocks(0), journal_syncs(0), journal_checkpoints(0), compressed(0),
+	compress_in(0), compress_out(0), incompressible(0), compress_ns(0), unpacked(0),
+	unpack_in(0), unpack_out(0), unpack_ns(0), replicas(0), shipped_images(0),
+	shipped_changes(0), shipped_blocks(0), image_saves(0), image_blocks(0),
+	image_save_ns(0), checksum_verified(0), checksum_verify_ns(0), checksum_failures(0),
+	checksum_updated(0), checksum_update_ns(0), dedup_lookups(0), dedup_hits(0),
+	dedup_collisions(0), dedup_ns(0), dedup_indexed(0), num_caches(0), num_replicas(0) {
+	for (int i = 0; i < MAX_CACHES; i++)
+		caches[i] = NULL;
+	start = now_ns();
+}
+
+// Command a request line's first word maps to.
+StatOp Stats::op(const string &command) {
+	for (int i = 0; i < OP_UNKNOWN; i++){
+		if (command == OP_NAMES[i])
+			return (StatOp) i;
+	}
+	return OP_UNKNOWN;
+}
+
+const char *Stats::op_name(int op) {
+	return OP_NAMES[op];
+}
+
+// Index of a status code in OpStats::status.
+int Stats::status_index(int code) {
+	if (code == 200)
+		return 1;
+	if (code >= 500 && code < 500 + NUM_STATUS_CODES - 2)
+		return code - 500 + 2;
+	return 0;
+}
+
+// Status code of an index, 0 for "other".
+int Stats::status_code(int index) {
+	if (index == 0)
+		return 0;
+	if (index == 1)
+		return 200;
+	return 500 + index - 2;
+}
+
+// Records one handled request.
+void Stats::record(StatOp op, int status, long long ns, long long bytes_in,
+                   long long bytes_out, long reads, long writes) {
+	OpStats &s = ops[op];
+	s.count.fetch_add(1, memory_order_relaxed);
+	if (status / 100 != 2)
+		s.errors.fetch_add(1, memory_order_relaxed);
+	s.total_ns.fetch_add(ns, memory_order_relaxed);
+	s.bytes_in.fetch_add(bytes_in, memory_order_relaxed);
+	s.bytes_out.fetch_add(bytes_out, memory_order_relaxed);
+	s.disk_reads.fetch_add(reads, memory_order_relaxed);
+	s.disk_writes.fetch_add(writes, memory_order_relaxed);
+	s.status[status_index(status)].fetch_add(1, memory_order_relaxed);
+	s.latency.record(ns);
+}
+
+void Stats::connection_opened() {
+	active_conns.fetch_add(1, memory_order_relaxed);
+	total_conns.fetch_add(1, memory_order_relaxed);
+}
+
+void Stats::connection_closed() {
+	active_conns.fetch_sub(1, memory_order_relaxed);
+}
+
+// Registers a cache whose hit ratio is reported.
+void Stats::add_cache(CacheStats *cache) {
+	// volumes mount in parallel, so claim an empty slot, and only then
+	// raise the count readers scan up to
+	for (int i = 0; i < MAX_CACHES; i++){
+		CacheStats *empty = NULL;
+		if (!caches[i].compare_exchange_strong(empty, cache))
+			continue;
+		int n = num_caches.load();
+		while (n < i + 1 && !num_caches.compare_exchange_weak(n, i + 1))
+			;
+		return;
+	}
+}
+
+// Unregisters a cache, leaving its slot empty for the next one.
+void Stats::remove_cache(CacheStats *cache) {
+	for (int i = 0; i < MAX_CACHES; i++){
+		CacheStats *found = cache;
+		if (caches[i].compare_exchange_strong(found, NULL))
+			return;
+	}
+}
+
+// Registers a replicated volume.
+void Stats::add_replica(ReplicaStats *replica) {
+	int i = num_replicas.load();
+	while (i < MAX_REPLICAS && !num_replicas.compare_exchange_weak(i, i + 1))
+		;
+	if (i < MAX_REPLICAS)
+		replica_volumes[i] = replica;
+}
+
+// Formats nanoseconds as microseconds with one decimal.
+static string us(double ns) {
+	char out[32];
+	snprintf(out, sizeof out, "%.1f", ns / 1000.0);
+	return out;
+}
+
+// Human-readable report of every counter.
+string Stats::report() {
+	char line[256];
+	string out;
+	snprintf(line, sizeof line, "uptime %.1f s, connections %ld active, %ld total\n",
+	         (now_ns() - start) / 1e9, active_conns.load(), total_conns.load());
+	out.append(line);
+	snprintf(line, sizeof line, "%-8s %8s %6s %9s %9s %9s %9s %9s %10s %10s %7s %7s\n",
+	         "op", "count", "errors", "mean(us)", "p50", "p95", "p99", "p99.9",
+	         "bytes_in", "bytes_out", "rd/op", "wr/op");
+	out.append(line);
+	for (int op = 0; op < NUM_STAT_OPS; op++){
+		OpStats &s = ops[op];
+		long long count = s.count.load();
+		if (!count)
+			continue;
+		snprintf(line, sizeof line, "%-8s %8lld %6lld %9s %9s %9s %9s %9s %10lld %10lld %7.2f %7.2f\n",
+		         OP_NAMES[op], count, s.errors.load(), us((double) s.total_ns.load() / count).c_str(),
+		         us(s.latency.percentile(50)).c_str(), us(s.latency.percentile(95)).c_str(),
+		         us(s.latency.percentile(99)).c_str(), us(s.latency.percentile(99.9)).c_str(),
+		         s.bytes_in.load(), s.bytes_out.load(), (double) s.disk_reads.load() / count,
+		         (double) s.disk_writes.load() / count);
+		out.append(line);
+	}
+	long long commits = journal_commits.load(), syncs = journal_syncs.load();
+	if (commits){
+		snprintf(line, sizeof line, "journal: %lld commits, %lld blocks, %lld syncs (%.2f commits/sync), %lld checkpoints\n",
+		         commits, journal_blocks.load(), syncs, syncs ? (double) commits / syncs : 0.0,
+		         journal_checkpoints.load());
+		out.append(line);
+	}
+	long long packed = compressed.load(), skipped = incompressible.load(), requests = unpacked.load();
+	if (packed || skipped || requests){
+		long long in = compress_in.load(), out_bytes = compress_out.load();
+		snprintf(line, sizeof line, "compression: %lld bodies, %lld -> %lld bytes (%.2fx), %lld incompressible, %.1f ms; "
+		         "%lld requests, %lld -> %lld bytes, %.1f ms\n",
+		         packed, in, out_bytes, out_bytes ? (double) in / out_bytes : 0.0, skipped,
+		         compress_ns.load() / 1e6, requests, unpack_in.load(),
+		         unpack_out.load(), unpack_ns.load() / 1e6);
+		out.append(line);
+	}
+	long long saves = image_saves.load();
+	if (saves){
+		snprintf(line, sizeof line, "saves: %lld images, %lld blocks, %.1f ms\n",
+		         saves, image_blocks.load(), image_save_ns.load() / 1e6);
+		out.append(line);
+	}
+	long long verified = checksum_verified.load(), updated = checksum_updated.load();
+	if (verified || updated){
+		snprintf(line, sizeof line, "checksums (%s): %lld verified, %.0f ns each, %lld failed; "
+		         "%lld updated, %.0f ns each\n", crc32c_method(), verified,
+		         verified ? (double) checksum_verify_ns.load() / verified : 0.0,
+		         checksum_failures.load(), updated,
+		         updated ? (double) checksum_update_ns.load() / updated : 0.0);
+		out.append(line);
+	}
+	long long lookups = dedup_lookups.load();
+	if (lookups){
+		// the ratio of full blocks written to blocks stored for them
+		long long hits = dedup_hits.load();
+		char ratio[32] = "inf";
+		if (hits < lookups)
+			snprintf(ratio, sizeof ratio, "%.2f", (double) lookups / (lookups - hits));
+		snprintf(line, sizeof line, "dedup: %lld full blocks, %lld shared, ratio %s:1, %lld collisions, "
+		         "%ld indexed, %.1f ms\n", lookups, hits, ratio,
+		         dedup_collisions.load(), dedup_indexed.load(), dedup_ns.load() / 1e6);
+		out.append(line);
+	}
+	long long images = shipped_images.load(), changes = shipped_changes.load();
+	if (images || changes){
+		snprintf(line, sizeof line, "shipping: %ld replicas, %lld images, %lld changes, %lld blocks\n",
+		         replicas.load(), images, changes, shipped_blocks.load());
+		out.append(line);
+	}
+	for (int i = 0; i < num_replicas.load(); i++){
+		ReplicaStats *r = replica_volumes[i];
+		string lag = r->synced_ns.load() ? to_string(r->lag_ns() / 1000000) + " ms" : "never synced";
+		snprintf(line, sizeof line, "replica %s: %s, lag %s, %lld images, %lld changes, %lld blocks\n",
+		         r->name, r->connected.load() ? "connected" : "disconnected", lag.c_str(),
+		         r->images.load(), r->changes.load(), r->blocks.load());
+		out.append(line);
+	}
+	for (int i = 0; i < num_caches.load(); i++){
+		CacheStats *cache = caches[i].load();
+		if (!cache)
+			continue;
+		long long hits = cache->hits.load(), misses = cache->misses.load();
+		snprintf(line, sizeof line, "cache %s: %lld hits, %lld misses, hit ratio %.1f%%\n",
+		         cache->name, hits, misses,
+		         hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+		out.append(line);
+	}
+	return out;
+}
@@ -0,0 +1,203 @@
+// CPSC 3500: Stats
+// Server instrumentation: per-command counts, latency histograms, bytes
+// in/out and disk I/O, updated with relaxed atomics from the request path
+// and reported by the "stats" command.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <string>
+
+using namespace std;
+
+// Commands the server tracks separately
+enum StatOp {
+	OP_MKDIR, OP_LS, OP_CD, OP_HOME, OP_RMDIR, OP_CREATE, OP_APPEND,
+	OP_STAT, OP_CAT, OP_HEAD, OP_RM, OP_STATS, OP_OPEN, OP_HAPPEND,
+	OP_HCAT, OP_HHEAD, OP_HSTAT, OP_MV, OP_CP, OP_LSL,
+	OP_RMR, OP_DU, OP_TREE, OP_COMPOUND, OP_COMPRESS, OP_SNAPSHOT,
+	OP_RMSNAP, OP_SYNC, OP_DF, OP_TRUNCATE, OP_UNKNOWN, NUM_STAT_OPS
+};
+
+// Response status codes tracked separately: 200, 500-517, and other
+const int NUM_STATUS_CODES = 20;
+
+// Latency histogram with log-linear buckets, in the style of HdrHistogram:
+// values below 16 ns get one bucket each, above that every power of two is
+// split into 16 buckets, so any recorded value is within 1/16 of its
+// bucket's bounds. Recording is a single relaxed atomic increment.
+class Histogram {
+
+  public:
+    static const int SUB_BUCKETS = 16;
+    static const int NUM_BUCKETS = SUB_BUCKETS + 60 * SUB_BUCKETS;
+
+    Histogram();
+
+    // Records one value in nanoseconds.
+    void record(long long ns);
+
+    // Bucket that ns falls into, and the largest value bucket b holds.
+    static int bucket(long long ns);
+    static long long bucket_max(int b);
+
+    // Number of values recorded in bucket b.
+    long long count(int b) const;
+
+    // The p-th percentile (0-100) in nanoseconds, reported as the upper
+    // bound of the bucket it falls in; 0 if nothing was recorded.
+    long long percentile(double p) const;
+
+  private:
+    atomic<long long> counts[NUM_BUCKETS];
+};
+
+// Counters for one command
+struct OpStats {
+	atomic<long long> count;
+	atomic<long long> errors;		// responses other than 2xx
+	atomic<long long> total_ns;
+	atomic<long long> bytes_in;		// request bytes
+	atomic<long long> bytes_out;		// response bytes
+	atomic<long long> disk_reads;		// blocks read
+	atomic<long long> disk_writes;		// blocks written
+	atomic<long long> status[NUM_STATUS_CODES];
+	Histogram latency;
+
+	OpStats();
+};
+
+// Hit/miss counters a cache reports through the stats command.
+struct CacheStats {
+	const char *name;
+	atomic<long long> hits;
+	atomic<long long> misses;
+
+	CacheStats(const char *cache_name);
+};
+
+// A volume kept in step with a primary server's, reported through the
+// stats command.
+struct ReplicaStats {
+	const char *name;		// volume
+	atomic<int> connected;		// following the primary now
+	atomic<long long> synced_ns;	// wall clock time on the primary the
+					// volume is current as of, 0 if never
+	atomic<long long> images;	// full copies received
+	atomic<long long> changes;	// transactions applied
+	atomic<long long> blocks;	// blocks they wrote
+
+	ReplicaStats(const char *volume);
+
+	// How far behind the primary the volume is, in nanoseconds: the time
+	// since the primary last reported everything it had committed.
+	long long lag_ns();
+};
+
+class Stats {
+
+  public:
+    Stats();
+
+    // Command a request line's first word maps to.
+    static StatOp op(const string &command);
+    static const char *op_name(int op);
+
+    // Index of a status code in OpStats::status, and the code of an index
+    // (0 for "other").
+    static int status_index(int code);
+    static int status_code(int index);
+
+    // Records one handled request.
+    void record(StatOp op, int status, long long ns, long long bytes_in,
+                long long bytes_out, long reads, long writes);
+
+    // Connection accounting.
+    void connection_opened();
+    void connection_closed();
+
+    // Registers a cache whose hit ratio is reported, or unregisters one
+    // before it goes away. At most MAX_CACHES at a time; safe to call
+    // from several threads.
+    void add_cache(CacheStats *cache);
+    void remove_cache(CacheStats *cache);
+
+    // Registers a replicated volume, at most MAX_REPLICAS.
+    void add_replica(ReplicaStats *replica);
+
+    // Human-readable report of everything above.
+    string report();
+
+    OpStats ops[NUM_STAT_OPS];
+    atomic<long> active_conns;
+    atomic<long> total_conns;
+
+    // Journal activity: transactions and blocks logged, fdatasyncs shared
+    // by group commit, and checkpoints.
+    atomic<long long> journal_commits;
+    atomic<long long> journal_blocks;
+    atomic<long long> journal_syncs;
+    atomic<long long> journal_checkpoints;
+
+    // Compression: response bodies compressed, their bytes before and
+    // after, bodies sent as they were because they did not compress, and
+    // time spent; compressed requests unpacked, their bytes before and
+    // after, and time spent.
+    atomic<long long> compressed;
+    atomic<long long> compress_in;
+    atomic<long long> compress_out;
+    atomic<long long> incompressible;
+    atomic<long long> compress_ns;
+    atomic<long long> unpacked;
+    atomic<long long> unpack_in;
+    atomic<long long> unpack_out;
+    atomic<long long> unpack_ns;
+
+    // Shipping to replicas: replicas following this server, and the full
+    // copies, transactions and blocks sent to them.
+    atomic<long> replicas;
+    atomic<long long> shipped_images;
+    atomic<long long> shipped_changes;
+    atomic<long long> shipped_blocks;
+
+    // Saving volumes kept in memory: images written, their blocks, and
+    // time spent writing them.
+    atomic<long long> image_saves;
+    atomic<long long> image_blocks;
+    atomic<long long> image_save_ns;
+
+    // Block checksums: blocks read from disk that were checked, the time
+    // spent checking them and those that failed; checksums computed for
+    // blocks written, and the time spent computing them.
+    atomic<long long> checksum_verified;
+    atomic<long long> checksum_verify_ns;
+    atomic<long long> checksum_failures;
+    atomic<long long> checksum_updated;
+    atomic<long long> checksum_update_ns;
+
+    // Deduplication: full data blocks looked up by fingerprint, those that
+    // shared a block already on disk, fingerprints that matched different
+    // data, time spent, and blocks indexed across volumes.
+    atomic<long long> dedup_lookups;
+    atomic<long long> dedup_hits;
+    atomic<long long> dedup_collisions;
+    atomic<long long> dedup_ns;
+    atomic<long> dedup_indexed;
+
+    static const int MAX_CACHES = 24;
+    atomic<int> num_caches;			// slots in use so far
+    atomic<CacheStats *> caches[MAX_CACHES];	// NULL once removed
+
+    static const int MAX_REPLICAS = 16;
+    atomic<int> num_replicas;
+    ReplicaStats *replica_volumes[MAX_REPLICAS];
+
+  private:
+    long long start;	// now_ns() when the server started
+};
+
+// The server's statistics
+extern Stats server_stats;
+
+#endif
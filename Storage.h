@@ -0,0 +1,48 @@
+// CPSC 3500: Storage
+// Where a volume's blocks live, beneath BasicFileSys and the journal: a
+// Disk file that every write goes to, or a RamDisk that keeps the volume
+// in memory and saves an image of it to the file now and then.
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+class Storage {
+
+  public:
+    virtual ~Storage() {
+    }
+
+    // Opens the storage kept in file_name. Returns true if it is new and
+    // needs formatting.
+    virtual bool mount(const char *file_name) = 0;
+
+    // Closes the storage, saving it first if it is kept in memory.
+    virtual void unmount() = 0;
+
+    // Reads block block_num into block.
+    virtual void read_block(int block_num, void *block) = 0;
+
+    // Writes the data in block to block block_num.
+    virtual void write_block(int block_num, void *block) = 0;
+
+    // Writes count consecutive blocks starting at block_num.
+    virtual void write_blocks(int block_num, int count, const void *blocks) = 0;
+
+    // Waits until everything written so far is as durable as the storage
+    // makes it.
+    virtual void sync() = 0;
+
+    // Number of blocks held.
+    virtual int num_blocks() = 0;
+
+    // Storage kept in memory is saved in two steps: take_image copies it,
+    // with the file system lock held so the copy is consistent, and
+    // save_image writes the copy to the file without the lock. A disk file
+    // has nothing to save.
+    virtual void take_image() {
+    }
+    virtual void save_image() {
+    }
+};
+
+#endif
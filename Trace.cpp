@@ -0,0 +1,121 @@
+// CPSC 3500: Trace
+// Binary request traces written by the server and read by nfsreplay.
+
+#include <cstring>
+
+#include "Trace.h"
+#include "Latency.h"
+
+static const char TRACE_MAGIC[8] = { 'N', 'F', 'S', 'T', 'R', 'C', '1', '\n' };
+
+// Buffered records older than this are flushed with the next record, so a
+// killed server loses at most this much of its trace.
+static const long long FLUSH_INTERVAL = 100000000LL;	// 100 ms
+
+// Appends v to buf as an unsigned LEB128 varint.
+static void put_varint(string &buf, unsigned long long v) {
+	while (v >= 0x80){
+		buf.append(1, (char) (v | 0x80));
+		v >>= 7;
+	}
+	buf.append(1, (char) v);
+}
+
+// Reads an unsigned LEB128 varint. Returns false at EOF.
+static bool get_varint(FILE *in, unsigned long long &v) {
+	v = 0;
+	for (int shift = 0; shift < 64; shift += 7){
+		int c = getc(in);
+		if (c == EOF)
+			return false;
+		v |= (unsigned long long) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// Creates path and writes the header.
+bool TraceWriter::open(const char *path) {
+	out = fopen(path, "wb");
+	if (!out)
+		return false;
+	fwrite(TRACE_MAGIC, 1, sizeof TRACE_MAGIC, out);
+	start = now_ns();
+	last_arrival = 0;
+	last_flush = start;
+	return true;
+}
+
+// Writes any buffered records and closes the file.
+void TraceWriter::close() {
+	lock_guard<mutex> guard(lock);
+	if (out)
+		fclose(out);
+	out = NULL;
+}
+
+// Appends one record.
+void TraceWriter::record(unsigned conn, long long arrival, int status,
+                         long long service, const string &request) {
+	string buf;
+	lock_guard<mutex> guard(lock);
+	if (!out)
+		return;
+	arrival -= start;
+	long long delta = arrival - last_arrival;
+	last_arrival = arrival;
+	put_varint(buf, ((unsigned long long) delta << 1) ^ (unsigned long long) (delta >> 63));
+	put_varint(buf, conn);
+	put_varint(buf, status);
+	put_varint(buf, service);
+	put_varint(buf, request.length());
+	buf.append(request);
+	fwrite(buf.data(), 1, buf.length(), out);
+
+	long long now = now_ns();
+	if (now - last_flush > FLUSH_INTERVAL){
+		fflush(out);
+		last_flush = now;
+	}
+}
+
+// Opens path and checks the header.
+bool TraceReader::open(const char *path) {
+	char magic[sizeof TRACE_MAGIC];
+	in = fopen(path, "rb");
+	if (!in)
+		return false;
+	if (fread(magic, 1, sizeof magic, in) != sizeof magic ||
+	    memcmp(magic, TRACE_MAGIC, sizeof magic) != 0){
+		fclose(in);
+		in = NULL;
+		return false;
+	}
+	last_arrival = 0;
+	return true;
+}
+
+void TraceReader::close() {
+	if (in)
+		fclose(in);
+	in = NULL;
+}
+
+// Reads the next record. A record cut short by a crash ends the trace.
+bool TraceReader::next(TraceRecord &rec) {
+	unsigned long long delta, conn, status, service, length;
+	if (!get_varint(in, delta) || !get_varint(in, conn) ||
+	    !get_varint(in, status) || !get_varint(in, service) ||
+	    !get_varint(in, length))
+		return false;
+	rec.request.resize(length);
+	if (length && fread(&rec.request[0], 1, length, in) != length)
+		return false;
+	last_arrival += (long long) (delta >> 1) ^ -(long long) (delta & 1);
+	rec.arrival = last_arrival;
+	rec.conn = conn;
+	rec.status = status;
+	rec.service = service;
+	return true;
+}
@@ -0,0 +1,78 @@
+// CPSC 3500: Trace
+// Binary request traces. The server records every request it handles
+// (arrival time, connection, request line, response status and service
+// time) and nfsreplay reads them back to re-drive a server.
+//
+// A trace file is the 8-byte magic "NFSTRC1\n" followed by records. Every
+// record field is an unsigned LEB128 varint, except the request bytes:
+//   arrival delta (ns, zigzag signed: records are written in completion
+//   order, so arrivals can go backwards), connection id, status code,
+//   service time (ns), request length, request bytes (no CRLF).
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdio>
+#include <string>
+#include <mutex>
+
+using namespace std;
+
+// One traced request
+struct TraceRecord {
+	long long arrival;	// ns since the trace started
+	unsigned conn;		// connection id, unique within the trace
+	int status;		// response status code, 0 if none was sent
+	long long service;	// ns from arrival until the response was sent
+	string request;		// request line without CRLF
+};
+
+// Appends records to a trace file. Safe to share between connections.
+class TraceWriter {
+
+  public:
+    TraceWriter() : out(NULL), start(0), last_arrival(0), last_flush(0) {
+    }
+
+    // Creates path and writes the header. Returns false on failure.
+    bool open(const char *path);
+
+    // Writes any buffered records and closes the file.
+    void close();
+
+    // Time origin of the trace, on the now_ns() clock.
+    long long start_time() const { return start; }
+
+    // Appends one record; arrival is on the now_ns() clock.
+    void record(unsigned conn, long long arrival, int status,
+                long long service, const string &request);
+
+  private:
+    FILE *out;
+    mutex lock;			// serializes record()
+    long long start;		// now_ns() when the trace was opened
+    long long last_arrival;	// arrival of the previous record
+    long long last_flush;	// now_ns() of the last flush
+};
+
+// Reads a trace file written by TraceWriter.
+class TraceReader {
+
+  public:
+    TraceReader() : in(NULL), last_arrival(0) {
+    }
+
+    // Opens path and checks the header. Returns false on failure.
+    bool open(const char *path);
+
+    void close();
+
+    // Reads the next record. Returns false at the end of the trace.
+    bool next(TraceRecord &rec);
+
+  private:
+    FILE *in;
+    long long last_arrival;
+};
+
+#endif
@@ -11,19 +11,30 @@ int main(int argc, char **argv)
 {
   Shell shell;
 
+  // -z: compress large requests and responses
+  bool compress = argc > 1 && strcmp(argv[1], "-z") == 0;
+  if (compress) {
+    argc--;
+    argv++;
+  }
+
   if (argc == 2) {
     shell.mountNFS(string(argv[1]));
+    if (compress) shell.enable_compression();
     shell.run();
   }
   else if (argc == 4 && strcmp(argv[1], "-s") == 0) {
     shell.mountNFS(string(argv[3]));
+    if (compress) shell.enable_compression();
     shell.run_script(argv[2]);
   }
   else {
     cerr << "Invalid command line" << endl;
     cerr << "Usage (one of the following): " << endl;
-    cerr << "./nfsclient server:port" << endl;
-    cerr << "./nfsclient -s <script-name> server:port" << endl;
+    cerr << "./nfsclient [-z] server:port" << endl;
+    cerr << "./nfsclient [-z] -s <script-name> server:port" << endl;
+    cerr << "(or unix:path / shm:path for a server on this host started with -u path)" << endl;
+    cerr << "-z compresses large requests and responses" << endl;
   }
 
   return 0;
@@ -0,0 +1,425 @@
+// CPSC 3500: nfsbench
+// Load generator for the network file system server. Opens several client
+// connections, drives a weighted mix of operations against the server for a
+// fixed time or operation count and reports throughput and latency
+// percentiles per operation, as a table and optionally as JSON.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+using namespace std;
+
+#include "Blocks.h"
+#include "Connection.h"
+#include "Latency.h"
+
+// Operations the generator can issue
+enum Op { OP_CREATE, OP_APPEND, OP_CAT, OP_LS, OP_STAT, OP_RM, NUM_OPS };
+static const char *OP_NAMES[NUM_OPS] = {
+	"create", "append", "cat", "ls", "stat", "rm"
+};
+
+// A size distribution: fixed ("N"), uniform ("A-B") or exponential ("expN").
+struct Dist {
+	char kind;	// 'f', 'u' or 'e'
+	double a, b;
+
+	bool parse(const string &spec);
+	long sample(mt19937 &rng) const;
+};
+
+bool Dist::parse(const string &spec) {
+	char *end;
+	if (spec.compare(0, 3, "exp") == 0){
+		kind = 'e';
+		a = strtod(spec.c_str() + 3, &end);
+		return *end == '\0' && a > 0;
+	}
+	a = strtod(spec.c_str(), &end);
+	if (*end == '\0'){
+		kind = 'f';
+		return a >= 0;
+	}
+	if (*end != '-')
+		return false;
+	kind = 'u';
+	b = strtod(end + 1, &end);
+	return *end == '\0' && a >= 0 && b >= a;
+}
+
+long Dist::sample(mt19937 &rng) const {
+	if (kind == 'f')
+		return (long) a;
+	if (kind == 'u')
+		return uniform_int_distribution<long>((long) a, (long) b)(rng);
+	return (long) exponential_distribution<double>(1.0 / a)(rng);
+}
+
+// Benchmark configuration
+struct Config {
+	string server;
+	int conns = 1;
+	double duration = 10;		// seconds, used when ops == 0
+	long ops = 0;			// total operations over all connections
+	int mix[NUM_OPS] = { 15, 30, 25, 10, 10, 10 };
+	Dist append_size = { 'u', 16, 512 };	// bytes per append
+	Dist dir_size = { 'f', MAX_DIR_ENTRIES, 0 };	// entries per directory
+	unsigned seed = 1;
+	string json;			// JSON output file, "-" for stdout
+	bool handles = false;		// append/cat/stat through file handles
+	bool compress = false;		// compress large requests and responses
+	string parent;			// directory to run in, e.g. a volume
+};
+
+// Results of one connection
+struct WorkerResult {
+	LatencyRecorder lat[NUM_OPS];
+	long errors[NUM_OPS] = {};
+	map<string, long> status[NUM_OPS];	// count per status code
+	bool failed = false;			// lost the connection
+};
+
+// Files a worker owns in its directory
+struct BenchFile {
+	string name;
+	long size;
+	string handle;	// from open, with -H
+};
+
+static atomic<bool> start_flag(false);
+
+// Issues one request and records its latency and status under op.
+static bool timed_request(Connection &conn, WorkerResult &res, Op op,
+                          const string &req, string &status) {
+	string body;
+	long long start = now_ns();
+	if (!conn.request(req, status, body)){
+		res.failed = true;
+		return false;
+	}
+	res.lat[op].add(now_ns() - start);
+	string code = status.substr(0, 3);
+	res.status[op][code]++;
+	if (code[0] != '2')
+		res.errors[op]++;
+	return true;
+}
+
+// Runs the operation mix on one connection inside top/dir until the deadline
+// or the operation quota is reached.
+static void worker(const Config &cfg, int id, string top, string dir, long quota,
+                   long long *deadline, WorkerResult *res) {
+	Connection conn;
+	string status, body;
+	mt19937 rng(cfg.seed * 7919 + id);
+	vector<BenchFile> files;
+	int next_name = 0;
+
+	if (!conn.open(cfg.server) || (cfg.compress && !conn.compress()) ||
+	    !conn.request("cd " + top + "/" + dir, status, body)){
+		res->failed = true;
+		return;
+	}
+	// directory capacity for this worker's share of dir
+	long cap = cfg.dir_size.sample(rng);
+	if (cap < 1)
+		cap = 1;
+	if (cap > MAX_DIR_ENTRIES)
+		cap = MAX_DIR_ENTRIES;
+	int sharers = (cfg.conns + MAX_DIR_ENTRIES - 1) / MAX_DIR_ENTRIES;
+	cap = max(1L, cap / sharers);
+
+	int total_weight = 0;
+	for (int i = 0; i < NUM_OPS; i++)
+		total_weight += cfg.mix[i];
+
+	while (!start_flag.load())
+		this_thread::yield();
+
+	for (long n = 0; quota ? n < quota : now_ns() < *deadline; n++){
+		// pick an operation by weight
+		int pick = uniform_int_distribution<int>(0, total_weight - 1)(rng);
+		int op = 0;
+		while (pick >= cfg.mix[op])
+			pick -= cfg.mix[op++];
+
+		// operations that need a file create one first; a full directory
+		// turns a create into a remove
+		if (op != OP_CREATE && op != OP_LS && files.empty())
+			op = OP_CREATE;
+		if (op == OP_CREATE && (long) files.size() >= cap)
+			op = OP_RM;
+
+		size_t f = files.empty() ? 0 :
+			uniform_int_distribution<size_t>(0, files.size() - 1)(rng);
+		long len = 0;
+		if (op == OP_APPEND){
+			len = max(1L, cfg.append_size.sample(rng));
+			if (len > MAX_FILE_SIZE)
+				len = MAX_FILE_SIZE;
+			// a file that can't take the append is recycled
+			if (files[f].size + len > MAX_FILE_SIZE)
+				op = OP_RM;
+		}
+
+		string req;
+		switch (op){
+		case OP_CREATE: {
+			// names are reused cyclically, skipping ones still in use
+			string name;
+			bool used = true;
+			while (used){
+				name = "f" + to_string(id) + "_" + to_string(next_name++ % 100);
+				used = false;
+				for (size_t i = 0; i < files.size(); i++)
+					used = used || files[i].name == name;
+			}
+			req = "create " + name;
+			if (!timed_request(conn, *res, OP_CREATE, req, status))
+				return;
+			if (status.compare(0, 3, "200") != 0)
+				continue;
+			// with -H the file is opened once, untimed
+			string handle;
+			if (cfg.handles && !conn.request("open " + name, status, handle)){
+				res->failed = true;
+				return;
+			}
+			files.push_back({ name, 0, handle });
+			continue;
+		}
+		case OP_APPEND:
+			req = cfg.handles ? "happend " + files[f].handle : "append " + files[f].name;
+			req += " " + string(len, 'a' + f % 26);
+			break;
+		case OP_CAT:
+			req = cfg.handles ? "hcat " + files[f].handle : "cat " + files[f].name;
+			break;
+		case OP_LS:
+			req = "ls";
+			break;
+		case OP_STAT:
+			req = cfg.handles ? "hstat " + files[f].handle : "stat " + files[f].name;
+			break;
+		case OP_RM:
+			req = "rm " + files[f].name;
+			break;
+		}
+		if (!timed_request(conn, *res, (Op) op, req, status))
+			return;
+		if (status.compare(0, 3, "200") != 0)
+			continue;
+		if (op == OP_APPEND)
+			files[f].size += len;
+		else if (op == OP_RM)
+			files.erase(files.begin() + f);
+	}
+
+	// clean up what this worker left behind
+	for (size_t i = 0; i < files.size(); i++)
+		conn.request("rm " + files[i].name, status, body);
+	conn.close();
+}
+
+// Parses a mix such as "create=10,append=40,cat=50".
+static bool parse_mix(const string &spec, int mix[NUM_OPS]) {
+	for (int i = 0; i < NUM_OPS; i++)
+		mix[i] = 0;
+	stringstream ss(spec);
+	string item;
+	int total = 0;
+	while (getline(ss, item, ',')){
+		size_t eq = item.find('=');
+		if (eq == string::npos)
+			return false;
+		string name = item.substr(0, eq);
+		int i;
+		for (i = 0; i < NUM_OPS && name != OP_NAMES[i]; i++);
+		if (i == NUM_OPS)
+			return false;
+		mix[i] = atoi(item.c_str() + eq + 1);
+		if (mix[i] < 0)
+			return false;
+		total += mix[i];
+	}
+	return total > 0;
+}
+
+static void usage() {
+	cerr << "Usage: ./nfsbench [options] server:port   (or unix:path, shm:path)" << endl;
+	cerr << "  -c conns     number of client connections (default 1)" << endl;
+	cerr << "  -d seconds   run for a fixed time (default 10)" << endl;
+	cerr << "  -n ops       run a fixed number of operations instead" << endl;
+	cerr << "  -m mix       op weights, e.g. create=15,append=30,cat=25,ls=10,stat=10,rm=10" << endl;
+	cerr << "  -s dist      bytes per append: N, A-B (uniform) or expN (default 16-512)" << endl;
+	cerr << "  -f dist      files per directory, same forms (default " << MAX_DIR_ENTRIES << ")" << endl;
+	cerr << "  -r seed      random seed (default 1)" << endl;
+	cerr << "  -j file      also write results as JSON to file (- for stdout)" << endl;
+	cerr << "  -H           open each file once and append/cat/stat by handle" << endl;
+	cerr << "  -z           compress large requests and responses" << endl;
+	cerr << "  -p dir       run in dir, e.g. /name for a volume (default: the home directory)" << endl;
+}
+
+// Formats nanoseconds as microseconds with one decimal.
+static string us(double ns) {
+	char out[32];
+	snprintf(out, sizeof out, "%.1f", ns / 1000.0);
+	return out;
+}
+
+int main(int argc, char **argv) {
+	Config cfg;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:d:n:m:s:f:r:j:Hzp:")) != -1){
+		bool ok = true;
+		switch (opt){
+		case 'c': cfg.conns = atoi(optarg); ok = cfg.conns > 0; break;
+		case 'd': cfg.duration = atof(optarg); ok = cfg.duration > 0; break;
+		case 'n': cfg.ops = atol(optarg); ok = cfg.ops > 0; break;
+		case 'm': ok = parse_mix(optarg, cfg.mix); break;
+		case 's': ok = cfg.append_size.parse(optarg); break;
+		case 'f': ok = cfg.dir_size.parse(optarg); break;
+		case 'r': cfg.seed = strtoul(optarg, NULL, 10); break;
+		case 'j': cfg.json = optarg; break;
+		case 'H': cfg.handles = true; break;
+		case 'z': cfg.compress = true; break;
+		case 'p': cfg.parent = optarg; break;
+		default: ok = false;
+		}
+		if (!ok){
+			usage();
+			return 1;
+		}
+	}
+	if (optind != argc - 1){
+		usage();
+		return 1;
+	}
+	cfg.server = argv[optind];
+
+	// each run works in its own top-level directory with up to
+	// MAX_DIR_ENTRIES worker directories below it, shared round-robin
+	Connection setup;
+	string status, body;
+	string top = "nb" + to_string(getpid() % 10000000);
+	if (!cfg.parent.empty())
+		top = cfg.parent + "/" + top;
+	int ndirs = min(cfg.conns, MAX_DIR_ENTRIES);
+	if (!setup.open(cfg.server))
+		return 1;
+	setup.request("mkdir " + top, status, body);
+	if (status.compare(0, 3, "200") != 0){
+		cerr << "mkdir " << top << ": " << status << endl;
+		return 1;
+	}
+	setup.request("cd " + top, status, body);
+	for (int i = 0; i < ndirs; i++)
+		setup.request("mkdir w" + to_string(i), status, body);
+
+	vector<WorkerResult> results(cfg.conns);
+	vector<thread> threads;
+	long long deadline = 0;
+	for (int i = 0; i < cfg.conns; i++){
+		long quota = 0;
+		if (cfg.ops)
+			quota = cfg.ops / cfg.conns + (i < cfg.ops % cfg.conns ? 1 : 0);
+		string dir = "w" + to_string(i % ndirs);
+		threads.push_back(thread(worker, cref(cfg), i, top, dir, quota, &deadline, &results[i]));
+	}
+	long long start = now_ns();
+	deadline = start + (long long) (cfg.duration * 1e9);
+	start_flag = true;
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	double elapsed = (now_ns() - start) / 1e9;
+
+	// remove the run's directories
+	for (int i = 0; i < ndirs; i++)
+		setup.request("rmdir w" + to_string(i), status, body);
+	setup.request("home", status, body);
+	setup.request("rmdir " + top, status, body);
+	setup.close();
+
+	// merge per-connection results
+	WorkerResult total;
+	int failed = 0;
+	for (size_t i = 0; i < results.size(); i++){
+		failed += results[i].failed;
+		for (int op = 0; op < NUM_OPS; op++){
+			total.lat[op].merge(results[i].lat[op]);
+			total.errors[op] += results[i].errors[op];
+			for (auto &s : results[i].status[op])
+				total.status[op][s.first] += s.second;
+		}
+	}
+	long ops = 0, errors = 0;
+	for (int op = 0; op < NUM_OPS; op++){
+		ops += total.lat[op].count();
+		errors += total.errors[op];
+	}
+
+	// human-readable report
+	printf("nfsbench: %d connection(s), %.2f s, %ld ops, %ld errors, %.1f ops/s\n",
+	       cfg.conns, elapsed, ops, errors, ops / elapsed);
+	if (failed)
+		printf("warning: %d connection(s) lost\n", failed);
+	printf("%-7s %9s %7s %10s %9s %9s %9s %9s %9s %9s\n", "op", "count", "errors",
+	       "ops/s", "mean(us)", "p50", "p95", "p99", "p99.9", "max");
+	for (int op = 0; op < NUM_OPS; op++){
+		LatencyRecorder &l = total.lat[op];
+		if (!l.count())
+			continue;
+		printf("%-7s %9zu %7ld %10.1f %9s %9s %9s %9s %9s %9s\n", OP_NAMES[op],
+		       l.count(), total.errors[op], l.count() / elapsed, us(l.mean()).c_str(),
+		       us(l.percentile(50)).c_str(), us(l.percentile(95)).c_str(),
+		       us(l.percentile(99)).c_str(), us(l.percentile(99.9)).c_str(),
+		       us(l.percentile(100)).c_str());
+	}
+
+	// JSON report
+	if (!cfg.json.empty()){
+		ostringstream js;
+		js << "{\"connections\":" << cfg.conns << ",\"elapsed_s\":" << elapsed
+		   << ",\"ops\":" << ops << ",\"errors\":" << errors
+		   << ",\"ops_per_s\":" << ops / elapsed << ",\"lost_connections\":" << failed
+		   << ",\"per_op\":{";
+		bool first = true;
+		for (int op = 0; op < NUM_OPS; op++){
+			LatencyRecorder &l = total.lat[op];
+			if (!l.count())
+				continue;
+			js << (first ? "" : ",") << "\"" << OP_NAMES[op] << "\":{"
+			   << "\"count\":" << l.count() << ",\"errors\":" << total.errors[op]
+			   << ",\"ops_per_s\":" << l.count() / elapsed
+			   << ",\"mean_us\":" << us(l.mean()) << ",\"p50_us\":" << us(l.percentile(50))
+			   << ",\"p95_us\":" << us(l.percentile(95)) << ",\"p99_us\":" << us(l.percentile(99))
+			   << ",\"p999_us\":" << us(l.percentile(99.9)) << ",\"max_us\":" << us(l.percentile(100))
+			   << ",\"status\":{";
+			bool first_status = true;
+			for (auto &s : total.status[op]){
+				js << (first_status ? "" : ",") << "\"" << s.first << "\":" << s.second;
+				first_status = false;
+			}
+			js << "}}";
+			first = false;
+		}
+		js << "}}\n";
+		if (cfg.json == "-")
+			cout << js.str();
+		else {
+			ofstream out(cfg.json.c_str());
+			out << js.str();
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,566 @@
+// CPSC 3500: nfsfsck
+// Offline consistency checker for a disk image. Walks the tree from the
+// root directory, and the tree of each snapshot, with a pool of threads
+// over a read-only mapping of the image, counting every reference to every
+// block, then compares the reachable blocks with the bitmap in block 0.
+// Reports directory entries with bad names, bad block numbers or bad magic
+// numbers, inodes with bad sizes or block pointers, blocks referenced more
+// than once other than data blocks shared by copies of a file, reference
+// counts that disagree with the sharing found, leaked blocks (allocated but
+// unreachable) and missing ones (reachable but free), blocks marked for
+// deduplication that hold no file data, and blocks whose contents do not
+// match their checksums. With -r the problems are repaired; a block that
+// fails its checksum can't be restored, so it gets a checksum for what it
+// holds.
+//
+// Exit status as for fsck(8): 0 clean, 1 errors corrected, 4 errors left
+// uncorrected, 8 operational error.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+#include "Blocks.h"
+#include "BasicFileSys.h"
+#include "Latency.h"
+#include "Crc32c.h"
+
+// A reference to a block: a directory entry, or a data block pointer of an
+// inode
+struct Ref {
+	short block;		// block referred to
+	short from;		// directory or inode holding the reference
+	int slot;		// entry or pointer index in from
+	bool entry;		// directory entry rather than data pointer
+	string path;
+};
+
+// A problem found, and whether repair fixes it
+struct Problem {
+	string path;
+	string what;
+};
+
+// What one thread found
+struct Results {
+	vector<Ref> refs;
+	vector<Ref> bad_entries;	// entries to remove
+	map<short, int> dir_counts;	// directories whose entry count is wrong
+	map<short, int> truncate;	// inode -> data blocks to keep
+	map<short, unsigned int> sizes;	// inode -> corrected size
+	vector<Problem> problems;
+	long dirs = 0, files = 0;
+};
+
+static const unsigned char *image;	// read-only mapping of the disk
+static atomic<int> refs[NUM_BLOCKS];	// references to each block
+static atomic<bool> claimed[NUM_BLOCKS];	// directory or inode already walked
+static refcount_block_t counts[REFCOUNT_BLOCKS];	// reference count table
+static dirblock_t snapshots;	// the snapshot directory
+static unsigned int sums[CHECKSUM_BLOCKS * CHECKSUMS_PER_BLOCK];	// checksum table
+static dedupblock_t indexed;	// blocks marked for deduplication
+
+// work queue of directories to walk
+struct Dir {
+	short block;
+	string path;
+};
+static mutex queue_lock;
+static condition_variable queue_cv;
+static deque<Dir> queue;
+static int active = 0;	// threads walking a directory
+
+static const void *block(short b) {
+	if (b == SNAPSHOT_BLOCK)
+		return &snapshots;
+	if (b == DEDUP_BLOCK)
+		return &indexed;
+	if (b >= REFCOUNT_START)
+		return &counts[b - REFCOUNT_START];
+	return image + (size_t) b * BLOCK_SIZE;
+}
+
+static unsigned int magic_of(short b) {
+	return *(const unsigned int *) block(b);
+}
+
+static string hex(unsigned int x) {
+	char out[16];
+	snprintf(out, sizeof out, "0x%08x", x);
+	return out;
+}
+
+// Checks an inode and counts references to its data blocks.
+static void check_inode(short b, const string &path, Results &out) {
+	const inode_t *inode = (const inode_t *) block(b);
+	out.files++;
+	unsigned int size = inode->size;
+	if (size > MAX_FILE_SIZE){
+		out.problems.push_back({path, "size " + to_string(size) + " exceeds the maximum file size"});
+		size = MAX_FILE_SIZE;
+		out.sizes[b] = size;
+	}
+	// a small file is stored in the inode and has no data blocks
+	if (size <= MAX_INLINE_SIZE)
+		return;
+	int needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (int j = 0; j < MAX_DATA_BLOCKS; j++){
+		short p = inode->blocks[j];
+		// a zero pointer is a hole, which reads as zeros
+		if (j < needed && (p < 0 || p == 1 || p >= NUM_BLOCKS)){
+			out.problems.push_back({path, "data block " + to_string(j) + " is " + to_string(p) +
+			                        ", file truncated to " + to_string(j * BLOCK_SIZE) + " bytes"});
+			out.truncate[b] = j;
+			out.sizes[b] = j * BLOCK_SIZE;
+			return;
+		}
+		if (j >= needed && p){
+			out.problems.push_back({path, "data block " + to_string(j) + " set past the end of the file"});
+			out.truncate[b] = needed;
+			return;
+		}
+		if (p){
+			refs[p].fetch_add(1);
+			out.refs.push_back({p, b, j, false, path});
+		}
+	}
+}
+
+// Checks one directory, queueing its subdirectories.
+static void walk_dir(const Dir &d, Results &out) {
+	const dirblock_t *dir = (const dirblock_t *) block(d.block);
+	out.dirs++;
+	int n = MAX_DIR_ENTRIES;
+	if (dir->num_entries <= (unsigned int) MAX_DIR_ENTRIES)
+		n = dir->num_entries;
+	else {
+		out.problems.push_back({d.path, to_string(dir->num_entries) + " entries in a directory of " +
+		                        to_string(MAX_DIR_ENTRIES)});
+		out.dir_counts[d.block] = n;
+	}
+	for (int i = 0; i < n; i++){
+		const auto &e = dir->dir_entries[i];
+		short b = e.block_num;
+		string name(e.name, strnlen(e.name, MAX_FNAME_SIZE + 1));
+		string path = (d.path == "/" ? "/" : d.path + "/") + name;
+		string bad;
+		if (name.empty() || name.length() > MAX_FNAME_SIZE)
+			bad = "bad name";
+		else if (b < 2 || b >= NUM_BLOCKS)
+			bad = "block " + to_string(b) + " is outside the disk";
+		else if (magic_of(b) != DIR_MAGIC_NUM && magic_of(b) != INODE_MAGIC_NUM)
+			bad = "bad magic number " + hex(magic_of(b)) + " in block " + to_string(b);
+		if (!bad.empty()){
+			out.problems.push_back({path, bad + ", entry removed"});
+			out.bad_entries.push_back({b, d.block, i, true, path});
+			continue;
+		}
+
+		refs[b].fetch_add(1);
+		out.refs.push_back({b, d.block, i, true, path});
+		if (claimed[b].exchange(true))
+			continue;
+		if (magic_of(b) == DIR_MAGIC_NUM){
+			lock_guard<mutex> guard(queue_lock);
+			queue.push_back({b, path});
+			queue_cv.notify_one();
+		}
+		else
+			check_inode(b, path, out);
+	}
+}
+
+// Walks directories until the queue is empty and no thread can add more.
+static void worker(Results *out) {
+	unique_lock<mutex> guard(queue_lock);
+	while (1){
+		queue_cv.wait(guard, [] { return !queue.empty() || !active; });
+		if (queue.empty())
+			return;
+		Dir d = queue.front();
+		queue.pop_front();
+		active++;
+		guard.unlock();
+		walk_dir(d, *out);
+		guard.lock();
+		active--;
+		if (!active && queue.empty())
+			queue_cv.notify_all();
+	}
+}
+
+// Lists up to 10 block numbers.
+static string block_list(const vector<short> &blocks) {
+	string out;
+	for (size_t i = 0; i < blocks.size() && i < 10; i++)
+		out += (i ? " " : "") + to_string(blocks[i]);
+	if (blocks.size() > 10)
+		out += " ...";
+	return out;
+}
+
+static void usage() {
+	cerr << "Usage: ./nfsfsck [-r] [-j threads] [disk-image]" << endl;
+	cerr << "  -r          repair the problems found" << endl;
+	cerr << "  -j threads  threads walking the tree (default: one per core)" << endl;
+}
+
+int main(int argc, char **argv) {
+	bool repair = false;
+	int threads = thread::hardware_concurrency();
+	int opt;
+	while ((opt = getopt(argc, argv, "rj:")) != -1){
+		if (opt == 'r')
+			repair = true;
+		else if (opt == 'j' && (threads = atoi(optarg)) > 0)
+			continue;
+		else {
+			usage();
+			return 8;
+		}
+	}
+	if (optind < argc - 1){
+		usage();
+		return 8;
+	}
+	if (threads < 1)
+		threads = 1;
+	const char *file = optind < argc ? argv[optind] : "DISK";
+
+	int fd = open(file, repair ? O_RDWR : O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1){
+		perror(file);
+		return 8;
+	}
+	if (st.st_size < (off_t) NUM_BLOCKS * BLOCK_SIZE){
+		cerr << file << ": too small to be a disk image" << endl;
+		return 8;
+	}
+
+	// Refuse layouts whose inodes would be misread, as mount does.
+	if (st.st_size >= (off_t) DISK_BLOCKS * BLOCK_SIZE){
+		formatblock_t format;
+		pread(fd, &format, BLOCK_SIZE, (off_t) FORMAT_BLOCK * BLOCK_SIZE);
+		if (format.magic != FORMAT_MAGIC_NUM || format.version != FORMAT_VERSION){
+			cerr << file << ": unknown disk format" << endl;
+			return 8;
+		}
+	}
+	else if (st.st_size < (off_t) (REFCOUNT_START + REFCOUNT_BLOCKS) * BLOCK_SIZE){
+		cerr << file << ": disk predates reference counts and has an older inode layout" << endl;
+		return 8;
+	}
+
+	// Replay the journal first when repairing; otherwise just say whether
+	// the image is missing committed transactions.
+	if (repair){
+		BasicFileSys disk;
+		disk.mount(file);
+		disk.unmount();
+		fstat(fd, &st);
+	}
+	else if (st.st_size >= (off_t) (JOURNAL_START + JOURNAL_BLOCKS) * BLOCK_SIZE){
+		journal_header_t header;
+		journal_desc_t desc;
+		pread(fd, &header, BLOCK_SIZE, (off_t) JOURNAL_START * BLOCK_SIZE);
+		if (header.magic == JOURNAL_MAGIC_NUM && header.start < (unsigned int) JOURNAL_LOG_BLOCKS){
+			pread(fd, &desc, BLOCK_SIZE, (off_t) (JOURNAL_START + 1 + header.start) * BLOCK_SIZE);
+			if (desc.magic == JOURNAL_DESC_MAGIC_NUM && desc.seq == header.start_seq)
+				cout << file << ": journal holds transactions not yet replayed; run with -r "
+				        "or mount the disk to apply them" << endl;
+		}
+	}
+
+	void *mapping = mmap(NULL, (size_t) NUM_BLOCKS * BLOCK_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED){
+		perror("mmap");
+		return 8;
+	}
+	image = (const unsigned char *) mapping;
+	memset(counts, 0, sizeof counts);
+	if (st.st_size >= (off_t) (REFCOUNT_START + REFCOUNT_BLOCKS) * BLOCK_SIZE &&
+	    pread(fd, counts, sizeof counts, (off_t) REFCOUNT_START * BLOCK_SIZE) != (ssize_t) sizeof counts){
+		perror("read");
+		return 8;
+	}
+	memset(&snapshots, 0, sizeof snapshots);
+	snapshots.magic = DIR_MAGIC_NUM;
+	if (st.st_size >= (off_t) (SNAPSHOT_BLOCK + 1) * BLOCK_SIZE &&
+	    pread(fd, &snapshots, BLOCK_SIZE, (off_t) SNAPSHOT_BLOCK * BLOCK_SIZE) != BLOCK_SIZE){
+		perror("read");
+		return 8;
+	}
+	bool have_sums = st.st_size >= (off_t) (CHECKSUM_START + CHECKSUM_BLOCKS) * BLOCK_SIZE;
+	if (have_sums &&
+	    pread(fd, sums, sizeof sums, (off_t) CHECKSUM_START * BLOCK_SIZE) != (ssize_t) sizeof sums){
+		perror("read");
+		return 8;
+	}
+	memset(&indexed, 0, sizeof indexed);
+	bool have_index = st.st_size >= (off_t) (DEDUP_BLOCK + 1) * BLOCK_SIZE;
+	if (have_index &&
+	    pread(fd, &indexed, BLOCK_SIZE, (off_t) DEDUP_BLOCK * BLOCK_SIZE) != BLOCK_SIZE){
+		perror("read");
+		return 8;
+	}
+
+	// pass 0: blocks that changed since their checksums were written
+	vector<Problem> problems;
+	vector<short> bad_sums;
+	for (int i = 0; have_sums && i < CHECKED_BLOCKS; i++){
+		short b = checked_block(i);
+		if ((b != DEDUP_BLOCK || have_index) && crc32c(0, block(b), BLOCK_SIZE) != sums[i])
+			bad_sums.push_back(b);
+	}
+	if (!bad_sums.empty())
+		problems.push_back({"checksums", to_string(bad_sums.size()) + " block(s) whose contents do not match "
+		                    "their checksums: " + block_list(bad_sums)});
+
+	// pass 1: walk the tree in parallel, counting references
+	long long start = now_ns();
+	for (int b = 0; b < NUM_BLOCKS; b++){
+		refs[b] = 0;
+		claimed[b] = false;
+	}
+	refs[0] = refs[1] = 1;
+	claimed[1] = true;
+	if (magic_of(1) != DIR_MAGIC_NUM){
+		cout << file << ": root directory has bad magic number " << hex(magic_of(1))
+		     << ", cannot check further" << endl;
+		return 4;
+	}
+	queue.push_back({1, "/"});
+
+	// each snapshot's root is an entry of the snapshot directory, checked
+	// like those of any directory
+	Results snapshot_refs;
+	walk_dir({SNAPSHOT_BLOCK, string("/") + SNAPSHOT_DIR_NAME}, snapshot_refs);
+	vector<Results> results(threads);
+	vector<thread> pool;
+	for (int t = 0; t < threads; t++)
+		pool.push_back(thread(worker, &results[t]));
+	for (int t = 0; t < threads; t++)
+		pool[t].join();
+	double walk_ms = (now_ns() - start) / 1e6;
+
+	Results all;
+	results.push_back(snapshot_refs);
+	for (size_t t = 0; t < results.size(); t++){
+		Results &r = results[t];
+		all.refs.insert(all.refs.end(), r.refs.begin(), r.refs.end());
+		all.bad_entries.insert(all.bad_entries.end(), r.bad_entries.begin(), r.bad_entries.end());
+		all.dir_counts.insert(r.dir_counts.begin(), r.dir_counts.end());
+		all.truncate.insert(r.truncate.begin(), r.truncate.end());
+		all.sizes.insert(r.sizes.begin(), r.sizes.end());
+		problems.insert(problems.end(), r.problems.begin(), r.problems.end());
+		all.dirs += r.dirs;
+		all.files += r.files;
+	}
+
+	// pass 2: blocks referenced more than once. Data blocks may be shared
+	// by any number of inodes. Otherwise the reference with the smallest
+	// path keeps the block; other directory entries are removed, other
+	// data pointers get a copy of the block.
+	map<short, vector<Ref> > by_block;
+	for (size_t i = 0; i < all.refs.size(); i++){
+		if (refs[all.refs[i].block] > 1)
+			by_block[all.refs[i].block].push_back(all.refs[i]);
+	}
+	vector<Ref> clones;
+	for (auto &b : by_block){
+		vector<Ref> &r = b.second;
+		sort(r.begin(), r.end(), [](const Ref &x, const Ref &y) {
+			return x.entry != y.entry ? x.entry : x.path < y.path;
+		});
+		if (!r[0].entry)
+			continue;
+		for (size_t i = 1; i < r.size(); i++){
+			problems.push_back({r[i].path, "block " + to_string(b.first) + " is also used by " + r[0].path +
+			                    (r[i].entry ? ", entry removed" : ", block copied")});
+			if (r[i].entry)
+				all.bad_entries.push_back(r[i]);
+			else
+				clones.push_back(r[i]);
+		}
+	}
+
+	// pass 3: compare the reachable blocks with the bitmap, and the sharing
+	// found with the reference counts
+	vector<short> miscounted;
+	for (int b = 0; b < NUM_BLOCKS; b++){
+		int expected = refs[b] > 1 && !by_block[b][0].entry ? refs[b] - 1 : 0;
+		if (counts[b / REFS_PER_BLOCK].extra[b % REFS_PER_BLOCK] != expected)
+			miscounted.push_back(b);
+	}
+	if (!miscounted.empty())
+		problems.push_back({"refcounts", to_string(miscounted.size()) + " block(s) with a wrong reference count: " +
+		                    block_list(miscounted)});
+	// only data blocks, which no directory entry names, may be marked for
+	// deduplication
+	vector<bool> named(NUM_BLOCKS);
+	for (size_t i = 0; i < all.refs.size(); i++)
+		named[all.refs[i].block] = named[all.refs[i].block] || all.refs[i].entry;
+	vector<short> unindexed;
+	for (int b = 0; b < NUM_BLOCKS; b++){
+		if ((indexed.bitmap[b / 8] & (1 << (b % 8))) && (!refs[b] || named[b]))
+			unindexed.push_back(b);
+	}
+	if (!unindexed.empty())
+		problems.push_back({"dedup", to_string(unindexed.size()) + " block(s) marked for deduplication that "
+		                    "hold no file data: " + block_list(unindexed)});
+	const superblock_t *super = (const superblock_t *) block(0);
+	vector<short> leaked, missing;
+	for (int b = 0; b < NUM_BLOCKS; b++){
+		bool used = super->bitmap[b / 8] & (1 << (b % 8));
+		if (used && !refs[b])
+			leaked.push_back(b);
+		else if (!used && refs[b])
+			missing.push_back(b);
+	}
+	if (!leaked.empty())
+		problems.push_back({"", to_string(leaked.size()) + " block(s) allocated but unreachable: " +
+		                    block_list(leaked)});
+	if (!missing.empty())
+		problems.push_back({"", to_string(missing.size()) + " block(s) in use but marked free: " +
+		                    block_list(missing)});
+
+	sort(problems.begin(), problems.end(), [](const Problem &a, const Problem &b) {
+		return a.path < b.path;
+	});
+	for (size_t i = 0; i < problems.size(); i++)
+		cout << (problems[i].path.empty() ? "bitmap" : problems[i].path) << ": " << problems[i].what << endl;
+	printf("%s: %ld directories, %ld files, %d blocks in use, %zu problem(s); walked in %.2f ms with %d thread(s)\n",
+	       file, all.dirs, all.files, (int) count_if(refs, refs + NUM_BLOCKS, [](const atomic<int> &r) { return r > 0; }),
+	       problems.size(), walk_ms, threads);
+
+	if (problems.empty()){
+		munmap(mapping, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+		close(fd);
+		return 0;
+	}
+	if (!repair){
+		munmap(mapping, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+		close(fd);
+		return 4;
+	}
+
+	// repair on copies of the blocks, then write them back
+	map<short, datablock_t> repaired;
+	auto edit = [&](short b) -> void * {
+		if (!repaired.count(b))
+			memcpy(&repaired[b], block(b), BLOCK_SIZE);
+		return &repaired[b];
+	};
+
+	// directory entries, removed in one rebuild per directory
+	map<short, set<int> > removals;
+	for (size_t i = 0; i < all.bad_entries.size(); i++)
+		removals[all.bad_entries[i].from].insert(all.bad_entries[i].slot);
+	for (auto &c : all.dir_counts)
+		removals[c.first];
+	for (auto &r : removals){
+		dirblock_t *dir = (dirblock_t *) edit(r.first);
+		int n = min(dir->num_entries, (unsigned int) MAX_DIR_ENTRIES), kept = 0;
+		for (int i = 0; i < n; i++){
+			if (!r.second.count(i))
+				dir->dir_entries[kept++] = dir->dir_entries[i];
+		}
+		for (int i = kept; i < MAX_DIR_ENTRIES; i++){
+			dir->dir_entries[i].name[0] = '\0';
+			dir->dir_entries[i].block_num = 0;
+		}
+		dir->num_entries = kept;
+	}
+
+	// inodes: sizes and pointers past the end
+	for (auto &s : all.sizes)
+		((inode_t *) edit(s.first))->size = s.second;
+	for (auto &t : all.truncate){
+		inode_t *inode = (inode_t *) edit(t.first);
+		for (int j = t.second; j < MAX_DATA_BLOCKS; j++)
+			inode->blocks[j] = 0;
+	}
+
+	// shared data blocks get copies in free blocks
+	bool unfixed = false;
+	int next_free = 2;
+	for (size_t i = 0; i < clones.size(); i++){
+		while (next_free < NUM_BLOCKS && refs[next_free])
+			next_free++;
+		if (next_free == NUM_BLOCKS){
+			cout << clones[i].path << ": no free block to copy block " << clones[i].block << " to" << endl;
+			unfixed = true;
+			continue;
+		}
+		refs[next_free] = 1;
+		memcpy(edit(next_free), block(clones[i].block), BLOCK_SIZE);
+		((inode_t *) edit(clones[i].from))->blocks[clones[i].slot] = next_free;
+	}
+
+	// the bitmap is rebuilt from the blocks in use, and the reference
+	// counts from the blocks still shared
+	superblock_t *new_super = (superblock_t *) edit(0);
+	memset(new_super->bitmap, 0, BLOCK_SIZE);
+	for (int b = 0; b < NUM_BLOCKS; b++){
+		if (refs[b])
+			new_super->bitmap[b / 8] |= 1 << (b % 8);
+	}
+	for (int b = 0; b < NUM_BLOCKS; b++){
+		unsigned short &extra = counts[b / REFS_PER_BLOCK].extra[b % REFS_PER_BLOCK];
+		unsigned short expected = refs[b] > 1 && !by_block[b][0].entry ? refs[b] - 1 : 0;
+		if (extra != expected){
+			extra = expected;
+			repaired[REFCOUNT_START + b / REFS_PER_BLOCK] = *(datablock_t *) &counts[b / REFS_PER_BLOCK];
+		}
+	}
+	for (size_t i = 0; i < unindexed.size(); i++){
+		indexed.bitmap[unindexed[i] / 8] &= ~(1 << (unindexed[i] % 8));
+		repaired[DEDUP_BLOCK] = *(datablock_t *) &indexed;
+	}
+
+	// every block rewritten, and every block that failed its checksum,
+	// gets a checksum for what it now holds
+	set<short> tables;
+	for (auto &f : repaired){
+		int i = checksum_index(f.first);
+		sums[i] = crc32c(0, &f.second, BLOCK_SIZE);
+		tables.insert(i / CHECKSUMS_PER_BLOCK);
+	}
+	for (size_t k = 0; k < bad_sums.size(); k++){
+		int i = checksum_index(bad_sums[k]);
+		if (!repaired.count(bad_sums[k]))
+			sums[i] = crc32c(0, block(bad_sums[k]), BLOCK_SIZE);
+		tables.insert(i / CHECKSUMS_PER_BLOCK);
+	}
+	for (int t : tables)
+		memcpy(&repaired[CHECKSUM_START + t], &sums[t * CHECKSUMS_PER_BLOCK], BLOCK_SIZE);
+
+	for (auto &f : repaired){
+		if (pwrite(fd, &f.second, BLOCK_SIZE, (off_t) f.first * BLOCK_SIZE) != BLOCK_SIZE){
+			perror("write");
+			return 8;
+		}
+	}
+	fdatasync(fd);
+	cout << file << ": " << repaired.size() << " block(s) rewritten" << endl;
+	munmap(mapping, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+	close(fd);
+	return unfixed ? 4 : 1;
+}
@@ -0,0 +1,251 @@
+// CPSC 3500: nfsmicro
+// In-process microbenchmarks for the storage path: Disk block I/O, the
+// BasicFileSys block allocator at several fill levels, and the FileSys
+// commands run as journal transactions against a temporary disk image with
+// responses written to /dev/null. Reports ns/op, disk system calls/op and
+// heap bytes/op, so regressions show up without the network in the way.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+using namespace std;
+
+#include "Blocks.h"
+#include "Disk.h"
+#include "BasicFileSys.h"
+#include "FileSys.h"
+#include "Latency.h"
+
+// Heap allocations made by this thread, counted by the operator new below.
+static thread_local long long alloc_bytes;
+static thread_local long alloc_count;
+
+void *operator new(size_t size) {
+	alloc_bytes += size;
+	alloc_count++;
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+// A snapshot of everything measured around one operation
+struct Probe {
+	long long ns;
+	long syscalls, reads, writes;
+	long long bytes;
+	long allocs;
+};
+
+static Probe probe() {
+	Probe p;
+	p.syscalls = Disk::stats.syscalls;
+	p.reads = Disk::stats.reads;
+	p.writes = Disk::stats.writes;
+	p.bytes = alloc_bytes;
+	p.allocs = alloc_count;
+	p.ns = now_ns();
+	return p;
+}
+
+// Totals for one benchmark
+struct Result {
+	long iters;
+	long long ns;
+	long syscalls, reads, writes;
+	long long bytes;
+	long allocs;
+};
+
+static string filter;	// only run benchmarks whose name contains this
+
+// Runs op(i) for i in [0, iters), timing only op. pre(i), if given, runs
+// untimed before each op to set up its state.
+static void bench(const string &name, long iters, function<void(long)> op,
+                  function<void(long)> pre = nullptr) {
+	if (name.find(filter) == string::npos)
+		return;
+	Result r = {};
+	for (long i = 0; i < iters; i++){
+		if (pre)
+			pre(i);
+		Probe a = probe();
+		op(i);
+		Probe b = probe();
+		r.ns += b.ns - a.ns;
+		r.syscalls += b.syscalls - a.syscalls;
+		r.reads += b.reads - a.reads;
+		r.writes += b.writes - a.writes;
+		r.bytes += b.bytes - a.bytes;
+		r.allocs += b.allocs - a.allocs;
+	}
+	r.iters = iters;
+	printf("%-28s %8ld %10.1f %9.2f %7.2f %7.2f %9.1f %8.2f\n", name.c_str(), iters,
+	       (double) r.ns / iters, (double) r.syscalls / iters,
+	       (double) r.reads / iters, (double) r.writes / iters,
+	       (double) r.bytes / iters, (double) r.allocs / iters);
+}
+
+// Disk::read_block and write_block on a formatted image
+static void disk_benchmarks(const string &image, long iters) {
+	Disk disk;
+	disk.mount(image.c_str());
+	datablock_t block;
+	memset(&block, 'x', sizeof block);
+	bench("disk/write_block", iters, [&](long i) {
+		disk.write_block(2 + i % (NUM_BLOCKS - 2), &block);
+	});
+	bench("disk/read_block", iters, [&](long i) {
+		disk.read_block(2 + i % (NUM_BLOCKS - 2), &block);
+	});
+	bench("disk/read_block_same", iters, [&](long i) {
+		disk.read_block(1, &block);
+	});
+	disk.unmount();
+}
+
+// get_free_block and reclaim_block with the given percentage of the disk
+// already allocated. The allocator scans from the start of the bitmap, so
+// cost grows with fill level.
+static void allocator_benchmarks(BasicFileSys &bfs, long iters) {
+	int fills[] = { 0, 50, 90, 99 };
+	for (int f = 0; f < 4; f++){
+		vector<short> held;
+		while ((int) held.size() + 2 < NUM_BLOCKS * fills[f] / 100)
+			held.push_back(bfs.get_free_block());
+
+		short block = 0;
+		string fill = to_string(fills[f]) + "%";
+		bench("bfs/get_free_block@" + fill, iters,
+		      [&](long) { block = bfs.get_free_block(); },
+		      [&](long) { if (block) bfs.reclaim_block(block); block = 0; });
+		if (block)
+			bfs.reclaim_block(block);
+		bench("bfs/reclaim_block@" + fill, iters,
+		      [&](long) { bfs.reclaim_block(block); },
+		      [&](long) { block = bfs.get_free_block(); });
+
+		for (size_t i = 0; i < held.size(); i++)
+			bfs.reclaim_block(held[i]);
+	}
+}
+
+// The FileSys commands, one benchmark each, in a scratch directory. Each
+// command runs the way the server runs it: as a journal transaction whose
+// response is sent once it is durable, so the fdatasync is included.
+static void filesys_benchmarks(BasicFileSys &bfs, long iters) {
+	int sink = open("/dev/null", O_WRONLY);
+	FileSys fs;
+	fs.mount(sink, &bfs);
+	auto run = [&](function<void()> cmd) {
+		bfs.lock();
+		bfs.begin();
+		cmd();
+		unsigned int seq = bfs.commit();
+		bfs.unlock();
+		bfs.wait_durable(seq);
+		fs.send_response();
+	};
+	run([&] { fs.mkdir("micro"); });
+	run([&] { fs.cd("micro"); });
+
+	string small(16, 's');
+	string large(4 * BLOCK_SIZE, 'l');
+	bench("fs/create+rm", iters, [&](long) { run([&] { fs.create("f"); }); run([&] { fs.rm("f"); }); });
+	bench("fs/create", iters, [&](long) { run([&] { fs.create("f"); }); },
+	      [&](long i) { if (i) run([&] { fs.rm("f"); }); });
+	run([&] { fs.rm("f"); });
+	bench("fs/rm_empty", iters, [&](long) { run([&] { fs.rm("f"); }); },
+	      [&](long) { run([&] { fs.create("f"); }); });
+	bench("fs/mkdir+rmdir", iters, [&](long) { run([&] { fs.mkdir("d"); }); run([&] { fs.rmdir("d"); }); });
+
+	run([&] { fs.create("f"); });
+	bench("fs/append_16B", iters, [&](long) { run([&] { fs.append("f", small.c_str()); }); },
+	      [&](long i) {
+		if (i % (MAX_FILE_SIZE / 16) == 0){
+			run([&] { fs.rm("f"); });
+			run([&] { fs.create("f"); });
+		}
+	});
+	run([&] { fs.rm("f"); });
+	run([&] { fs.create("f"); });
+	bench("fs/append_512B", iters, [&](long) { run([&] { fs.append("f", large.c_str()); }); },
+	      [&](long i) {
+		if (i % (MAX_FILE_SIZE / large.length()) == 0){
+			run([&] { fs.rm("f"); });
+			run([&] { fs.create("f"); });
+		}
+	});
+	run([&] { fs.rm("f"); });
+	bench("fs/rm_2KB", iters, [&](long) { run([&] { fs.rm("f"); }); },
+	      [&](long) {
+		run([&] { fs.create("f"); });
+		for (int i = 0; i < 4; i++)
+			run([&] { fs.append("f", large.c_str()); });
+	});
+
+	// read-side commands against a populated directory
+	run([&] { fs.create("f"); });
+	for (int i = 0; i < 4; i++)
+		run([&] { fs.append("f", large.c_str()); });
+	for (int i = 1; i < MAX_DIR_ENTRIES - 1; i++)
+		run([&] { fs.create(("g" + to_string(i)).c_str()); });
+	run([&] { fs.mkdir("sub"); });
+	bench("fs/cat_2KB", iters, [&](long) { run([&] { fs.cat("f"); }); });
+	bench("fs/head_100B", iters, [&](long) { run([&] { fs.head("f", 100); }); });
+	bench("fs/stat_file", iters, [&](long) { run([&] { fs.stat("f"); }); });
+	bench("fs/stat_dir", iters, [&](long) { run([&] { fs.stat("sub"); }); });
+	bench("fs/ls_10", iters, [&](long) { run([&] { fs.ls(); }); });
+	bench("fs/cd+home", iters, [&](long) { run([&] { fs.cd("sub"); }); run([&] { fs.home(); }); },
+	      [&](long) { run([&] { fs.home(); }); run([&] { fs.cd("micro"); }); });
+
+	fs.unmount();
+}
+
+int main(int argc, char **argv) {
+	long iters = 2000;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:f:")) != -1){
+		if (opt == 'i')
+			iters = atol(optarg);
+		else if (opt == 'f')
+			filter = optarg;
+		else {
+			cerr << "Usage: ./nfsmicro [-i iterations] [-f name-filter]" << endl;
+			return 1;
+		}
+	}
+
+	// a fresh image in a private temporary directory
+	char dir[] = "/tmp/nfsmicro.XXXXXX";
+	if (!mkdtemp(dir)){
+		perror("mkdtemp");
+		return 1;
+	}
+	string image = string(dir) + "/DISK";
+
+	BasicFileSys bfs;
+	bfs.mount(image.c_str());
+
+	printf("%-28s %8s %10s %9s %7s %7s %9s %8s\n", "benchmark", "iters", "ns/op",
+	       "syscalls", "reads", "writes", "bytes", "allocs");
+	disk_benchmarks(image, iters);
+	allocator_benchmarks(bfs, iters);
+	filesys_benchmarks(bfs, iters);
+
+	bfs.unmount();
+	unlink(image.c_str());
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,193 @@
+// CPSC 3500: nfsreplay
+// Re-drives a request trace recorded by "nfsserver -t" against a server.
+// Each traced connection is replayed on its own connection, in order, at
+// the original timing, N times faster, or as fast as possible. Reports the
+// replayed latency distribution per command next to the service times
+// that were recorded, and counts responses whose status differs.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include <unistd.h>
+using namespace std;
+
+#include "Connection.h"
+#include "Latency.h"
+#include "Trace.h"
+
+// Replay results for one command
+struct CommandResult {
+	LatencyRecorder recorded;	// server service time from the trace
+	LatencyRecorder replayed;	// client-side latency during replay
+	long mismatches = 0;		// responses with a different status
+};
+
+static mutex results_lock;
+static map<string, CommandResult> results;	// by command name
+static LatencyRecorder lag;			// how late requests were issued
+static long lost = 0;				// connections that failed
+
+// Sleeps until t on the now_ns() clock.
+static void sleep_until(long long t) {
+	timespec ts;
+	ts.tv_sec = t / 1000000000LL;
+	ts.tv_nsec = t % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Replays one traced connection. Request i is due at
+// start + (arrival - origin) / speed; speed 0 means as fast as possible.
+static void replay_conn(const string &server, const vector<TraceRecord> *recs,
+                        long long origin, long long start, double speed) {
+	map<string, CommandResult> mine;
+	LatencyRecorder my_lag;
+	Connection conn;
+	bool open = false, failed = false;
+	string status, body;
+
+	for (size_t i = 0; i < recs->size(); i++){
+		const TraceRecord &rec = (*recs)[i];
+		// requests the server never answered can't be replayed
+		if (!rec.status)
+			continue;
+		long long due = start;
+		if (speed > 0){
+			due += (long long) ((rec.arrival - origin) / speed);
+			sleep_until(due);
+		}
+		if (!open && !(open = conn.open(server))){
+			failed = true;
+			break;
+		}
+
+		long long sent = now_ns();
+		if (speed > 0)
+			my_lag.add(sent - due);
+		if (!conn.request(rec.request, status, body)){
+			failed = true;
+			break;
+		}
+		string name = rec.request.substr(0, rec.request.find(' '));
+		CommandResult &r = mine[name];
+		r.replayed.add(now_ns() - sent);
+		r.recorded.add(rec.service);
+		if (atoi(status.c_str()) != rec.status)
+			r.mismatches++;
+	}
+	if (open)
+		conn.close();
+
+	lock_guard<mutex> guard(results_lock);
+	if (failed)
+		lost++;
+	for (auto &m : mine){
+		CommandResult &r = results[m.first];
+		r.recorded.merge(m.second.recorded);
+		r.replayed.merge(m.second.replayed);
+		r.mismatches += m.second.mismatches;
+	}
+	lag.merge(my_lag);
+}
+
+// Formats nanoseconds as microseconds with one decimal.
+static string us(double ns) {
+	char out[32];
+	snprintf(out, sizeof out, "%.1f", ns / 1000.0);
+	return out;
+}
+
+static void usage() {
+	cerr << "Usage: ./nfsreplay [-s speed | -a] trace-file server:port   (or unix:path, shm:path)" << endl;
+	cerr << "  -s speed   replay N times faster than recorded (default 1)" << endl;
+	cerr << "  -a         replay as fast as possible" << endl;
+}
+
+int main(int argc, char **argv) {
+	double speed = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:a")) != -1){
+		if (opt == 's' && (speed = atof(optarg)) > 0)
+			continue;
+		if (opt == 'a'){
+			speed = 0;
+			continue;
+		}
+		usage();
+		return 1;
+	}
+	if (optind != argc - 2){
+		usage();
+		return 1;
+	}
+	const char *trace_file = argv[optind];
+	string server = argv[optind + 1];
+
+	// load the trace, grouped by connection
+	TraceReader reader;
+	if (!reader.open(trace_file)){
+		cerr << trace_file << ": not a trace file" << endl;
+		return 1;
+	}
+	map<unsigned, vector<TraceRecord> > conns;
+	TraceRecord rec;
+	long long origin = 0, last = 0;
+	long total = 0;
+	while (reader.next(rec)){
+		if (!total || rec.arrival < origin)
+			origin = rec.arrival;
+		last = max(last, rec.arrival);
+		conns[rec.conn].push_back(rec);
+		total++;
+	}
+	reader.close();
+	if (!total){
+		cerr << trace_file << ": empty trace" << endl;
+		return 1;
+	}
+	// records are written in completion order; a connection's requests
+	// are sequential, but sort by arrival to be safe
+	for (auto &c : conns)
+		stable_sort(c.second.begin(), c.second.end(),
+		            [](const TraceRecord &a, const TraceRecord &b) { return a.arrival < b.arrival; });
+
+	long long start = now_ns() + 10000000LL;	// let every thread get ready
+	vector<thread> threads;
+	for (auto &c : conns)
+		threads.push_back(thread(replay_conn, cref(server), &c.second, origin, start, speed));
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	double elapsed = (now_ns() - start) / 1e9;
+
+	printf("nfsreplay: %ld requests on %zu connections, recorded over %.2f s, replayed in %.2f s",
+	       total, conns.size(), (last - origin) / 1e9, elapsed);
+	if (speed > 0)
+		printf(" at %gx\n", speed);
+	else
+		printf(" as fast as possible\n");
+	if (lost)
+		printf("warning: %ld connection(s) failed\n", lost);
+	if (lag.count())
+		printf("schedule lag: p50 %s us, p99 %s us, max %s us\n", us(lag.percentile(50)).c_str(),
+		       us(lag.percentile(99)).c_str(), us(lag.percentile(100)).c_str());
+	printf("latency in us; recorded = server service time, replayed = client round trip\n");
+	printf("%-8s %8s | %9s %9s %9s | %9s %9s %9s | %9s %9s | %s\n", "command", "count",
+	       "rec p50", "rec p95", "rec p99", "rep p50", "rep p95", "rep p99",
+	       "diff p50", "diff p99", "status mismatches");
+	for (auto &r : results){
+		LatencyRecorder &a = r.second.recorded, &b = r.second.replayed;
+		printf("%-8s %8zu | %9s %9s %9s | %9s %9s %9s | %9s %9s | %ld\n", r.first.c_str(),
+		       b.count(), us(a.percentile(50)).c_str(), us(a.percentile(95)).c_str(),
+		       us(a.percentile(99)).c_str(), us(b.percentile(50)).c_str(),
+		       us(b.percentile(95)).c_str(), us(b.percentile(99)).c_str(),
+		       us(b.percentile(50) - a.percentile(50)).c_str(),
+		       us(b.percentile(99) - a.percentile(99)).c_str(), r.second.mismatches);
+	}
+	return lost ? 1 : 0;
+}
@@ -5,29 +5,382 @@
 #include <iostream>
 #include <cstring>
 #include <string>
+#include <vector>
 #include <cstdlib>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <signal.h>
+#include <cerrno>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
 #include "FileSys.h"
+#include "Disk.h"
+#include "Trace.h"
+#include "Latency.h"
+#include "Stats.h"
+#include "Metrics.h"
+#include "Lz.h"
+#include "Replica.h"
 using namespace std;
 
-void cleanExit(){exit(0);}
+TraceWriter *trace = NULL;	// records every request when tracing (-t)
+const char *primary = NULL;	// server this one is a replica of (-r)
 
-int main(int argc, char* argv[]) {
-	if (argc < 2) {
-		cout << "Usage: ./nfsserver port#\n";
-        return -1;
-    }
+// Maximum number of operations in one compound request
+const int MAX_COMPOUND_OPS = 64;
+
+// Maximum size of a compressed request, before and after decompression
+const size_t MAX_PACKED_SIZE = 1 << 20;
+
+// Maximum number of volumes (-v)
+const int MAX_VOLUMES = 16;
+
+// Receives until a full request line is buffered in buf, then moves it,
+// CRLF included, to line. Returns false if the client disconnected.
+bool receive_line(Channel &chan, string &buf, string &line) {
+	const int chunk_len = 4096;
+	char chunk[chunk_len];
+	size_t end;
+	int x;
+	while((end = buf.find("\r\n")) == string::npos){
+		x = chan.recv((void*) chunk, (size_t) chunk_len);
+		if (x == -1)
+			perror("recv");
+		// Client Disconnected
+		if (x <= 0)
+			return false;
+		buf.append(chunk, x);
+	}
+	line = buf.substr(0, end + 2);
+	buf.erase(0, end + 2);
+	return true;
+}
+
+// Receives until len bytes are buffered in buf, then moves them to out.
+// Returns false if the client disconnected.
+bool receive_bytes(Channel &chan, string &buf, size_t len, string &out) {
+	const int chunk_len = 4096;
+	char chunk[chunk_len];
+	int x;
+	while(buf.length() < len){
+		x = chan.recv((void*) chunk, (size_t) chunk_len);
+		if (x == -1)
+			perror("recv");
+		if (x <= 0)
+			return false;
+		buf.append(chunk, x);
+	}
+	out = buf.substr(0, len);
+	buf.erase(0, len);
+	return true;
+}
+
+// Splits a request line into the command and its two arguments; the
+// second argument is the rest of the line.
+void parse_request(const string &req, string &command, string &arg, string &arg2) {
+	int i=0;
+	command.clear();
+	arg.clear();
+	arg2.clear();
+	
+	// Get Command
+	while((req[i] != ' ') && (req[i] != '\r')){
+		command.append(1, req[i]);
+		i++;
+	}
+	// Get Argument 1
+	if (req[i] == ' ')
+		i++;
+	while((req[i] != ' ') && (req[i] != '\r')){
+		arg.append(1, req[i]);
+		i++;
+	}
+	// Get Argument 2
+	if (req[i] == ' ')
+		i++;
+	while(req[i] != '\r'){
+		arg2.append(1, req[i]);
+		i++;
+	}
+}
+
+// Runs one command. Returns false, sending nothing, if it is unknown.
+bool dispatch(FileSys &fs, const string &command, const string &arg, const string &arg2) {
+	if (command == "mkdir")
+		fs.mkdir(arg.c_str());
+	else if (command == "ls")
+		fs.ls(arg.c_str());
+	else if (command == "lsl")
+		fs.lsl(arg.c_str());
+	else if (command == "cd")
+		fs.cd(arg.c_str());
+	else if (command == "home")
+		fs.home();
+	else if (command == "rmdir")
+		fs.rmdir(arg.c_str());
+	else if (command == "create")
+		fs.create(arg.c_str());
+	else if (command == "append")
+		fs.append(arg.c_str(), arg2.c_str());
+	else if (command == "stat")
+		fs.stat(arg.c_str());
+	else if (command == "cat")
+		fs.cat(arg.c_str());
+	else if (command == "head") {
+		fs.head(arg.c_str(), strtoul(arg2.c_str(), NULL, 10));
+	}
+	else if (command == "rm")
+		fs.rm(arg.c_str());
+	else if (command == "truncate")
+		fs.truncate(arg.c_str(), strtoul(arg2.c_str(), NULL, 10));
+	else if (command == "stats")
+		fs.stats();
+	else if (command == "open")
+		fs.open(arg.c_str());
+	else if (command == "happend")
+		fs.happend(arg.c_str(), arg2.c_str());
+	else if (command == "hcat")
+		fs.hcat(arg.c_str());
+	else if (command == "hhead")
+		fs.hhead(arg.c_str(), strtoul(arg2.c_str(), NULL, 10));
+	else if (command == "hstat")
+		fs.hstat(arg.c_str());
+	else if (command == "mv")
+		fs.mv(arg.c_str(), arg2.c_str());
+	else if (command == "cp")
+		fs.cp(arg.c_str(), arg2.c_str());
+	else if (command == "rmr")
+		fs.rmr(arg.c_str());
+	else if (command == "du")
+		fs.du(arg.c_str());
+	else if (command == "tree")
+		fs.tree(arg.c_str());
+	else if (command == "compress")
+		fs.compress(arg.c_str());
+	else if (command == "snapshot")
+		fs.snapshot(arg.c_str());
+	else if (command == "rmsnap")
+		fs.rmsnap(arg.c_str());
+	else {
+		cout << "I got nothing\n";
+		return false;
+	}
+	return true;
+}
+
+// True if command changes the file system, which a replica refuses.
+bool changes_files(const string &command) {
+	static const char *changing[] = {
+		"mkdir", "rmdir", "create", "append", "rm", "happend", "mv", "cp",
+		"rmr", "snapshot", "rmsnap", "truncate"
+	};
+	for (const char *c : changing){
+		if (command == c)
+			return true;
+	}
+	return false;
+}
+
+// Runs one command on the volume it routes to. The first command run
+// locks its volume and begins a journal transaction there, which held
+// then names; the caller commits it. A command on another volume than held
+// is refused. Returns false, sending nothing, if the command is unknown.
+bool run(FileSys &fs, const string &command, string arg, string arg2, BasicFileSys *&held) {
+	if (primary && changes_files(command)){
+		fs.respond("515 Read-only replica", "");
+		return true;
+	}
+	BasicFileSys *disk = fs.route(command, arg, arg2);
+	if (!disk)
+		return true;
+	if (held && disk != held){
+		fs.respond("513 Not within one volume", "");
+		return true;
+	}
+	if (!held){
+		held = disk;
+		disk->lock();
+		disk->begin();
+	}
+	fs.check_cwd();
+	if (!dispatch(fs, command, arg, arg2))
+		return false;
+	// what it read may have been corrupt, so its response can't be trusted
+	if (disk->checksum_failed())
+		fs.respond("516 Checksum mismatch", "");
+	return true;
+}
+
+// Runs the operations of a compound request in order, stopping at the
+// first that fails, as NFSv4 COMPOUND does. The response carries the
+// status of the last operation run, and the responses of every operation
+// run, in full, as its body. All of them must be on one volume, and sync,
+// which locks every volume, cannot be one. Each operation commits as a
+// journal transaction of its own, so a compound as long as it likes stays
+// journaled; a crash can leave its first operations done, each in full.
+void compound(FileSys &fs, const vector<string> &ops, BasicFileSys *&held) {
+	string command, arg, arg2;
+	string status = "511 Bad compound request";
+	string body;
+	for (size_t k = 0; k < ops.size(); k++){
+		parse_request(ops[k], command, arg, arg2);
+		if (command == "compound" || command == "sync" || !run(fs, command, arg, arg2, held)){
+			status = "511 Bad compound request";
+			break;
+		}
+		if (held){
+			held->commit();
+			held->begin();
+		}
+		string response = fs.take_response();
+		status = response.substr(0, response.find("\r\n"));
+		body.append(response);
+		if (fs.last_status() != 200)
+			break;
+	}
+	fs.respond(status, body);
+}
+
+// Serves one client connection until the client closes it. Commands from
+// all connections run one at a time under the lock of their volume, so
+// commands on different volumes run in parallel. A connection to the Unix
+// domain socket (local) may switch to shared memory.
+void serve(int sock, unsigned conn_id, const vector<Volume> *volumes, bool local) {
+	string buf;		// received bytes not yet handled
+	Channel chan(sock);
+	if (local && !chan.accept_local(sock, buf)){
+		chan.close();
+		return;
+	}
+
+    // mount the file system
+    FileSys fs;
+    fs.mount(chan, *volumes); //assume that sock is the new socket created 
+                          //for a TCP connection between the client and the server.   
+ 
+    //loop: get the command from the client and invoke the file
+    //system operation which returns the results or error messages back to the clinet
+    //until the client closes the TCP connection.
+	string req;
+	string command;
+	string arg;
+	string arg2;
+	vector<string> ops;	// operations of a compound request
+	long long arrival;
+	bool answered;		// a response was sent for the request
+	long long sent;		// bytes sent before the request
+	DiskStats io;		// disk I/O before the request
+	BasicFileSys *disk;	// volume locked for the request
+	unsigned int seq;	// journal transaction of the request
+	server_stats.connection_opened();
+	while(1){
+		if (!receive_line(chan, buf, req))
+			break;
+		arrival = now_ns();
+		parse_request(req, command, arg, arg2);
+		
+		// A compressed request, "z N" and N bytes, holds one or more
+		// request lines, which are handled as if they had been sent as is
+		if (command == "z"){
+			size_t len = strtoul(arg.c_str(), NULL, 10);
+			string packed, lines;
+			if (len > MAX_PACKED_SIZE || !receive_bytes(chan, buf, len, packed))
+				break;
+			long long start = now_ns();
+			bool unpacked = lz_decompress(packed.data(), len, lines, MAX_PACKED_SIZE);
+			server_stats.unpack_ns.fetch_add(now_ns() - start, memory_order_relaxed);
+			if (unpacked){
+				server_stats.unpacked.fetch_add(1, memory_order_relaxed);
+				server_stats.unpack_in.fetch_add(len, memory_order_relaxed);
+				server_stats.unpack_out.fetch_add(lines.length(), memory_order_relaxed);
+				buf.insert(0, lines);
+				continue;
+			}
+			sent = fs.bytes_sent();
+			fs.respond("512 Bad compressed request", "");
+			fs.send_response();
+			server_stats.record(OP_UNKNOWN, 512, now_ns() - arrival, req.length() + len,
+				fs.bytes_sent() - sent, 0, 0);
+			continue;
+		}
+		
+		// A replica asks to follow a volume; the connection carries the
+		// volume's changes from then on
+		if (command == "replicate"){
+			size_t v = 0;
+			while (v < volumes->size() && (*volumes)[v].name != arg)
+				v++;
+			if (v < volumes->size()){
+				ship_changes(chan, (*volumes)[v].disk);
+				break;
+			}
+			fs.respond("503 File does not exist", "");
+			fs.send_response();
+			continue;
+		}
+		
+		// A compound request is followed by its operations, one per line.
+		// One with too many is read in full but refused.
+		ops.clear();
+		if (command == "compound"){
+			int count = atoi(arg.c_str());
+			string op;
+			bool connected = true;
+			for (int k = 0; k < count && connected; k++){
+				connected = receive_line(chan, buf, op);
+				ops.push_back(op);
+				req.append(op);
+			}
+			if (!connected)
+				break;
+			if (count > MAX_COMPOUND_OPS)
+				ops.clear();
+		}
+		
+		// Execute Command as one journal transaction on its volume, a
+		// compound as one per operation
+		sent = fs.bytes_sent();
+		io = Disk::stats;
+		disk = NULL;
+		if (command == "compound"){
+			compound(fs, ops, disk);
+			answered = true;
+		}
+		else
+			answered = run(fs, command, arg, arg2, disk);
+		if (disk){
+			seq = disk->commit();
+			disk->unlock();
+			
+			// Reply once the transaction is durable; waiting outside the
+			// lock lets other commands join the same fdatasync
+			disk->wait_durable(seq);
+		}
+		fs.send_response();
+		
+		long long service = now_ns() - arrival;
+		int status = answered ? fs.last_status() : 0;
+		server_stats.record(Stats::op(command), status, service, req.length(),
+			fs.bytes_sent() - sent, Disk::stats.reads - io.reads,
+			Disk::stats.writes - io.writes);
+		if (trace)
+			trace->record(conn_id, arrival, status, service, req.substr(0, req.length() - 2));
+	}
+	fs.unmount();
+	server_stats.connection_closed();
+}
 
-	sockaddr_storage their_addr;
-    socklen_t addr_size;
+// Creates a TCP socket listening on port. Exits on failure.
+int listen_on(const char *port) {
 	addrinfo hints, *res, *p;
-    int sockfd, sock;
+    int sockfd;
 	int yes = 1;
 
     memset(&hints, 0, sizeof hints);
@@ -36,7 +389,7 @@ int main(int argc, char* argv[]) {
     hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
 	
 
-    if(int rv = getaddrinfo(NULL, argv[1], &hints, &res)){
+    if(int rv = getaddrinfo(NULL, port, &hints, &res)){
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
 		exit(1);
 	}
@@ -64,119 +417,196 @@ int main(int argc, char* argv[]) {
 
         break;
     }
+	if (p == NULL) {
+		fprintf(stderr, "server: failed to bind port %s\n", port);
+		exit(1);
+	}
 	sockaddr_in* addr = (sockaddr_in*) res->ai_addr;
-	cout << "Address: " << inet_ntoa((in_addr)addr->sin_addr) << endl;
+	cout << "Address: " << inet_ntoa((in_addr)addr->sin_addr) << ":" << port << endl;
 	freeaddrinfo(res);
-    if (listen(sockfd, 1) == -1){
+    if (listen(sockfd, SOMAXCONN) == -1){
 		perror("listen");
 		exit(1);
 	}
+	return sockfd;
+}
 
-    // now accept an incoming connection:
-    addr_size = sizeof their_addr;
-    sock = accept(sockfd, (struct sockaddr *)&their_addr, &addr_size);
-	if (sock == -1){
-		perror("socket");
-		exit(errno);
+// Creates a Unix domain socket listening at path, replacing any old one.
+// Exits on failure.
+int listen_local(const char *path) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path){
+		fprintf(stderr, "server: socket path %s too long\n", path);
+		exit(1);
 	}
-	
-    //close the listening socket
-	close(sockfd);
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd == -1 || bind(sockfd, (sockaddr *) &addr, sizeof addr) == -1 ||
+	    listen(sockfd, SOMAXCONN) == -1){
+		perror("server: unix socket");
+		exit(1);
+	}
+	cout << "Address: unix:" << path << " (shm:" << path << " for shared memory)" << endl;
+	return sockfd;
+}
 
-    // mount the file system
-    FileSys fs;
-    fs.mount(sock); //assume that sock is the new socket created 
-                    //for a TCP connection between the client and the server.   
- 
-    //loop: get the command from the client and invoke the file
-    //system operation which returns the results or error messages back to the clinet
-    //until the client closes the TCP connection.
-	int req_len = 200;
-	char* req;
-	string command;
-	string arg;
-	string arg2;
-	int numbytes;
-	int x, i;
+atomic<unsigned> next_conn(0);	// id of the next connection
+
+// Saves the volumes kept in memory every secs seconds, forever.
+void save_loop(const vector<Volume> *volumes, int secs) {
 	while(1){
-		// Receive Message
-		req = new char(req_len);
-		numbytes = 0;
-		while(req[-2] != '\r' && req[-1] != '\n'){
-			x = recv(sock, (void*) req, (size_t) req_len, 0);
-			if (x == -1){
-				perror("recv");
-			}
-			// Client Disconnected
-			else if (!x){
-				fs.unmount();
-				close(sock);
-				exit(0);
-			}
-			req += x;
-			numbytes += x;
-		}
-		i=0;
-		req -= numbytes;
-		
-		// Get Command
-		while((req[i] != ' ') && (req[i] != '\r')){
-			command.append(1, req[i]);
-			i++;
-		}
-		// Get Argument 1
-		if (req[i] == ' ')
-			i++;
-		while((req[i] != ' ') && (req[i] != '\r')){
-			arg.append(1, req[i]);
-			i++;
+		this_thread::sleep_for(chrono::seconds(secs));
+		for (size_t i = 0; i < volumes->size(); i++)
+			(*volumes)[i].disk->save();
+	}
+}
+
+// Accepts connections on sockfd, each served by its own thread.
+void accept_loop(int sockfd, bool local, const vector<Volume> *volumes) {
+	while(1){
+		int sock = accept(sockfd, NULL, NULL);
+		if (sock == -1){
+			if (errno != EINTR)
+				perror("accept");
+			continue;
 		}
-		// Get Argument 2
-		if (req[i] == ' ')
-			i++;
-		while(req[i] != '\r'){
-			arg2.append(1, req[i]);
-			i++;
+		thread(serve, sock, next_conn++, volumes, local).detach();
+	}
+}
+
+int main(int argc, char* argv[]) {
+	const char *trace_file = NULL;
+	const char *metrics_port = NULL;
+	const char *local_path = NULL;
+	int save_secs = 0;		// keep volumes in memory, saving this often (-M)
+	bool verify = true;		// check blocks read against their checksums (-n turns off)
+	bool dedup = false;		// share full data blocks with the same contents (-d)
+	vector<string> names, images;	// volumes given with -v name=image
+	bool bad_args = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:m:u:v:r:M:nd")) != -1){
+		if (opt == 't')
+			trace_file = optarg;
+		else if (opt == 'M'){
+			save_secs = atoi(optarg);
+			bad_args = bad_args || save_secs <= 0;
 		}
-		
-		// Execute Command
-		if (command == "mkdir")
-			fs.mkdir(arg.c_str());
-		else if (command == "ls")
-			fs.ls();
-		else if (command == "cd")
-			fs.cd(arg.c_str());
-		else if (command == "home")
-			fs.home();
-		else if (command == "rmdir")
-			fs.rmdir(arg.c_str());
-		else if (command == "create")
-			fs.create(arg.c_str());
-		else if (command == "append")
-			fs.append(arg.c_str(), arg2.c_str());
-		else if (command == "stat")
-			fs.stat(arg.c_str());
-		else if (command == "cat")
-			fs.cat(arg.c_str());
-		else if (command == "head") {
-			fs.head(arg.c_str(), stoul(arg2));
+		else if (opt == 'r')
+			primary = optarg;
+		else if (opt == 'n')
+			verify = false;
+		else if (opt == 'd')
+			dedup = true;
+		else if (opt == 'm')
+			metrics_port = optarg;
+		else if (opt == 'u')
+			local_path = optarg;
+		else if (opt == 'v'){
+			const char *eq = strchr(optarg, '=');
+			string name = eq ? string(optarg, eq - optarg) : "";
+			bad_args = bad_args || name.empty() || name.find('/') != string::npos || !eq[1] ||
+			           find(names.begin(), names.end(), name) != names.end();
+			if (eq){
+				names.push_back(name);
+				images.push_back(eq + 1);
+			}
 		}
-		else if (command == "rm")
-			fs.rm(arg.c_str());
 		else
-			cout << "I got nothing\n";
-		
-		delete [] req;
-		command.clear();
-		arg.clear();
-		arg2.clear();
+			bad_args = true;
+	}
+	if (bad_args || optind != argc - 1 || (int) names.size() > MAX_VOLUMES) {
+		cout << "Usage: ./nfsserver [-t trace-file] [-m metrics-port] [-u socket-path] [-v name=image]... [-r primary] [-M seconds] [-n] [-d] port#\n";
+		cout << "Each -v mounts an image as volume /name (at most " << MAX_VOLUMES << "); the default is one volume, DISK\n";
+		cout << "With -r, each volume is a read-only replica of the volume of the same name at primary (server:port)\n";
+		cout << "With -M, volumes are kept in memory and saved to their images every so many seconds, on sync and on exit\n";
+		cout << "With -n, blocks read are not checked against their checksums\n";
+		cout << "With -d, full data blocks written with the contents of a block already on the volume share it\n";
+        return -1;
+    }
+	if (names.empty()){
+		names.push_back("DISK");
+		images.push_back("DISK");
 	}
 
-    //unmout the file system
-    fs.unmount();
-	
-	signal(SIGTERM, (sighandler_t) cleanExit);
-	signal(SIGINT, (sighandler_t) cleanExit);
+    int sockfd;
+
+	sockfd = listen_on(argv[optind]);
+
+	// a client that disconnects mid-response must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	// SIGTERM and SIGINT are taken by sigwait below, once the server is
+	// up; every thread inherits them blocked
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    // mount the volumes shared by every connection, in parallel since
+	// each may have a journal to replay
+	vector<Volume> volumes;
+	vector<thread> mounting;
+	vector<string> cache_names;
+	for (size_t i = 0; i < names.size(); i++){
+		Volume vol = { names[i], new BasicFileSys };
+		vol.disk->verify = verify;
+		vol.disk->dedup = dedup;
+		volumes.push_back(vol);
+		mounting.push_back(thread(&BasicFileSys::mount, vol.disk, images[i].c_str(), save_secs > 0));
+		cache_names.push_back("dentry " + names[i]);
+	}
+	for (size_t i = 0; i < mounting.size(); i++)
+		mounting[i].join();
+	for (size_t i = 0; volumes.size() > 1 && i < volumes.size(); i++)
+		volumes[i].disk->dentries.stats.name = cache_names[i].c_str();
+
+	// a replica keeps each volume in step with the primary's
+	for (size_t i = 0; primary && i < volumes.size(); i++){
+		ReplicaStats *stats = new ReplicaStats(volumes[i].name.c_str());
+		server_stats.add_replica(stats);
+		thread(replicate, string(primary), volumes[i].name, volumes[i].disk, stats).detach();
+	}
+
+	// start recording requests
+	TraceWriter writer;
+	if (trace_file){
+		if (!writer.open(trace_file)){
+			perror(trace_file);
+			exit(1);
+		}
+		trace = &writer;
+	}
+
+	// serve Prometheus scrapes on their own port and thread
+	if (metrics_port)
+		thread(serve_metrics, listen_on(metrics_port), &volumes).detach();
+
+	if (save_secs)
+		thread(save_loop, &volumes, save_secs).detach();
+
+    // now accept incoming connections, each served by its own thread;
+	// local clients connect to the Unix domain socket
+	if (local_path)
+		thread(accept_loop, listen_local(local_path), true, &volumes).detach();
+	thread(accept_loop, sockfd, false, &volumes).detach();
+
+	// serve until told to stop
+	int sig;
+	sigwait(&stop_signals, &sig);
+	cout << "Stopping on " << strsignal(sig) << endl;
+
+    //unmout the file system: once every volume is locked no command is
+	//running, and none starts before the process exits
+	for (size_t i = 0; i < volumes.size(); i++)
+		volumes[i].disk->lock();
+	for (size_t i = 0; i < volumes.size(); i++)
+		volumes[i].disk->unmount();
+	writer.close();
+	close(sockfd);
 
     return 0;
 }
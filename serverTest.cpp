@@ -15,24 +15,39 @@ int main(int argc, char* argv[]) {
     int sock = 1; //change this line when necessary!
 
     //mount the file system
+    BasicFileSys disk;
+    disk.mount();
     FileSys fs;
-    fs.mount(sock); //assume that sock is the new socket created 
+    fs.mount(sock, &disk); //assume that sock is the new socket created 
                     //for a TCP connection between the client and the server.   
  
-    fs.mkdir("dir1");
-	fs.cd("dir1");
-	fs.create("file1");
-	fs.append("file1", "Hello");
-	fs.ls();
-	fs.cat("file1");
-	fs.head("file1", 2);
-	fs.stat("file1");
-	fs.home();
-	fs.ls();
-	fs.stat("dir1");
+    fs.mkdir("dir1"); fs.send_response();
+	fs.cd("dir1"); fs.send_response();
+	fs.create("file1"); fs.send_response();
+	fs.append("file1", "Hello"); fs.send_response();
+	fs.ls(); fs.send_response();
+	fs.cat("file1"); fs.send_response();
+	fs.head("file1", 2); fs.send_response();
+	fs.stat("file1"); fs.send_response();
+	fs.home(); fs.send_response();
+	fs.ls(); fs.send_response();
+	fs.stat("dir1"); fs.send_response();
+
+	// "." and ".." in paths
+	fs.mkdir("dir2"); fs.send_response();
+	fs.create("./file2"); fs.send_response();
+	fs.mv("./file2", "dir1/../dir2/file2"); fs.send_response();
+	fs.ls("dir1/../dir2"); fs.send_response();
+	fs.cd("dir2/./.."); fs.send_response();
+	fs.ls("."); fs.send_response();
+	fs.cd("dir1"); fs.send_response();
+	fs.cat("../dir1/./file1"); fs.send_response();
+	fs.cd("../../.."); fs.send_response();
+	fs.ls(); fs.send_response();
 
     //unmout the file system
     fs.unmount();
+    disk.unmount();
 
     return 0;
 }
\ No newline at end of file